@@ -0,0 +1,277 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright 2022 Google, LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/sort.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>
+#include <asm/local.h>
+#include "google_bms.h"
+
+/*
+ * Binary event journal.
+ *
+ * Records are fixed size (64 bytes) and hold an event id, a timestamp and
+ * up to GBMS_JOURNAL_MAX_ARGS integer arguments. Each CPU owns a ring and
+ * claims slots with local_inc_return() so writers never take a lock and never
+ * format a string. The event id selects a printk style format string from a
+ * table that the caller registers at compile time; records are formatted
+ * only when the journal is read.
+ */
+
+#define GBMS_JOURNAL_DEFAULT_ENTRIES	256
+
+struct gbms_journal_rec {
+	u64 ts;
+	u32 seq;	/* 0 while the slot is being written */
+	u16 evid;
+	u8 nargs;
+	u8 cpu;
+	s32 args[GBMS_JOURNAL_MAX_ARGS];
+};
+
+struct gbms_journal_cpu {
+	local_t head;
+	struct gbms_journal_rec *recs;
+};
+
+struct gbms_journal {
+	const char *name;
+	const char * const *fmts;
+	int nfmts;
+	u32 mask;
+	struct gbms_journal_cpu __percpu *cpu;
+};
+
+void gbms_journal_logv(struct gbms_journal *jl, u16 evid, int nargs,
+		       const s32 *args)
+{
+	struct gbms_journal_cpu *jc;
+	struct gbms_journal_rec *rec;
+	unsigned long idx;
+	int cpu;
+
+	if (!jl || evid >= jl->nfmts)
+		return;
+	if (nargs > GBMS_JOURNAL_MAX_ARGS)
+		nargs = GBMS_JOURNAL_MAX_ARGS;
+
+	cpu = get_cpu();
+	jc = per_cpu_ptr(jl->cpu, cpu);
+	idx = local_inc_return(&jc->head) - 1;
+	rec = &jc->recs[idx & jl->mask];
+
+	WRITE_ONCE(rec->seq, 0);
+	smp_wmb();
+
+	rec->ts = local_clock();
+	rec->evid = evid;
+	rec->nargs = nargs;
+	rec->cpu = cpu;
+	memcpy(rec->args, args, nargs * sizeof(*args));
+
+	smp_wmb();
+	WRITE_ONCE(rec->seq, (u32)idx + 1);
+	put_cpu();
+}
+EXPORT_SYMBOL_GPL(gbms_journal_logv);
+
+struct gbms_journal *gbms_journal_create(const char *name,
+					 const char * const *fmts, int nfmts,
+					 int entries)
+{
+	struct gbms_journal *jl;
+	int cpu;
+
+	if (!name || !fmts || nfmts <= 0 || nfmts > U16_MAX)
+		return ERR_PTR(-EINVAL);
+
+	if (entries <= 0)
+		entries = GBMS_JOURNAL_DEFAULT_ENTRIES;
+	entries = roundup_pow_of_two(entries);
+
+	jl = kzalloc(sizeof(*jl), GFP_KERNEL);
+	if (!jl)
+		return ERR_PTR(-ENOMEM);
+
+	jl->name = name;
+	jl->fmts = fmts;
+	jl->nfmts = nfmts;
+	jl->mask = entries - 1;
+
+	jl->cpu = alloc_percpu(struct gbms_journal_cpu);
+	if (!jl->cpu)
+		goto error_exit;
+
+	for_each_possible_cpu(cpu) {
+		struct gbms_journal_cpu *jc = per_cpu_ptr(jl->cpu, cpu);
+
+		local_set(&jc->head, 0);
+		jc->recs = kcalloc(entries, sizeof(*jc->recs), GFP_KERNEL);
+		if (!jc->recs)
+			goto error_exit;
+	}
+
+	return jl;
+
+error_exit:
+	gbms_journal_destroy(jl);
+	return ERR_PTR(-ENOMEM);
+}
+EXPORT_SYMBOL_GPL(gbms_journal_create);
+
+void gbms_journal_destroy(struct gbms_journal *jl)
+{
+	int cpu;
+
+	if (IS_ERR_OR_NULL(jl))
+		return;
+
+	if (jl->cpu) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(jl->cpu, cpu)->recs);
+		free_percpu(jl->cpu);
+	}
+
+	kfree(jl);
+}
+EXPORT_SYMBOL_GPL(gbms_journal_destroy);
+
+/* ------------------------------------------------------------------------ */
+
+static int gbms_journal_rec_cmp(const void *a, const void *b)
+{
+	const struct gbms_journal_rec *ra = a, *rb = b;
+
+	if (ra->ts == rb->ts)
+		return 0;
+	return ra->ts < rb->ts ? -1 : 1;
+}
+
+/* copy the valid records of all CPUs in @snap, return the count */
+static int gbms_journal_snapshot(struct gbms_journal_rec *snap,
+				 const struct gbms_journal *jl,
+				 unsigned long *lost)
+{
+	const unsigned long entries = jl->mask + 1;
+	int cpu, count = 0;
+
+	*lost = 0;
+
+	for_each_possible_cpu(cpu) {
+		struct gbms_journal_cpu *jc = per_cpu_ptr(jl->cpu, cpu);
+		const unsigned long head = local_read(&jc->head);
+		unsigned long idx = head > entries ? head - entries : 0;
+
+		*lost += idx;
+
+		for ( ; idx < head; idx++) {
+			const struct gbms_journal_rec *rec =
+					&jc->recs[idx & jl->mask];
+			u32 seq;
+
+			seq = READ_ONCE(rec->seq);
+			smp_rmb();
+			snap[count] = *rec;
+			smp_rmb();
+
+			/* torn or overwritten while copying */
+			if (seq == 0 || seq != READ_ONCE(rec->seq))
+				continue;
+
+			count++;
+		}
+	}
+
+	sort(snap, count, sizeof(*snap), gbms_journal_rec_cmp, NULL);
+	return count;
+}
+
+static void gbms_journal_show_rec(struct seq_file *s,
+				  const struct gbms_journal *jl,
+				  const struct gbms_journal_rec *rec)
+{
+	s32 a[GBMS_JOURNAL_MAX_ARGS] = { 0 };
+	u32 rem_nsec;
+	u64 sec;
+
+	memcpy(a, rec->args, rec->nargs * sizeof(*a));
+	sec = div_u64_rem(rec->ts, NSEC_PER_SEC, &rem_nsec);
+
+	seq_printf(s, "[%5llu.%06u] ", sec, rem_nsec / NSEC_PER_USEC);
+	if (rec->evid >= jl->nfmts || !jl->fmts[rec->evid]) {
+		seq_printf(s, "<evid=%u>\n", rec->evid);
+		return;
+	}
+
+	/* format strings take only integer arguments */
+	seq_printf(s, jl->fmts[rec->evid], a[0], a[1], a[2], a[3], a[4],
+		   a[5], a[6], a[7], a[8], a[9], a[10], a[11]);
+	seq_putc(s, '\n');
+}
+
+static int gbms_journal_show(struct seq_file *s, void *data)
+{
+	const struct gbms_journal *jl = s->private;
+	const size_t size = (jl->mask + 1) * num_possible_cpus();
+	struct gbms_journal_rec *snap;
+	unsigned long lost;
+	int i, count;
+
+	snap = vmalloc(array_size(size, sizeof(*snap)));
+	if (!snap)
+		return -ENOMEM;
+
+	count = gbms_journal_snapshot(snap, jl, &lost);
+
+	seq_printf(s, "# %s: %d records, %lu overwritten\n",
+		   jl->name, count, lost);
+	for (i = 0; i < count; i++)
+		gbms_journal_show_rec(s, jl, &snap[i]);
+
+	vfree(snap);
+	return 0;
+}
+
+static int gbms_journal_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gbms_journal_show, inode->i_private);
+}
+
+static const struct file_operations gbms_journal_fops = {
+	.owner		= THIS_MODULE,
+	.open		= gbms_journal_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* decoded to text only on read */
+void gbms_journal_debugfs(struct gbms_journal *jl, struct dentry *parent)
+{
+	if (IS_ERR_OR_NULL(jl) || IS_ERR_OR_NULL(parent))
+		return;
+
+	debugfs_create_file(jl->name, 0400, parent, jl, &gbms_journal_fops);
+}
+EXPORT_SYMBOL_GPL(gbms_journal_debugfs);
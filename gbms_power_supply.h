@@ -88,6 +88,14 @@ enum gbms_property {
 	GBMS_PROP_BATTERY_AGE,		/* GBMS time in field */
 	GBMS_PROP_CAPACITY_FADE_RATE,	/* GBMS capaciy fade rate */
 	GBMS_PROP_CHARGE_FULL_ESTIMATE,	/* GBMS google_capacity */
+	GBMS_PROP_CHARGE_FULL_ESTIMATE_CONF, /* GBMS google_capacity, 0-100 */
+};
+
+/* GBMS_PROP_BATT_CE_CTRL values, driven by the charger state */
+enum gbms_ce_ctrl {
+	GBMS_CE_CTRL_STOP = 0,	/* disconnect: close all windows */
+	GBMS_CE_CTRL_START,	/* connect: open the windows */
+	GBMS_CE_CTRL_EOC,	/* charge done: settle and close the full window */
 };
 
 union gbms_propval {
@@ -30,6 +30,8 @@
 #include <linux/module.h>
 #include <linux/seq_file.h> /* seq_read, seq_lseek, single_release */
 #include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include "google_bms.h"
 
 struct gbms_storage_provider {
@@ -868,16 +870,22 @@ GBMS_DEBUG_ATTRIBUTE(gbms_providers_export_ops, NULL, debug_export_tag);
 
 /* ------------------------------------------------------------------------ */
 
+/* minor 0 is the text device, minor 1 the binary snapshot */
+#define GBMS_STORAGE_DEV_MINOR_BIN	1
+#define GBMS_STORAGE_DEV_MINORS		2
+
 struct gbms_storage_device {
 	struct gbms_cache_entry entry;
 	loff_t index;
 	loff_t count;
 
+	/* iterator data in the provider is shared by all readers */
 	struct mutex gdev_lock;
 	int hcmajor;
 	struct cdev hcdev;
 	struct class *hcclass;
 	bool available;
+	bool available_bin;
 	bool added;
 
 	void (*show_fn)(struct seq_file *s, const u8 *data, size_t count);
@@ -895,6 +903,9 @@ static void *ct_seq_start(struct seq_file *s, loff_t *pos)
 		(struct gbms_storage_device_seq *)s->private;
 	struct gbms_storage_device *gdev = gdev_seq->gbms_device;
 
+	/* released in ct_seq_stop() */
+	mutex_lock(&gdev->gdev_lock);
+
 	ret = gbms_storage_read_data(gdev->entry.tag, NULL, 0, 0);
 	if (ret < 0) {
 		gbms_tag_cstr_t buff;
@@ -942,6 +953,8 @@ static void ct_seq_stop(struct seq_file *s, void *v)
 		pr_err("cannot free %s iterator data (%d)\n",
 		       tag2cstr(buff, gdev->entry.tag), ret);
 	}
+
+	mutex_unlock(&gdev->gdev_lock);
 }
 
 static int ct_seq_show(struct seq_file *s, void *v)
@@ -970,12 +983,149 @@ static const struct seq_operations ct_seq_ops = {
 	.show  = ct_seq_show
 };
 
+/* binary snapshot of all the records, allocated on open */
+struct gbms_storage_device_snap {
+	void *data;
+	size_t size;
+};
+
+static struct gbms_storage_device_snap *
+gbms_storage_dev_snapshot(struct gbms_storage_device *gdev)
+{
+	const size_t rec_size = gdev->entry.count;
+	struct gbms_storage_device_snap *snap;
+	struct gbms_storage_hist_hdr *hdr;
+	gbms_tag_cstr_t buff;
+	int ret, i, count;
+	u8 *recs;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap)
+		return ERR_PTR(-ENOMEM);
+
+	mutex_lock(&gdev->gdev_lock);
+
+	ret = gbms_storage_read_data(gdev->entry.tag, NULL, 0, 0);
+	if (ret < 0) {
+		pr_err("cannot init %s iterator data (%d)\n",
+		       tag2cstr(buff, gdev->entry.tag), ret);
+		goto exit_unlock;
+	}
+
+	count = ret;
+	snap->data = vmalloc_user(PAGE_ALIGN(sizeof(*hdr) + count * rec_size));
+	if (!snap->data) {
+		ret = -ENOMEM;
+		goto exit_done;
+	}
+
+	recs = snap->data + sizeof(*hdr);
+	for (i = 0; i < count; i++) {
+		ret = gbms_storage_read_data(gdev->entry.tag,
+					     &recs[i * rec_size], rec_size, i);
+		if (ret < 0)
+			break;
+	}
+
+	hdr = snap->data;
+	hdr->magic = GBMS_STORAGE_HIST_MAGIC;
+	hdr->version = GBMS_STORAGE_HIST_VERSION;
+	hdr->hdr_size = sizeof(*hdr);
+	hdr->tag = gdev->entry.tag;
+	hdr->rec_size = rec_size;
+	hdr->rec_count = i;
+	hdr->data_size = sizeof(*hdr) + i * rec_size;
+	snap->size = hdr->data_size;
+	ret = 0;
+
+exit_done:
+	if (gbms_storage_read_data(gdev->entry.tag, NULL, 0,
+				   GBMS_STORAGE_INDEX_INVALID) < 0)
+		pr_err("cannot free %s iterator data\n",
+		       tag2cstr(buff, gdev->entry.tag));
+exit_unlock:
+	mutex_unlock(&gdev->gdev_lock);
+
+	if (ret < 0) {
+		vfree(snap->data);
+		kfree(snap);
+		return ERR_PTR(ret);
+	}
+
+	return snap;
+}
+
+static int gbms_storage_bin_open(struct inode *inode, struct file *file)
+{
+	struct gbms_storage_device *gdev =
+		container_of(inode->i_cdev, struct gbms_storage_device, hcdev);
+	struct gbms_storage_device_snap *snap;
+
+	snap = gbms_storage_dev_snapshot(gdev);
+	if (IS_ERR(snap))
+		return PTR_ERR(snap);
+
+	file->private_data = snap;
+	return 0;
+}
+
+static ssize_t gbms_storage_bin_read(struct file *file, char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct gbms_storage_device_snap *snap = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, snap->data,
+				       snap->size);
+}
+
+static loff_t gbms_storage_bin_llseek(struct file *file, loff_t offset,
+				      int whence)
+{
+	struct gbms_storage_device_snap *snap = file->private_data;
+
+	return fixed_size_llseek(file, offset, whence, snap->size);
+}
+
+static int gbms_storage_bin_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct gbms_storage_device_snap *snap = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, snap->data, vma->vm_pgoff);
+}
+
+static int gbms_storage_bin_release(struct inode *inode, struct file *file)
+{
+	struct gbms_storage_device_snap *snap = file->private_data;
+
+	vfree(snap->data);
+	kfree(snap);
+	return 0;
+}
+
+static const struct file_operations hdev_bin_fops = {
+	.open = gbms_storage_bin_open,
+	.owner = THIS_MODULE,
+	.read = gbms_storage_bin_read,
+	.llseek = gbms_storage_bin_llseek,
+	.mmap = gbms_storage_bin_mmap,
+	.release = gbms_storage_bin_release,
+};
+
 static int gbms_storage_dev_open(struct inode *inode, struct file *file)
 {
 	int ret;
 	struct gbms_storage_device *gdev =
 		container_of(inode->i_cdev, struct gbms_storage_device, hcdev);
 
+	if (iminor(inode) == GBMS_STORAGE_DEV_MINOR_BIN) {
+		replace_fops(file, &hdev_bin_fops);
+		return file->f_op->open(inode, file);
+	}
+
 	ret = seq_open(file, &ct_seq_ops);
 	if (ret == 0) {
 		struct seq_file *seq = file->private_data;
@@ -1013,12 +1163,17 @@ void gbms_storage_cleanup_device(struct gbms_storage_device *gdev)
 {
 	if (gdev->added)
 		cdev_del(&gdev->hcdev);
+	if (gdev->available_bin)
+		device_destroy(gdev->hcclass,
+			       MKDEV(MAJOR(gdev->hcmajor),
+				     GBMS_STORAGE_DEV_MINOR_BIN));
 	if (gdev->available)
 		device_destroy(gdev->hcclass, gdev->hcmajor);
 	if (gdev->hcclass)
 		class_destroy(gdev->hcclass);
 	if (gdev->hcmajor != -1)
-		unregister_chrdev_region(gdev->hcmajor, 1);
+		unregister_chrdev_region(gdev->hcmajor,
+					 GBMS_STORAGE_DEV_MINORS);
 	kfree(gdev);
 }
 EXPORT_SYMBOL_GPL(gbms_storage_cleanup_device);
@@ -1032,7 +1187,8 @@ static int gbms_storage_device_init(struct gbms_storage_device *gdev,
 	gdev->hcmajor = -1;
 
 	/* cat /proc/devices */
-	if (alloc_chrdev_region(&gdev->hcmajor, 0, 1, name) < 0)
+	if (alloc_chrdev_region(&gdev->hcmajor, 0, GBMS_STORAGE_DEV_MINORS,
+				name) < 0)
 		goto no_gdev;
 	/* ls /sys/class */
 	gdev->hcclass = class_create(THIS_MODULE, name);
@@ -1044,8 +1200,19 @@ static int gbms_storage_device_init(struct gbms_storage_device *gdev,
 		goto no_gdev;
 
 	gdev->available = true;
+
+	/* ls /dev/ binary snapshot, pread and mmap */
+	hcdev = device_create(gdev->hcclass, NULL,
+			      MKDEV(MAJOR(gdev->hcmajor),
+				    GBMS_STORAGE_DEV_MINOR_BIN),
+			      NULL, "%s_bin", name);
+	if (IS_ERR_OR_NULL(hcdev))
+		pr_warn("cannot create %s_bin\n", name);
+	else
+		gdev->available_bin = true;
+
 	cdev_init(&gdev->hcdev, &hdev_fops);
-	if (cdev_add(&gdev->hcdev, gdev->hcmajor, 1) == -1)
+	if (cdev_add(&gdev->hcdev, gdev->hcmajor, GBMS_STORAGE_DEV_MINORS) == -1)
 		goto no_gdev;
 
 	gdev->added = true;
@@ -1129,6 +1296,7 @@ static struct gbee_data {
 	struct nvmem_device *bee_nvram;
 
 	int lotr_version;
+	u32 page_size;
 } bee_data;
 
 struct delayed_work bee_work;
@@ -1173,7 +1341,8 @@ static void gbee_probe_work(struct work_struct *work)
 	}
 
 	/* TODO: use nvram cells to resolve GBMS_TAGS */
-	ret = gbee_register_device(beed->bee_name, beed->lotr_version, bee_nvram);
+	ret = gbee_register_device(beed->bee_name, beed->lotr_version,
+				   beed->page_size, bee_nvram);
 	if (ret < 0) {
 		pr_err("gbee %s ERROR %d\n", beed->bee_name, ret);
 
@@ -1193,6 +1362,7 @@ static void gbee_probe_work(struct work_struct *work)
 static void gbee_destroy(struct gbee_data *beed)
 {
 	gbms_storage_offline(beed->bee_name, true);
+	gbee_destroy_device();
 	nvmem_device_put(beed->bee_nvram);
 	kfree(beed->bee_name);
 }
@@ -1299,6 +1469,12 @@ static int __init gbms_storage_init(void)
 			bee_data.lotr_version = 0xff;
 
 		pr_info("LOTR: %x\n", bee_data.lotr_version);
+
+		/* 0 is the EEPROM driver default */
+		ret = of_property_read_u32(node, "google,eeprom-page-size",
+					   &bee_data.page_size);
+		if (ret < 0)
+			bee_data.page_size = 0;
 	}
 
 	gbms_storage_init_done = true;
@@ -172,7 +172,8 @@ struct nvmem_device;
 #if IS_ENABLED(CONFIG_GOOGLE_BEE)
 
 /* defaults */
-extern int gbee_register_device(const char *name, int lotr, struct nvmem_device *nvram);
+extern int gbee_register_device(const char *name, int lotr, u32 page_size,
+				struct nvmem_device *nvram);
 extern void gbee_destroy_device(void);
 
 /* version 1 */
@@ -184,7 +185,8 @@ extern int gbee_storage_info(gbms_tag_t tag, size_t *addr, size_t *count, void *
 
 #else
 
-static inline int gbee_register_device(const char *name,
+static inline int gbee_register_device(const char *name, int lotr,
+				       u32 page_size,
 				       struct nvmem_device *nvram)
 { return -ENODEV; }
 
@@ -220,6 +222,24 @@ extern int gbms_storage_flush_all(void);
 struct gbms_storage_device;
 extern struct gbms_storage_device *
 gbms_storage_create_device(const char *name, gbms_tag_t tag);
+
+/*
+ * /dev/<name>_bin serves a snapshot of all the records taken on open with
+ * read(), pread() and mmap(): a struct gbms_storage_hist_hdr followed by
+ * rec_count records of rec_size bytes each.
+ */
+#define GBMS_STORAGE_HIST_MAGIC		0x53494847	/* GHIS */
+#define GBMS_STORAGE_HIST_VERSION	1
+
+struct gbms_storage_hist_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t hdr_size;
+	uint32_t tag;
+	uint32_t rec_size;
+	uint32_t rec_count;
+	uint32_t data_size;	/* header and records */
+} __packed;
 extern void gbms_storage_cleanup_device(struct gbms_storage_device *gdev);
 
 
@@ -83,6 +83,10 @@
 #define BHI_NEED_REP_THRESHOLD_DEFAULT	70
 #define BHI_CCBIN_INDEX_LIMIT		90
 #define BHI_ALGO_FULL_HEALTH		10000
+/* minimum google_capacity confidence used in the capacity index */
+#define BHI_CE_CONF_MIN			75
+#define BHI_AGE_REFRESH_S		3600
+#define BHI_SAVE_INTERVAL_S		3600
 #define BHI_ROUND_INDEX(index) \
 	(((index) + BHI_ALGO_FULL_HEALTH / 2) / BHI_ALGO_FULL_HEALTH * 100)
 
@@ -108,6 +112,8 @@ enum batt_health_ui {
 struct ssoc_uicurve {
 	qnum_t real;
 	qnum_t ui;
+	/* slope to the next point, see ssoc_uicurve_compile() */
+	qnum_t slope;
 };
 
 enum batt_rl_status {
@@ -174,12 +180,19 @@ struct batt_ssoc_state {
 	bool bd_trickle_dry_run;
 	u32 bd_trickle_reset_sec;
 
-	/* buff */
-	char ssoc_state_cstr[SSOC_STATE_BUF_SZ];
-
 	/* Save/Restore fake capacity */
 	bool save_soc_available;
 	u16 save_soc;
+
+	/* last line in the ssoc logbuffer, see dump_ssoc_log() */
+	int log_l;
+	int log_ct;
+	int log_rls;
+	ktime_t log_at;
+
+	/* set on a whole SOC% change, consumed by batt_cycle_count_update() */
+	int ccbin_soc;
+	bool ccbin_pending;
 };
 
 struct gbatt_ccbin_data {
@@ -187,6 +200,9 @@ struct gbatt_ccbin_data {
 	char cyc_ctr_cstr[GBMS_CCBIN_CSTR_SIZE];
 	struct mutex lock;
 	int prev_soc;
+	/* residency for BHI, under and over BHI_CCBIN_INDEX_LIMIT */
+	u32 res_under;
+	u32 res_over;
 };
 
 #define DEFAULT_RES_TEMP_LOW	350
@@ -194,17 +210,34 @@ struct gbatt_ccbin_data {
 #define DEFAULT_RAVG_SOC_LOW	5
 #define DEFAULT_RAVG_SOC_HIGH	75
 #define DEFAULT_RES_FILT_LEN	10
+#define RAVG_TEMP_BINS		4
+/* persist when the estimate moves more than this (percent) */
+#define RAVG_SAVE_DELTA_PCT	2
+
+/* exact integer sums: no loss of precision in the variance */
+struct batt_res_bin {
+	u32 count;
+	s64 sum;
+	s64 sum_sq;
+};
 
 struct batt_res {
 	bool estimate_requested;
 
-	/* samples */
+	/* samples, by temperature between res_temp_low and res_temp_high */
 	int sample_accumulator;
 	int sample_count;
+	struct batt_res_bin bins[RAVG_TEMP_BINS];
 
 	/* registers */
 	int filter_count;
 	int resistance_avg;
+	/* CI of the last session mean, same scale as resistance_avg */
+	int resistance_ci;
+
+	/* last values in storage */
+	int saved_avg;
+	int saved_count;
 
 	/* configuration */
 	int estimate_filter;
@@ -253,6 +286,15 @@ enum batt_aacr_state {
 	BATT_AACR_MAX,
 };
 
+enum batt_aacr_algo {
+	BATT_AACR_ALGO_DEFAULT = 0,	/* min of reference and FG capacity */
+	BATT_AACR_ALGO_REFERENCE_CAP,	/* reference capacity only */
+	BATT_AACR_ALGO_MAX,
+};
+
+/* cycles covered by the AACR fade table, interpolate after */
+#define AACR_TABLE_CYCLES_MAX	2048
+
 #define BATT_TEMP_RECORD_THR 3
 /* discharge saved after charge */
 #define SD_CHG_START 0
@@ -291,6 +333,7 @@ struct bhi_data
 	/* capacity metrics */
 	int capacity_design;		/* from the FG or from charge table */
 	int capacity_fade;		/* from the FG */
+	int capacity_estimate;		/* google_capacity, mAh, 0 if unsure */
 
 	/* impedance */
 	u32 act_impedance;		/* resistance, qualified */
@@ -303,6 +346,22 @@ struct bhi_data
 
 };
 
+/* inputs of the last BHI calculation, indices are recomputed on change */
+struct bhi_inputs
+{
+	bool valid;
+	int algo;
+	int capacity_design;
+	int capacity_fade;
+	int capacity_estimate;
+	u32 act_impedance;
+	u32 cur_impedance;		/* from bhi_health_get_impedance() */
+	int ccbin_index;
+	int cycle_count;
+	int marginal_threshold;
+	int need_rep_threshold;
+};
+
 struct health_data
 {
 	/* current algorithm */
@@ -323,6 +382,11 @@ struct health_data
 	/* current battery state */
 	struct bhi_data bhi_data;
 
+	/* change tracking for batt_bhi_stats_update() */
+	struct bhi_inputs bhi_inputs;
+	ktime_t bhi_age_time;
+	ktime_t bhi_save_time;
+	bool bhi_save_pending;
 };
 
 #define POWER_METRICS_MAX_DATA	50
@@ -357,6 +421,23 @@ struct csi_stats {
 };
 
 /* battery driver state */
+/*
+ * Adaptive charging plan: the TTF estimate at a SOC and the time when PAUSE
+ * must end to be full by the deadline. msc_logic_health() re-plans when the
+ * SOC moves, the inputs of the estimate change or the plan gets old.
+ */
+struct batt_health_plan {
+	bool valid;
+	ktime_t planned_at;
+	int soc;			/* ssoc_get_real() at plan */
+	int flags;			/* inputs to batt_ttf_estimate() */
+	int ret;			/* from batt_ttf_estimate() */
+	ktime_t ttf;
+	ktime_t deadline;
+	ktime_t margin;
+	ktime_t resume_time;		/* deadline - ttf - safety margin */
+};
+
 struct batt_drv {
 	struct device *device;
 	struct power_supply *psy;
@@ -364,6 +445,7 @@ struct batt_drv {
 	const char *fg_psy_name;
 	struct power_supply *fg_psy;
 	struct notifier_block fg_nb;
+	struct gbms_psy_batch fg_batch;
 
 	struct delayed_work init_work;
 	struct delayed_work batt_work;
@@ -415,6 +497,7 @@ struct batt_drv {
 	int jeita_stop_charging;
 	/* health based charging */
 	struct batt_chg_health chg_health;
+	struct batt_health_plan health_plan;
 
 	/* MSC charging */
 	u32 battery_capacity;	/* in mAh */
@@ -461,6 +544,7 @@ struct batt_drv {
 	ktime_t ttf_est;
 
 	/* logging */
+	struct gbms_journal *ssoc_journal;
 	struct logbuffer *ssoc_log;
 
 	/* thermal */
@@ -493,8 +577,12 @@ struct batt_drv {
 
 	/* AACR: Aged Adjusted Charging Rate */
 	enum batt_aacr_state aacr_state;
+	enum batt_aacr_algo aacr_algo;
 	int aacr_cycle_grace;
 	int aacr_cycle_max;
+	/* fade10 at cycle, see aacr_build_table() */
+	s16 aacr_table[AACR_TABLE_CYCLES_MAX];
+	int aacr_table_len;
 
 	/* BHI: updated on disconnect, EOC */
 	struct health_data health_data;
@@ -589,12 +677,22 @@ static int psy_changed(struct notifier_block *nb,
 
 	if (action == PSY_EVENT_PROP_CHANGED &&
 	    (!strcmp(psy->desc->name, batt_drv->fg_psy_name))) {
-		mod_delayed_work(system_wq, &batt_drv->batt_work, 0);
+		gbms_psy_batch_notify(&batt_drv->fg_batch, 0);
 	}
 
 	return NOTIFY_OK;
 }
 
+/* once per burst of notifications from the gauge */
+static void psy_changed_batch(struct gbms_psy_batch *batch,
+			      unsigned long changed)
+{
+	struct batt_drv *batt_drv = container_of(batch, struct batt_drv,
+						 fg_batch);
+
+	mod_delayed_work(system_wq, &batt_drv->batt_work, 0);
+}
+
 /* ------------------------------------------------------------------------- */
 
 
@@ -677,7 +775,7 @@ static char *ssoc_uicurve_cstr(char *buff, size_t size,
 }
 
 /* NOTE: no bounds checks on this one */
-static int ssoc_uicurve_find(qnum_t real, struct ssoc_uicurve *curve)
+static int ssoc_uicurve_find(qnum_t real, const struct ssoc_uicurve *curve)
 {
 	int i;
 
@@ -692,9 +790,28 @@ static int ssoc_uicurve_find(qnum_t real, struct ssoc_uicurve *curve)
 	return i-1;
 }
 
-static qnum_t ssoc_uicurve_map(qnum_t real, struct ssoc_uicurve *curve)
+/*
+ * The UI curve changes only on splice and dup while ssoc_uicurve_map() runs
+ * on every ssoc_update(): compute the per segment slopes here so that the
+ * map does not need a 64 bit division. Results are the same since the slope
+ * is computed exactly like before, just ahead of time.
+ */
+static void ssoc_uicurve_compile(struct ssoc_uicurve *curve)
+{
+	qnum_t delta_ui, delta_re;
+	int i;
+
+	for (i = 0; i < UICURVE_MAX - 1; i++) {
+		delta_ui = curve[i + 1].ui - curve[i].ui;
+		delta_re =  curve[i + 1].real - curve[i].real;
+		curve[i].slope = delta_re ? qnum_div(delta_ui, delta_re) : 0;
+	}
+
+	curve[UICURVE_MAX - 1].slope = 0;
+}
+
+static qnum_t ssoc_uicurve_map(qnum_t real, const struct ssoc_uicurve *curve)
 {
-	qnum_t slope = 0, delta_ui, delta_re;
 	int i;
 
 	if (real < curve[0].real)
@@ -706,12 +823,7 @@ static qnum_t ssoc_uicurve_map(qnum_t real, struct ssoc_uicurve *curve)
 	if (curve[i].real == real)
 		return curve[i].ui;
 
-	delta_ui = curve[i + 1].ui - curve[i].ui;
-	delta_re =  curve[i + 1].real - curve[i].real;
-	if (delta_re)
-		slope = qnum_div(delta_ui, delta_re);
-
-	return curve[i].ui + qnum_mul(slope, (real - curve[i].real));
+	return curve[i].ui + qnum_mul(curve[i].slope, (real - curve[i].real));
 }
 
 /* "optimized" to work on 3 element curves */
@@ -728,6 +840,7 @@ static void ssoc_uicurve_splice(struct ssoc_uicurve *curve, qnum_t real,
 	/* splice only when real is within the curve range */
 	curve[1].real = real;
 	curve[1].ui = ui;
+	ssoc_uicurve_compile(curve);
 }
 
 static void ssoc_uicurve_dup(struct ssoc_uicurve *dst,
@@ -735,6 +848,7 @@ static void ssoc_uicurve_dup(struct ssoc_uicurve *dst,
 {
 	if (dst != curve)
 		memcpy(dst, curve, sizeof(*dst)*UICURVE_MAX);
+	ssoc_uicurve_compile(dst);
 }
 
 
@@ -845,28 +959,103 @@ static int ssoc_get_capacity(const struct batt_ssoc_state *ssoc)
 
 /* ------------------------------------------------------------------------- */
 
-static void dump_ssoc_state(struct batt_ssoc_state *ssoc_state,
-			    struct logbuffer *log)
+/* ssoc journal events, formatted only when the journal is read */
+enum batt_ssoc_jev {
+	BATT_JEV_SSOC = 0,
+	BATT_JEV_SSOC_CURVE,
+};
+
+static const char * const batt_ssoc_jev_fmts[] = {
+	[BATT_JEV_SSOC] =
+		"SSOC: l=%d%% gdf=%d.%02d uic=%d.%02d rl=%d.%02d ct=%d rls=%d bd_cnt=%d",
+	[BATT_JEV_SSOC_CURVE] =
+		"SSOC: curve:[%d.%02d %d.%02d][%d.%02d %d.%02d][%d.%02d %d.%02d]",
+};
+
+#define BATT_SSOC_JOURNAL_ENTRIES	512
+#define BATT_SSOC_LOG_INTERVAL_S	60
+
+/*
+ * The ssoc logbuffer is collected in bugreports on user builds where the
+ * journal (debugfs) is not available. The line is formatted only when the
+ * level, the curve type or the rate limiter status change, or every
+ * BATT_SSOC_LOG_INTERVAL_S.
+ */
+static void dump_ssoc_log(struct batt_ssoc_state *ssoc_state,
+			  struct logbuffer *log)
 {
+	const int level = ssoc_get_capacity(ssoc_state);
+	const ktime_t now = get_boot_sec();
 	char buff[UICURVE_BUF_SZ] = { 0 };
 
-	scnprintf(ssoc_state->ssoc_state_cstr,
-		  sizeof(ssoc_state->ssoc_state_cstr),
-		  "SSOC: l=%d%% gdf=%d.%02d uic=%d.%02d rl=%d.%02d ct=%d curve:%s rls=%d bd_cnt=%d",
-		  ssoc_get_capacity(ssoc_state),
-		  qnum_toint(ssoc_state->ssoc_gdf),
-		  qnum_fracdgt(ssoc_state->ssoc_gdf),
-		  qnum_toint(ssoc_state->ssoc_uic),
-		  qnum_fracdgt(ssoc_state->ssoc_uic),
-		  qnum_toint(ssoc_state->ssoc_rl),
-		  qnum_fracdgt(ssoc_state->ssoc_rl),
-		  ssoc_state->ssoc_curve_type,
-		  ssoc_uicurve_cstr(buff, sizeof(buff), ssoc_state->ssoc_curve),
-		  ssoc_state->rl_status,
-		  ssoc_state->bd_trickle_cnt);
-
-	logbuffer_log(log, "%s", ssoc_state->ssoc_state_cstr);
-	pr_debug("%s\n", ssoc_state->ssoc_state_cstr);
+	if (!log)
+		return;
+
+	if (ssoc_state->log_at &&
+	    now - ssoc_state->log_at < BATT_SSOC_LOG_INTERVAL_S &&
+	    level == ssoc_state->log_l &&
+	    ssoc_state->ssoc_curve_type == ssoc_state->log_ct &&
+	    ssoc_state->rl_status == ssoc_state->log_rls)
+		return;
+
+	ssoc_state->log_l = level;
+	ssoc_state->log_ct = ssoc_state->ssoc_curve_type;
+	ssoc_state->log_rls = ssoc_state->rl_status;
+	ssoc_state->log_at = now;
+
+	logbuffer_log(log, "SSOC: l=%d%% gdf=%d.%02d uic=%d.%02d rl=%d.%02d ct=%d curve:%s rls=%d bd_cnt=%d",
+		      level,
+		      qnum_toint(ssoc_state->ssoc_gdf),
+		      qnum_fracdgt(ssoc_state->ssoc_gdf),
+		      qnum_toint(ssoc_state->ssoc_uic),
+		      qnum_fracdgt(ssoc_state->ssoc_uic),
+		      qnum_toint(ssoc_state->ssoc_rl),
+		      qnum_fracdgt(ssoc_state->ssoc_rl),
+		      ssoc_state->ssoc_curve_type,
+		      ssoc_uicurve_cstr(buff, sizeof(buff), ssoc_state->ssoc_curve),
+		      ssoc_state->rl_status,
+		      ssoc_state->bd_trickle_cnt);
+}
+
+static void dump_ssoc_state(struct batt_ssoc_state *ssoc_state,
+			    struct gbms_journal *jl, struct logbuffer *log)
+{
+	const struct ssoc_uicurve *curve = ssoc_state->ssoc_curve;
+
+	dump_ssoc_log(ssoc_state, log);
+
+	gbms_journal(jl, BATT_JEV_SSOC,
+		     ssoc_get_capacity(ssoc_state),
+		     qnum_toint(ssoc_state->ssoc_gdf),
+		     qnum_fracdgt(ssoc_state->ssoc_gdf),
+		     qnum_toint(ssoc_state->ssoc_uic),
+		     qnum_fracdgt(ssoc_state->ssoc_uic),
+		     qnum_toint(ssoc_state->ssoc_rl),
+		     qnum_fracdgt(ssoc_state->ssoc_rl),
+		     ssoc_state->ssoc_curve_type,
+		     ssoc_state->rl_status,
+		     ssoc_state->bd_trickle_cnt);
+
+	BUILD_BUG_ON(UICURVE_MAX != 3);
+	gbms_journal(jl, BATT_JEV_SSOC_CURVE,
+		     qnum_toint(curve[0].real), qnum_fracdgt(curve[0].real),
+		     qnum_toint(curve[0].ui), qnum_fracdgt(curve[0].ui),
+		     qnum_toint(curve[1].real), qnum_fracdgt(curve[1].real),
+		     qnum_toint(curve[1].ui), qnum_fracdgt(curve[1].ui),
+		     qnum_toint(curve[2].real), qnum_fracdgt(curve[2].real),
+		     qnum_toint(curve[2].ui), qnum_fracdgt(curve[2].ui));
+
+	pr_debug("SSOC: l=%d%% gdf=%d.%02d uic=%d.%02d rl=%d.%02d ct=%d rls=%d bd_cnt=%d\n",
+		 ssoc_get_capacity(ssoc_state),
+		 qnum_toint(ssoc_state->ssoc_gdf),
+		 qnum_fracdgt(ssoc_state->ssoc_gdf),
+		 qnum_toint(ssoc_state->ssoc_uic),
+		 qnum_fracdgt(ssoc_state->ssoc_uic),
+		 qnum_toint(ssoc_state->ssoc_rl),
+		 qnum_fracdgt(ssoc_state->ssoc_rl),
+		 ssoc_state->ssoc_curve_type,
+		 ssoc_state->rl_status,
+		 ssoc_state->bd_trickle_cnt);
 }
 
 /* ------------------------------------------------------------------------- */
@@ -914,6 +1103,12 @@ static void ssoc_update(struct batt_ssoc_state *ssoc, qnum_t soc)
 
 	/*  monotonicity and rate of change */
 	ssoc->ssoc_rl = ssoc_apply_rl(ssoc);
+
+	/* cycle count bins change only when real SOC% changes */
+	if (ssoc_get_real(ssoc) != ssoc->ccbin_soc) {
+		ssoc->ccbin_soc = ssoc_get_real(ssoc);
+		ssoc->ccbin_pending = true;
+	}
 }
 
 /*
@@ -1238,6 +1433,7 @@ static int ssoc_init(struct batt_ssoc_state *ssoc_state,
 	if (ret < 0)
 		ssoc_state->ssoc_rl_state.rl_track_target = 1;
 	ssoc_state->ssoc_rl_state.rl_ssoc_target = -1;
+	ssoc_state->ccbin_soc = -1;
 
 	/*
 	 * ssoc_work() needs a curve: start with the charge curve to prevent
@@ -1536,88 +1732,118 @@ static void batt_chg_stats_soc_update(struct gbms_charging_event *ce_data,
 	ce_data->last_soc = index;
 }
 
-static void batt_chg_stats_update_tier(const struct batt_drv *const batt_drv,
-				       int temp_idx, int ibatt_ma, int temp,
-				       ktime_t elap, int cc,
-				       struct gbms_ce_tier_stats *tier)
+/* sample shared by all the stat blocks updated in one batt_chg_stats_update() */
+struct batt_chg_stats_sample {
+	int temp_idx;
+	int ibatt_ma;
+	int temp;
+	uint16_t icl_settled;
+	ktime_t elap;
+	int cc;
+};
+
+/* high_soc, dryrun, one in series, overheat and cc_lvl */
+#define BATT_CHG_STATS_TIERS_MAX	5
+
+static void batt_chg_stats_open_tier(struct gbms_ce_tier_stats *tier,
+				     const struct batt_chg_stats_sample *s,
+				     int soc_in)
 {
-	const uint16_t icl_settled = batt_drv->chg_state.f.icl;
+	tier->temp_idx = s->temp_idx;
 
-	/*
-	 * book time to previous msc_state for this tier, there is an
-	 * interesting wrinkle here since some tiers (health, full, etc)
-	 * might be entered and exited multiple times.
-	 */
-	batt_chg_stats_tier(tier, batt_drv->msc_state, elap);
+	tier->temp_in = s->temp;
+	tier->temp_min = s->temp;
+	tier->temp_max = s->temp;
 
-	if (tier->soc_in == -1) {
-		int soc_in;
+	tier->ibatt_min = s->ibatt_ma;
+	tier->ibatt_max = s->ibatt_ma;
 
-		soc_in = GPSY_GET_PROP(batt_drv->fg_psy,
-				       GBMS_PROP_CAPACITY_RAW);
-		if (soc_in < 0) {
-			pr_info("MSC_STAT cannot read soc_in=%d\n", soc_in);
-			return;
-		}
+	tier->icl_min = s->icl_settled;
+	tier->icl_max = s->icl_settled;
 
-		tier->temp_idx = temp_idx;
+	tier->soc_in = soc_in;
+	tier->cc_in = s->cc;
+	tier->cc_total = 0;
+}
 
-		tier->temp_in = temp;
-		tier->temp_min = temp;
-		tier->temp_max = temp;
+/*
+ * Update all the active stat blocks for a sample in one pass. Everything
+ * that depends only on the sample (time bucket, weighted sums, the initial
+ * soc of new tiers) is computed once and applied to each block.
+ */
+static void batt_chg_stats_update_tiers(const struct batt_drv *const batt_drv,
+					struct gbms_ce_tier_stats **tiers,
+					int count,
+					const struct batt_chg_stats_sample *s)
+{
+	const u8 flags = batt_drv->chg_state.f.flags;
+	const int msc_state = batt_drv->msc_state;
+	/*
+	 * averages: temp < 100. icl_settled < 3000, sum(ibatt)
+	 * is bound to battery capacity, elap in seconds, sums
+	 * are stored in an s64. For icl_settled I need a tier
+	 * to last for more than ~97M years.
+	 */
+	const int64_t temp_w = s->temp * s->elap;
+	const int64_t icl_w = s->icl_settled * s->elap;
+	const int64_t ibatt_w = s->ibatt_ma * s->elap;
+	int i, soc_in = -1;
 
-		tier->ibatt_min = ibatt_ma;
-		tier->ibatt_max = ibatt_ma;
+	for (i = 0; i < count; i++) {
+		struct gbms_ce_tier_stats *tier = tiers[i];
 
-		tier->icl_min = icl_settled;
-		tier->icl_max = icl_settled;
+		/*
+		 * book time to previous msc_state for this tier, there is an
+		 * interesting wrinkle here since some tiers (health, full, etc)
+		 * might be entered and exited multiple times.
+		 */
+		batt_chg_stats_tier(tier, msc_state, s->elap);
+
+		if (tier->soc_in == -1) {
+
+			/* read once for all the tiers opened by this sample */
+			if (soc_in < 0) {
+				soc_in = GPSY_GET_PROP(batt_drv->fg_psy,
+						       GBMS_PROP_CAPACITY_RAW);
+				if (soc_in < 0) {
+					pr_info("MSC_STAT cannot read soc_in=%d\n",
+						soc_in);
+					continue;
+				}
+			}
 
-		tier->soc_in = soc_in;
-		tier->cc_in = cc;
-		tier->cc_total = 0;
-	} else {
-		const u8 flags = batt_drv->chg_state.f.flags;
+			batt_chg_stats_open_tier(tier, s, soc_in);
+			tier->sample_count += 1;
+			continue;
+		}
 
 		/* crossed temperature tier */
-		if (temp_idx != tier->temp_idx)
+		if (s->temp_idx != tier->temp_idx)
 			tier->temp_idx = -1;
 
 		if (flags & GBMS_CS_FLAG_CC) {
-			tier->time_fast += elap;
+			tier->time_fast += s->elap;
 		} else if (flags & GBMS_CS_FLAG_CV) {
-			tier->time_taper += elap;
+			tier->time_taper += s->elap;
 		} else {
-			tier->time_other += elap;
+			tier->time_other += s->elap;
 		}
 
-		/*
-		 * averages: temp < 100. icl_settled < 3000, sum(ibatt)
-		 * is bound to battery capacity, elap in seconds, sums
-		 * are stored in an s64. For icl_settled I need a tier
-		 * to last for more than ~97M years.
-		 */
-		if (temp < tier->temp_min)
-			tier->temp_min = temp;
-		if (temp > tier->temp_max)
-			tier->temp_max = temp;
-		tier->temp_sum += temp * elap;
+		tier->temp_min = min_t(int, tier->temp_min, s->temp);
+		tier->temp_max = max_t(int, tier->temp_max, s->temp);
+		tier->temp_sum += temp_w;
 
-		if (icl_settled < tier->icl_min)
-			tier->icl_min = icl_settled;
-		if (icl_settled > tier->icl_max)
-			tier->icl_max = icl_settled;
-		tier->icl_sum += icl_settled * elap;
+		tier->icl_min = min_t(int, tier->icl_min, s->icl_settled);
+		tier->icl_max = max_t(int, tier->icl_max, s->icl_settled);
+		tier->icl_sum += icl_w;
 
-		if (ibatt_ma < tier->ibatt_min)
-			tier->ibatt_min = ibatt_ma;
-		if (ibatt_ma > tier->ibatt_max)
-			tier->ibatt_max = ibatt_ma;
-		tier->ibatt_sum += ibatt_ma * elap;
+		tier->ibatt_min = min_t(int, tier->ibatt_min, s->ibatt_ma);
+		tier->ibatt_max = max_t(int, tier->ibatt_max, s->ibatt_ma);
+		tier->ibatt_sum += ibatt_w;
 
-		tier->cc_total = cc - tier->cc_in;
+		tier->cc_total = s->cc - tier->cc_in;
+		tier->sample_count += 1;
 	}
-
-	tier->sample_count += 1;
 }
 
 /* call holding stats_lock */
@@ -1628,8 +1854,10 @@ static void batt_chg_stats_update(struct batt_drv *batt_drv, int temp_idx,
 	const int soc_real = ssoc_get_real(&batt_drv->ssoc_state);
 	const int msc_state = batt_drv->msc_state; /* last msc_state */
 	struct gbms_charging_event *ce_data = &batt_drv->ce_data;
+	struct gbms_ce_tier_stats *tiers[BATT_CHG_STATS_TIERS_MAX];
 	struct gbms_ce_tier_stats *tier = NULL;
-	int cc;
+	struct batt_chg_stats_sample sample;
+	int cc, count = 0;
 
 	if (elap == 0)
 		return;
@@ -1646,22 +1874,16 @@ static void batt_chg_stats_update(struct batt_drv *batt_drv, int temp_idx,
 	/* ---  Log tiers in PARALLEL below ---  */
 
 	if (soc_real >= SSOC_HIGH_SOC)
-		batt_chg_stats_update_tier(batt_drv, temp_idx, ibatt_ma, temp,
-					   elap, cc,
-					   &ce_data->high_soc_stats);
+		tiers[count++] = &ce_data->high_soc_stats;
 
 	if (batt_drv->chg_health.dry_run_deadline > 0)
-		batt_chg_stats_update_tier(batt_drv, temp_idx, ibatt_ma, temp,
-					   elap, cc,
-					   &ce_data->health_dryrun_stats);
+		tiers[count++] = &ce_data->health_dryrun_stats;
 
 	/* --- Log tiers in SERIES below --- */
 	if (batt_drv->batt_full) {
 
 		/* Override regular charge tiers when fully charged */
-		batt_chg_stats_update_tier(batt_drv, temp_idx, ibatt_ma,
-					   temp, elap, cc,
-					   &ce_data->full_charge_stats);
+		tiers[count++] = &ce_data->full_charge_stats;
 
 	} else if (msc_state == MSC_HEALTH_PAUSE) {
 
@@ -1669,9 +1891,7 @@ static void batt_chg_stats_update(struct batt_drv *batt_drv, int temp_idx,
 		 * We log the pause tier in different AC tier groups so that we
 		 * can capture pause time separately.
 		 */
-		batt_chg_stats_update_tier(batt_drv, temp_idx, ibatt_ma, temp,
-					   elap, cc,
-					   &ce_data->health_pause_stats);
+		tiers[count++] = &ce_data->health_pause_stats;
 
 	} else if (msc_state == MSC_HEALTH || msc_state == MSC_HEALTH_ALWAYS_ON) {
 		/*
@@ -1687,9 +1907,7 @@ static void batt_chg_stats_update(struct batt_drv *batt_drv, int temp_idx,
 		 */
 
 		/* tier used for TTF during HC, check msc_logic_health() */
-		batt_chg_stats_update_tier(batt_drv, temp_idx, ibatt_ma,
-					   temp, elap, cc,
-					   &ce_data->health_stats);
+		tiers[count++] = &ce_data->health_stats;
 	} else {
 		const qnum_t soc = ssoc_get_capacity_raw(&batt_drv->ssoc_state);
 
@@ -1711,17 +1929,13 @@ static void batt_chg_stats_update(struct batt_drv *batt_drv, int temp_idx,
 
 	/* batt_drv->batt_health is protected with chg_lock, */
 	if (batt_drv->batt_health == POWER_SUPPLY_HEALTH_OVERHEAT) {
-		batt_chg_stats_update_tier(batt_drv, temp_idx, ibatt_ma, temp,
-					   elap, cc,
-					   &ce_data->overheat_stats);
+		tiers[count++] = &ce_data->overheat_stats;
 		tier = NULL;
 	}
 
 	/* custom charge levels (DWELL-DEFEND or RETAIL) */
 	if (batt_drv->chg_state.f.flags & GBMS_CS_FLAG_CCLVL) {
-		batt_chg_stats_update_tier(batt_drv, temp_idx, ibatt_ma, temp,
-					   elap, cc,
-					   &ce_data->cc_lvl_stats);
+		tiers[count++] = &ce_data->cc_lvl_stats;
 		tier = NULL;
 	}
 
@@ -1729,11 +1943,17 @@ static void batt_chg_stats_update(struct batt_drv *batt_drv, int temp_idx,
 	 * Time/current spent in OVERHEAT or at CustomLevel should not
 	 * be booked to ce_data.tier_stats[tier_idx]
 	 */
-	if (!tier)
-		return;
+	if (tier)
+		tiers[count++] = tier;
+
+	sample.temp_idx = temp_idx;
+	sample.ibatt_ma = ibatt_ma;
+	sample.temp = temp;
+	sample.icl_settled = batt_drv->chg_state.f.icl;
+	sample.elap = elap;
+	sample.cc = cc;
 
-	batt_chg_stats_update_tier(batt_drv, temp_idx, ibatt_ma, temp,
-				   elap, cc, tier);
+	batt_chg_stats_update_tiers(batt_drv, tiers, count, &sample);
 }
 
 static int batt_chg_health_vti(const struct batt_chg_health *chg_health)
@@ -2189,10 +2409,10 @@ static int batt_ravg_value(const struct batt_res *rstate)
 
 static void batt_res_dump_logs(const struct batt_res *rstate)
 {
-	pr_info("RAVG: req:%d, sample:%d[%d], filt_cnt:%d, res_avg:%d\n",
+	pr_info("RAVG: req:%d, sample:%d[%d], filt_cnt:%d, res_avg:%d ci:%d\n",
 		rstate->estimate_requested, rstate->sample_accumulator,
 		rstate->sample_count, rstate->filter_count,
-		rstate->resistance_avg);
+		rstate->resistance_avg, rstate->resistance_ci);
 }
 
 static void batt_res_state_set(struct batt_res *rstate, bool breq)
@@ -2200,6 +2420,58 @@ static void batt_res_state_set(struct batt_res *rstate, bool breq)
 	rstate->estimate_requested = breq;
 	rstate->sample_accumulator = 0;
 	rstate->sample_count = 0;
+	memset(rstate->bins, 0, sizeof(rstate->bins));
+}
+
+static int batt_res_temp_bin(const struct batt_res *rstate, int temp)
+{
+	const int range = rstate->res_temp_high - rstate->res_temp_low + 1;
+	int bin;
+
+	if (range <= 0)
+		return 0;
+
+	bin = (temp - rstate->res_temp_low) * RAVG_TEMP_BINS / range;
+	return clamp(bin, 0, RAVG_TEMP_BINS - 1);
+}
+
+/* O(1), sample is scaled like resistance_avg */
+static void batt_res_add_sample(struct batt_res *rstate, int temp, int sample)
+{
+	struct batt_res_bin *bin = &rstate->bins[batt_res_temp_bin(rstate, temp)];
+
+	bin->count++;
+	bin->sum += sample;
+	bin->sum_sq += (s64)sample * sample;
+
+	rstate->sample_accumulator += sample;
+	rstate->sample_count++;
+}
+
+/*
+ * ~95% confidence half width of the mean of the samples in this session,
+ * 2 * sqrt(var / n) with var the sample variance.
+ */
+static int batt_res_session_ci(const struct batt_res *rstate)
+{
+	s64 sum = 0, sum_sq = 0, var;
+	u32 n = 0;
+	int i;
+
+	for (i = 0; i < RAVG_TEMP_BINS; i++) {
+		n += rstate->bins[i].count;
+		sum += rstate->bins[i].sum;
+		sum_sq += rstate->bins[i].sum_sq;
+	}
+
+	if (n < 2)
+		return 0;
+
+	var = div64_s64(sum_sq * n - sum * sum, (s64)n * (n - 1));
+	if (var <= 0)
+		return 0;
+
+	return 2 * int_sqrt64(div64_s64(var, n));
 }
 
 static int batt_ravg_write(int resistance_avg, int filter_count)
@@ -2246,6 +2518,18 @@ static void batt_res_update(struct batt_res *rstate)
 
 	total_estimate = filter_estimate + new_estimate;
 	rstate->resistance_avg = total_estimate / rstate->filter_count;
+	rstate->resistance_ci = batt_res_session_ci(rstate);
+}
+
+/* persist when the filter is growing or the estimate moved enough */
+static bool batt_res_needs_save(const struct batt_res *rstate)
+{
+	const int delta = abs(rstate->resistance_avg - rstate->saved_avg);
+
+	if (rstate->filter_count != rstate->saved_count)
+		return true;
+
+	return delta * 100 > rstate->saved_avg * RAVG_SAVE_DELTA_PCT;
 }
 
 static int batt_res_load_data(struct batt_res *rstate,
@@ -2277,6 +2561,8 @@ static int batt_res_load_data(struct batt_res *rstate,
 error_done:
 	rstate->resistance_avg = resistance_avg;
 	rstate->filter_count = filter_count;
+	rstate->saved_avg = resistance_avg;
+	rstate->saved_count = filter_count;
 	return 0;
 }
 
@@ -2295,14 +2581,20 @@ static void batt_res_work(struct batt_drv *batt_drv)
 
 	if (soc >= rstate->ravg_soc_high) {
 
-		/* done: recalculate resistance_avg and save it */
+		/* done: recalculate resistance_avg and save it on change */
 		if (rstate->sample_count > 0) {
 			batt_res_update(rstate);
 
-			ret = batt_ravg_write(rstate->resistance_avg,
-					      rstate->filter_count);
-			if (ret == 0)
-				batt_res_dump_logs(rstate);
+			if (batt_res_needs_save(rstate)) {
+				ret = batt_ravg_write(rstate->resistance_avg,
+						      rstate->filter_count);
+				if (ret == 0) {
+					rstate->saved_avg = rstate->resistance_avg;
+					rstate->saved_count = rstate->filter_count;
+				}
+			}
+
+			batt_res_dump_logs(rstate);
 		}
 
 		/* loose the new data when it cannot save */
@@ -2325,8 +2617,7 @@ static void batt_res_work(struct batt_drv *batt_drv)
 		return;
 
 	/* accumulate samples if temperature and SOC are within range */
-	rstate->sample_accumulator += resistance / 100;
-	rstate->sample_count++;
+	batt_res_add_sample(rstate, temp, resistance / 100);
 	pr_debug("RAVG: sample:%d[%d], filt_cnt:%d\n",
 		 rstate->sample_accumulator, rstate->sample_count,
 		 rstate->filter_count);
@@ -2973,7 +3264,7 @@ static bool msc_health_pause(struct batt_drv *batt_drv, const ktime_t ttf,
 	const struct gbms_charging_event *ce_data = &batt_drv->ce_data;
 	const struct gbms_ce_tier_stats	*h = &ce_data->health_stats;
 	struct batt_chg_health *rest = &batt_drv->chg_health;
-	const ktime_t deadline = rest->rest_deadline;
+	const struct batt_health_plan *plan = &batt_drv->health_plan;
 	const ktime_t safety_margin = (ktime_t)batt_drv->health_safety_margin;
 	/* Note: We only capture ACTIVE time in health stats */
 	const ktime_t elap_h = h->time_fast + h->time_taper + h->time_other;
@@ -3014,8 +3305,8 @@ static bool msc_health_pause(struct batt_drv *batt_drv, const ktime_t ttf,
 	if (rest->active_time > (HEALTH_PAUSE_TIME * HEALTH_PAUSE_DEBOUNCE))
 		return false;
 
-	/* check if time meets the PAUSE condition or not */
-	if (ttf > 0 && deadline > now + ttf + safety_margin)
+	/* check if time meets the PAUSE condition: before the planned resume */
+	if (ttf > 0 && plan->valid && now < plan->resume_time)
 		return true;
 
 	/* record time for next pause check */
@@ -3075,6 +3366,77 @@ static bool batt_health_set_chg_deadline(struct batt_chg_health *chg_health,
 	return new_deadline || rest_state != chg_health->rest_state;
 }
 
+#define HEALTH_PLAN_MAX_AGE	600
+
+#define HEALTH_PLAN_F_DEBOUNCE	BIT(0)
+#define HEALTH_PLAN_F_OVERHEAT	BIT(1)
+#define HEALTH_PLAN_F_CCLVL	BIT(2)
+#define HEALTH_PLAN_F_BUCK	BIT(3)
+#define HEALTH_PLAN_F_FAKE	BIT(4)
+
+static int batt_health_plan_flags(const struct batt_drv *batt_drv)
+{
+	int flags = 0;
+
+	if (batt_drv->ttf_debounce)
+		flags |= HEALTH_PLAN_F_DEBOUNCE;
+	if (batt_drv->batt_health == POWER_SUPPLY_HEALTH_OVERHEAT)
+		flags |= HEALTH_PLAN_F_OVERHEAT;
+	if (batt_drv->chg_state.f.flags & GBMS_CS_FLAG_CCLVL)
+		flags |= HEALTH_PLAN_F_CCLVL;
+	if (batt_drv->ssoc_state.buck_enabled == 1)
+		flags |= HEALTH_PLAN_F_BUCK;
+	if (batt_drv->ttf_stats.ttf_fake != -1)
+		flags |= HEALTH_PLAN_F_FAKE;
+
+	return flags;
+}
+
+/* re-plan on a new deadline and on disconnect */
+static void batt_health_plan_reset(struct batt_drv *batt_drv)
+{
+	batt_drv->health_plan.valid = false;
+}
+
+/*
+ * TTF for adaptive charging: run ttf_soc_estimate() only when the plan
+ * drifts (SOC, estimate inputs, deadline, margin or age) and compute when
+ * PAUSE needs to end to meet the deadline.
+ * Return the value of batt_ttf_estimate(), *ttf is the estimate.
+ */
+static int batt_health_plan_update(struct batt_drv *batt_drv, ktime_t now,
+				   ktime_t *ttf)
+{
+	struct batt_health_plan *plan = &batt_drv->health_plan;
+	const struct batt_chg_health *rest = &batt_drv->chg_health;
+	const int soc = ssoc_get_real(&batt_drv->ssoc_state);
+	const int flags = batt_health_plan_flags(batt_drv);
+	const ktime_t margin = batt_drv->health_safety_margin;
+
+	if (plan->valid && plan->soc == soc && plan->flags == flags &&
+	    plan->deadline == rest->rest_deadline &&
+	    plan->margin == margin &&
+	    now - plan->planned_at < HEALTH_PLAN_MAX_AGE) {
+		*ttf = plan->ttf;
+		return plan->ret;
+	}
+
+	plan->ret = batt_ttf_estimate(&plan->ttf, batt_drv);
+	plan->valid = true;
+	plan->planned_at = now;
+	plan->soc = soc;
+	plan->flags = flags;
+	plan->deadline = rest->rest_deadline;
+	plan->margin = margin;
+	plan->resume_time = plan->deadline - plan->ttf - margin;
+
+	pr_debug("MSC_HEALTH: plan soc=%d ttf=%lld deadline=%lld resume=%lld (%d)\n",
+		 soc, plan->ttf, plan->deadline, plan->resume_time, plan->ret);
+
+	*ttf = plan->ttf;
+	return plan->ret;
+}
+
 /* cc_max in ua: capacity in mAh, rest_rate in deciPct */
 static int msc_logic_health_get_rate(const struct batt_chg_health *rest,
 				     int capacity_ma)
@@ -3134,7 +3496,7 @@ static bool msc_logic_health(struct batt_drv *batt_drv)
 	 * The estimate will be negative when BD is triggered and during the
 	 * debounce period.
 	 */
-	ret = batt_ttf_estimate(&ttf, batt_drv);
+	ret = batt_health_plan_update(batt_drv, now, &ttf);
 	if (ret < 0)
 		return false;
 
@@ -3264,10 +3626,9 @@ static int msc_pm_hold(int msc_state)
 	return pm_state;
 }
 
-/* same as design when under the grace period */
-static u32 aacr_get_reference_capacity(const struct batt_drv *batt_drv, int cycle_count)
+/* fade in 0.1% at cycle_count, 0 when under the grace period */
+static int aacr_calc_fade10(const struct batt_drv *batt_drv, int cycle_count)
 {
-	const int design_capacity = batt_drv->battery_capacity;
 	const int aacr_cycle_grace = batt_drv->aacr_cycle_grace;
 	const int aacr_cycle_max = batt_drv->aacr_cycle_max;
 	int fade10;
@@ -3286,6 +3647,43 @@ static u32 aacr_get_reference_capacity(const struct batt_drv *batt_drv, int cycl
 		fade10 = 0;
 	}
 
+	return fade10;
+}
+
+/*
+ * Compile the fade curve in a per cycle table. Call on profile load and when
+ * aacr_cycle_grace, aacr_cycle_max or aacr_state change.
+ * The table extends to the last reference cycle or aacr_cycle_max.
+ */
+static void aacr_build_table(struct batt_drv *batt_drv)
+{
+	const struct gbms_chg_profile *profile = &batt_drv->chg_profile;
+	int i, len = batt_drv->aacr_cycle_max;
+
+	if (profile->aacr_nb_limits)
+		len = max_t(int, len,
+			    profile->reference_cycles[profile->aacr_nb_limits - 1]);
+	len = clamp(len + 1, 0, AACR_TABLE_CYCLES_MAX);
+
+	for (i = 0; i < len; i++)
+		batt_drv->aacr_table[i] = aacr_calc_fade10(batt_drv, i);
+	batt_drv->aacr_table_len = len;
+
+	pr_debug("AACR: table len=%d grace=%d max=%d\n", len,
+		 batt_drv->aacr_cycle_grace, batt_drv->aacr_cycle_max);
+}
+
+/* same as design when under the grace period */
+static u32 aacr_get_reference_capacity(const struct batt_drv *batt_drv, int cycle_count)
+{
+	const int design_capacity = batt_drv->battery_capacity;
+	int fade10;
+
+	if (cycle_count >= 0 && cycle_count < batt_drv->aacr_table_len)
+		fade10 = batt_drv->aacr_table[cycle_count];
+	else
+		fade10 = aacr_calc_fade10(batt_drv, cycle_count);
+
 	return design_capacity - (design_capacity * fade10 / 1000);
 }
 
@@ -3310,6 +3708,12 @@ static int aacr_get_capacity_at_cycle(const struct batt_drv *batt_drv, int cycle
 	if (reference_capacity <= 0)
 		return design_capacity;
 
+	/* no FG reading, follow the reference curve */
+	if (batt_drv->aacr_algo == BATT_AACR_ALGO_REFERENCE_CAP) {
+		aacr_capacity = max(reference_capacity, min_capacity);
+		return (aacr_capacity / 50) * 50;
+	}
+
 	/* full_cap_nom in uAh, need to scale to mAh */
 	full_cap_nom = GPSY_GET_PROP(fg_psy, POWER_SUPPLY_PROP_CHARGE_FULL);
 	if (full_cap_nom < 0)
@@ -3373,7 +3777,7 @@ static int hist_get_index(int cycle_count, const struct batt_drv *batt_drv)
 static int bhi_cap_data_update(struct bhi_data *bhi_data, struct batt_drv *batt_drv)
 {
 	struct power_supply *fg_psy = batt_drv->fg_psy;
-	int cap_fade;
+	int cap_fade, cap_est, conf;
 
 	/* GBMS_PROP_CAPACITY_FADE_RATE is in percent */
 	cap_fade = GPSY_GET_PROP(fg_psy, GBMS_PROP_CAPACITY_FADE_RATE);
@@ -3384,8 +3788,17 @@ static int bhi_cap_data_update(struct bhi_data *bhi_data, struct batt_drv *batt_
 
 	bhi_data->capacity_fade = cap_fade;
 
-	pr_debug("%s: cap_fade=%d, cycle_count=%d\n", __func__,
-		bhi_data->capacity_fade, bhi_data->cycle_count);
+	/* google_capacity is in mAh per percent of vfsoc */
+	conf = GPSY_GET_PROP(fg_psy, GBMS_PROP_CHARGE_FULL_ESTIMATE_CONF);
+	cap_est = GPSY_GET_PROP(fg_psy, GBMS_PROP_CHARGE_FULL_ESTIMATE);
+	if (conf >= BHI_CE_CONF_MIN && cap_est > 0)
+		bhi_data->capacity_estimate = cap_est * 100;
+	else
+		bhi_data->capacity_estimate = 0;
+
+	pr_debug("%s: cap_fade=%d, cap_est=%d (%d), cycle_count=%d\n", __func__,
+		bhi_data->capacity_fade, bhi_data->capacity_estimate, conf,
+		bhi_data->cycle_count);
 
 	return 0;
 }
@@ -3417,14 +3830,16 @@ static int bhi_calc_cap_index(int algo, const struct bhi_data *bhi_data)
 	/*
 	 * TODO: for BHI_ALGO_ACHI_B compare to aacr capacity
 	 * aacr_capacity = aacr_get_capacity_at_cycle(batt_drv, cycle_count);
-	 *
-	 * TODO: compare to google_capacity?
-	 * ret = gbms_storage_read(GBMS_TAG_GCFE, &gcap sizeof(gcap));
 	 */
 
 	if (capacity_health > bhi_data->capacity_design)
 		capacity_health = bhi_data->capacity_design;
 
+	/* google_capacity, when confident, can only lower the index */
+	if (bhi_data->capacity_estimate > 0 &&
+	    bhi_data->capacity_estimate < capacity_health)
+		capacity_health = bhi_data->capacity_estimate;
+
 	index = (capacity_health * BHI_ALGO_FULL_HEALTH) / bhi_data->capacity_design;
 	pr_debug("%s: algo=%d index=%d ch=%d, cd=%d, cf=%d\n", __func__,
 		algo, index, capacity_health, bhi_data->capacity_design,
@@ -3665,43 +4080,129 @@ static int batt_bhi_data_load(struct batt_drv *batt_drv)
 	return 0;
 }
 
-/* call holding mutex_lock(&batt_drv->chg_lock)  */
+/*
+ * Battery age is only context for the indices: read it from the FG when the
+ * cycle count changes or every BHI_AGE_REFRESH_S.
+ * call holding mutex_lock(&batt_drv->chg_lock)
+ */
+static int bhi_update_age(struct batt_drv *batt_drv, ktime_t now)
+{
+	struct health_data *health_data = &batt_drv->health_data;
+	const struct bhi_inputs *last = &health_data->bhi_inputs;
+	int age;
+
+	if (last->valid && last->cycle_count == batt_drv->cycle_count &&
+	    health_data->bhi_age_time &&
+	    now - health_data->bhi_age_time < BHI_AGE_REFRESH_S)
+		return 0;
+
+	age = GPSY_GET_PROP(batt_drv->fg_psy, GBMS_PROP_BATTERY_AGE);
+	if (age < 0)
+		return -EIO;
+
+	health_data->bhi_data.battery_age = age;
+	health_data->bhi_age_time = now;
+	return 0;
+}
+
+/* save when pending, rate limited. A failed save is retried on next call */
+static void batt_bhi_save_pending(struct batt_drv *batt_drv, ktime_t now)
+{
+	struct health_data *health_data = &batt_drv->health_data;
+	int ret;
+
+	if (!health_data->bhi_save_pending)
+		return;
+	if (health_data->bhi_save_time &&
+	    now - health_data->bhi_save_time < BHI_SAVE_INTERVAL_S)
+		return;
+
+	ret = batt_bhi_data_save(batt_drv);
+	if (ret < 0) {
+		pr_err("BHI: cannot save data (%d)\n", ret);
+	} else {
+		health_data->bhi_save_time = now;
+		health_data->bhi_save_pending = false;
+	}
+}
+
+/*
+ * Recompute only the indices whose inputs changed since the last call.
+ * Notify userspace once when the health status changes, save (rate limited
+ * to BHI_SAVE_INTERVAL_S) when any index changes.
+ * call holding mutex_lock(&batt_drv->chg_lock)
+ */
 static int batt_bhi_stats_update(struct batt_drv *batt_drv)
 {
 	struct health_data *health_data = &batt_drv->health_data;
-	struct power_supply *fg_psy = batt_drv->fg_psy;
+	struct bhi_inputs *last = &health_data->bhi_inputs;
+	struct bhi_data *bhi_data = &health_data->bhi_data;
 	const int bhi_algo = health_data->bhi_algo;
+	const ktime_t now = get_boot_sec();
+	bool changed = false, status_changed, inputs_changed;
+	struct bhi_inputs in;
 	enum bhi_status status;
-	bool changed = false;
-	int age, index;
-
+	int index;
 
 	/* age (and cycle count* might be used in the calc */
-	age = GPSY_GET_PROP(fg_psy, GBMS_PROP_BATTERY_AGE);
-	if (age < 0)
+	if (bhi_update_age(batt_drv, now) < 0)
 		return -EIO;
-	health_data->bhi_data.battery_age = age;
 
 	/* cycle count is cached */
-	health_data->bhi_data.cycle_count = batt_drv->cycle_count;
+	bhi_data->cycle_count = batt_drv->cycle_count;
+
+	memset(&in, 0, sizeof(in));
+	in.valid = true;
+	in.algo = bhi_algo;
+	in.capacity_design = bhi_data->capacity_design;
+	in.capacity_fade = bhi_data->capacity_fade;
+	in.capacity_estimate = bhi_data->capacity_estimate;
+	in.act_impedance = bhi_data->act_impedance;
+	in.cur_impedance = bhi_health_get_impedance(bhi_algo, bhi_data);
+	in.ccbin_index = bhi_data->ccbin_index;
+	in.cycle_count = bhi_data->cycle_count;
+	in.marginal_threshold = health_data->marginal_threshold;
+	in.need_rep_threshold = health_data->need_rep_threshold;
+
+	if (!last->valid || last->algo != in.algo ||
+	    last->capacity_design != in.capacity_design ||
+	    last->capacity_fade != in.capacity_fade ||
+	    last->capacity_estimate != in.capacity_estimate) {
+		index = bhi_calc_cap_index(bhi_algo, bhi_data);
+		if (index < 0)
+			index = BHI_ALGO_FULL_HEALTH;
+		changed |= health_data->bhi_cap_index != index;
+		health_data->bhi_cap_index = index;
+	}
 
-	index = bhi_calc_cap_index(bhi_algo, &health_data->bhi_data);
-	if (index < 0)
-		index = BHI_ALGO_FULL_HEALTH;
-	changed |= health_data->bhi_cap_index != index;
-	health_data->bhi_cap_index = index;
+	if (!last->valid || last->algo != in.algo ||
+	    last->act_impedance != in.act_impedance ||
+	    last->cur_impedance != in.cur_impedance) {
+		index = bhi_calc_imp_index(bhi_algo, bhi_data);
+		if (index < 0)
+			index = BHI_ALGO_FULL_HEALTH;
+		changed |= health_data->bhi_imp_index != index;
+		health_data->bhi_imp_index = index;
+	}
 
-	index = bhi_calc_imp_index(bhi_algo, &health_data->bhi_data);
-	if (index < 0)
-		index = BHI_ALGO_FULL_HEALTH;
-	changed |= health_data->bhi_imp_index != index;
-	health_data->bhi_imp_index = index;
+	if (!last->valid || last->algo != in.algo ||
+	    last->ccbin_index != in.ccbin_index) {
+		index = bhi_calc_sd_index(bhi_algo, bhi_data);
+		if (index < 0)
+			index = BHI_ALGO_FULL_HEALTH;
+		changed |= health_data->bhi_sd_index != index;
+		health_data->bhi_sd_index = index;
+	}
 
-	index = bhi_calc_sd_index(bhi_algo, &health_data->bhi_data);
-	if (index < 0)
-		index = BHI_ALGO_FULL_HEALTH;
-	changed |= health_data->bhi_sd_index != index;
-	health_data->bhi_sd_index = index;
+	inputs_changed = changed || !last->valid || last->algo != in.algo ||
+			 last->marginal_threshold != in.marginal_threshold ||
+			 last->need_rep_threshold != in.need_rep_threshold;
+	*last = in;
+
+	if (!inputs_changed) {
+		batt_bhi_save_pending(batt_drv, now);
+		return 0;
+	}
 
 	index = bhi_calc_health_index(bhi_algo,
 				      health_data->bhi_cap_index,
@@ -3714,7 +4215,8 @@ static int batt_bhi_stats_update(struct batt_drv *batt_drv)
 	health_data->bhi_index = index;
 
 	status = bhi_calc_health_status(bhi_algo, index, health_data);
-	changed |= health_data->bhi_status != status;
+	status_changed = health_data->bhi_status != status;
+	changed |= status_changed;
 	health_data->bhi_status = status;
 
 	pr_debug("%s: algo=%d status=%d bhi=%d cap_index=%d, imp_index=%d sd_index=%d (%d)\n", __func__,
@@ -3722,39 +4224,31 @@ static int batt_bhi_stats_update(struct batt_drv *batt_drv)
 		 health_data->bhi_cap_index, health_data->bhi_imp_index,
 		 health_data->bhi_sd_index,  changed);
 
+	/* a single event for userspace */
+	if (status_changed && batt_drv->psy)
+		power_supply_changed(batt_drv->psy);
 
-	if (changed) {
-		int ret;
-
-		/* TODO: send a power supply event? */
-
-		ret = batt_bhi_data_save(batt_drv);
-		if (ret < 0)
-			pr_err("BHI: cannot save data (%d)\n", ret);
-	}
+	health_data->bhi_save_pending |= changed;
+	batt_bhi_save_pending(batt_drv, now);
 
 	return changed;
 }
 
 /*
  * calculate the ratio of the time spent at under the soc_limit vs the time
- * spent over the soc_limit in percent.
+ * spent over the soc_limit in percent. res_under and res_over are kept by
+ * batt_cycle_count_update() and batt_cycle_count_residency().
  * call holding mutex_lock(&batt_drv->chg_lock);
  */
-static int bhi_cycle_count_residency(struct gbatt_ccbin_data *ccd , int soc_limit)
+static int bhi_cycle_count_residency(struct gbatt_ccbin_data *ccd)
 {
-	int i, under = 0, over = 0;
+	const u32 under = ccd->res_under, over = ccd->res_over;
 
-	for (i = 0; i < GBMS_CCBIN_BUCKET_COUNT; i++) {
-		if (ccd->count[i] == 0xFFFF)
-			continue;
-		if (i < soc_limit)
-			under += ccd->count[i];
-		else
-			over += ccd->count[i];
-	}
+	pr_debug("%s: under=%u, over=%u limit=%d\n", __func__, under, over,
+		 BHI_CCBIN_INDEX_LIMIT);
+	if (under + over == 0)
+		return 0;
 
-	pr_debug("%s: under=%d, over=%d limit=%d\n", __func__, under, over, soc_limit);
 	return (under * BHI_ALGO_FULL_HEALTH) / (under + over);
 }
 
@@ -3766,7 +4260,7 @@ static int batt_bhi_stats_update_all(struct batt_drv *batt_drv)
 
 	/* swell probability: cc residecy needs ccd->lock */
 	batt_drv->health_data.bhi_data.ccbin_index =
-		bhi_cycle_count_residency(&batt_drv->cc_data, BHI_CCBIN_INDEX_LIMIT);
+		bhi_cycle_count_residency(&batt_drv->cc_data);
 	/* swell cumulative needs a new lock */
 	batt_drv->health_data.bhi_data.swell_cumulative =
 		bhi_calc_sd_total(&batt_drv->sd);
@@ -4244,6 +4738,7 @@ static int batt_chg_logic(struct batt_drv *batt_drv)
 				  SSOC_UIC_TYPE_DSG);
 
 		batt_drv->chg_health.rest_deadline = 0;
+		batt_health_plan_reset(batt_drv);
 		batt_reset_chg_drv_state(batt_drv);
 		batt_update_cycle_count(batt_drv);
 		batt_rl_reset(batt_drv);
@@ -4251,7 +4746,7 @@ static int batt_chg_logic(struct batt_drv *batt_drv)
 		/* trigger google_capacity learning. */
 		err = GPSY_SET_PROP(batt_drv->fg_psy,
 				    GBMS_PROP_BATT_CE_CTRL,
-				    false);
+				    GBMS_CE_CTRL_STOP);
 		if (err < 0)
 			pr_err("Cannot set the BATT_CE_CTRL.\n");
 
@@ -4311,7 +4806,8 @@ static int batt_chg_logic(struct batt_drv *batt_drv)
 
 		batt_chg_stats_start(batt_drv);
 
-		err = GPSY_SET_PROP(batt_drv->fg_psy, GBMS_PROP_BATT_CE_CTRL, true);
+		err = GPSY_SET_PROP(batt_drv->fg_psy, GBMS_PROP_BATT_CE_CTRL,
+				    GBMS_CE_CTRL_START);
 		if (err < 0)
 			pr_err("Cannot set the BATT_CE_CTRL (%d)\n", err);
 
@@ -4344,6 +4840,15 @@ static int batt_chg_logic(struct batt_drv *batt_drv)
 		changed = batt_rl_enter(&batt_drv->ssoc_state,
 					BATT_RL_STATUS_DISCHARGE);
 
+		/* google_capacity: settle and close the full window */
+		if (!batt_drv->chg_done) {
+			err = GPSY_SET_PROP(batt_drv->fg_psy,
+					    GBMS_PROP_BATT_CE_CTRL,
+					    GBMS_CE_CTRL_EOC);
+			if (err < 0)
+				pr_err("Cannot set the BATT_CE_CTRL (%d)\n", err);
+		}
+
 		batt_drv->chg_done = true;
 	} else if (batt_drv->batt_full) {
 		changed = batt_rl_enter(&batt_drv->ssoc_state,
@@ -4499,7 +5004,8 @@ msc_logic_done:
 msc_logic_exit:
 
 	if (changed) {
-		dump_ssoc_state(&batt_drv->ssoc_state, batt_drv->ssoc_log);
+		dump_ssoc_state(&batt_drv->ssoc_state, batt_drv->ssoc_journal,
+				batt_drv->ssoc_log);
 		if (batt_drv->psy)
 			power_supply_changed(batt_drv->psy);
 	}
@@ -4539,6 +5045,7 @@ static int batt_init_chg_profile(struct batt_drv *batt_drv)
 {
 	struct gbms_chg_profile *profile = &batt_drv->chg_profile;
 	struct device_node *node = batt_drv->device->of_node;
+	u32 aacr_algo;
 	int ret = 0;
 
 	/* handle retry */
@@ -4598,6 +5105,13 @@ static int batt_init_chg_profile(struct batt_drv *batt_drv)
 	if (!ret && profile->aacr_nb_limits)
 		batt_drv->aacr_state = BATT_AACR_ENABLED;
 
+	ret = of_property_read_u32(node, "google,aacr-algo", &aacr_algo);
+	if (ret < 0 || aacr_algo >= BATT_AACR_ALGO_MAX)
+		aacr_algo = BATT_AACR_ALGO_DEFAULT;
+	batt_drv->aacr_algo = aacr_algo;
+
+	aacr_build_table(batt_drv);
+
 	/* NOTE: with NG charger tolerance is applied from "charger" */
 	gbms_init_chg_table(profile, node, aacr_get_capacity(batt_drv));
 
@@ -4606,6 +5120,23 @@ static int batt_init_chg_profile(struct batt_drv *batt_drv)
 
 /* ------------------------------------------------------------------------- */
 
+/* recompute residency from the bins, call holding mutex_lock(&ccd->lock) */
+static void batt_cycle_count_residency(struct gbatt_ccbin_data *ccd)
+{
+	int i;
+
+	ccd->res_under = 0;
+	ccd->res_over = 0;
+	for (i = 0; i < GBMS_CCBIN_BUCKET_COUNT; i++) {
+		if (ccd->count[i] == 0xFFFF)
+			continue;
+		if (i < BHI_CCBIN_INDEX_LIMIT)
+			ccd->res_under += ccd->count[i];
+		else
+			ccd->res_over += ccd->count[i];
+	}
+}
+
 /* call holding mutex_unlock(&ccd->lock); */
 static int batt_cycle_count_store(struct gbatt_ccbin_data *ccd)
 {
@@ -4635,11 +5166,34 @@ static int batt_cycle_count_load(struct gbatt_ccbin_data *ccd)
 		if (ccd->count[i] == 0xFFFF)
 			ccd->count[i] = 0;
 
+	batt_cycle_count_residency(ccd);
 	ccd->prev_soc = -1;
 	return 0;
 }
 
-/* update only when SSOC is increasing, not need to check charging */
+/*
+ * Write only bins [first, last], full write when the storage cannot write
+ * a range of the tag.
+ * call holding mutex_unlock(&ccd->lock);
+ */
+static int batt_cycle_count_store_range(struct gbatt_ccbin_data *ccd,
+					int first, int last)
+{
+	const size_t len = (last - first + 1) * sizeof(ccd->count[0]);
+	int ret;
+
+	ret = gbms_storage_write_data(GBMS_TAG_BCNT, &ccd->count[first], len,
+				      first * sizeof(ccd->count[0]));
+	if (ret >= 0)
+		return 0;
+
+	return batt_cycle_count_store(ccd);
+}
+
+/*
+ * Called when SSOC changes a whole percent (see ssoc_update()), bins are
+ * updated only when SSOC is increasing, not need to check charging.
+ */
 static void batt_cycle_count_update(struct batt_drv *batt_drv, int soc)
 {
 	struct gbatt_ccbin_data *ccd = &batt_drv->cc_data;
@@ -4650,16 +5204,24 @@ static void batt_cycle_count_update(struct batt_drv *batt_drv, int soc)
 	mutex_lock(&ccd->lock);
 
 	if (ccd->prev_soc != -1 && soc > ccd->prev_soc) {
-		int bucket, cnt;
+		int bucket, cnt, first = GBMS_CCBIN_BUCKET_COUNT, last = -1;
 
 		for (cnt = soc ; cnt > ccd->prev_soc ; cnt--) {
 			/* cnt decremented by 1 for bucket symmetry */
 			bucket = (cnt - 1) * GBMS_CCBIN_BUCKET_COUNT / 100;
 			ccd->count[bucket]++;
+
+			if (bucket < BHI_CCBIN_INDEX_LIMIT)
+				ccd->res_under++;
+			else
+				ccd->res_over++;
+
+			first = min(first, bucket);
+			last = max(last, bucket);
 		}
 
 		/* NOTE: could store on FULL or disconnect instead */
-		(void)batt_cycle_count_store(ccd);
+		(void)batt_cycle_count_store_range(ccd, first, last);
 	}
 
 	ccd->prev_soc = soc;
@@ -4683,6 +5245,7 @@ static ssize_t cycle_counts_store(struct device *dev,
 
 	ret = gbms_cycle_count_sscan(batt_drv->cc_data.count, buf);
 	if (ret == 0) {
+		batt_cycle_count_residency(&batt_drv->cc_data);
 		ret = batt_cycle_count_store(&batt_drv->cc_data);
 		if (ret < 0)
 			pr_err("cannot store bin count ret=%d\n", ret);
@@ -4741,6 +5304,24 @@ static ssize_t resistance_avg_show(struct device *dev,
 
 static const DEVICE_ATTR_RO(resistance_avg);
 
+/*
+ * ~95% confidence half width of the mean resistance of the last charge
+ * session (the sample fed to the filter), not of the filtered
+ * resistance_avg. Same scale as resistance_avg, 0 when not known.
+ */
+static ssize_t resistance_avg_ci_show(struct device *dev,
+				      struct device_attribute *attr,
+				      char *buff)
+{
+	struct power_supply *psy = container_of(dev, struct power_supply, dev);
+	struct batt_drv *batt_drv = power_supply_get_drvdata(psy);
+	const struct batt_res *rstate = &batt_drv->health_data.bhi_data.res_state;
+
+	return scnprintf(buff, PAGE_SIZE, "%d\n", rstate->resistance_ci * 100);
+}
+
+static const DEVICE_ATTR_RO(resistance_avg_ci);
+
 static ssize_t charge_full_estimate_show(struct device *dev,
 				   struct device_attribute *attr,
 				   char *buff)
@@ -5125,6 +5706,7 @@ static int debug_ravg_fops_write(void *data, u64 val)
 	batt_res_state_set(res_state, false);
 	res_state->resistance_avg = resistance_avg;
 	res_state->filter_count = filter_count;
+	res_state->resistance_ci = 0;
 
 	/* reset storage to defaults */
 	if (val == 0) {
@@ -5133,6 +5715,10 @@ static int debug_ravg_fops_write(void *data, u64 val)
 	}
 
 	ret = batt_ravg_write(resistance_avg, filter_count);
+	if (ret == 0) {
+		res_state->saved_avg = res_state->resistance_avg;
+		res_state->saved_count = res_state->filter_count;
+	}
 	pr_info("RAVG: update val=%d, resistance_avg=%x filter_count=%x (%d)\n",
 		(int)val, resistance_avg, filter_count, ret);
 	mutex_unlock(&batt_drv->chg_lock);
@@ -5142,6 +5728,31 @@ static int debug_ravg_fops_write(void *data, u64 val)
 
 DEFINE_SIMPLE_ATTRIBUTE(debug_ravg_fops, NULL, debug_ravg_fops_write, "%llu\n");
 
+/* per temperature bin: count mean, samples of the current session */
+static ssize_t debug_get_ravg_bins(struct file *filp, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct batt_drv *batt_drv = (struct batt_drv *)filp->private_data;
+	const struct batt_res *rstate = &batt_drv->health_data.bhi_data.res_state;
+	char tmp[RAVG_TEMP_BINS * 32 + 2];
+	int i, len = 0;
+
+	mutex_lock(&batt_drv->chg_lock);
+	for (i = 0; i < RAVG_TEMP_BINS; i++) {
+		const struct batt_res_bin *bin = &rstate->bins[i];
+		const s64 mean = bin->count ? div_s64(bin->sum, bin->count) : 0;
+
+		len += scnprintf(&tmp[len], sizeof(tmp) - len, "%u:%lld ",
+				 bin->count, mean * 100);
+	}
+	mutex_unlock(&batt_drv->chg_lock);
+	len += scnprintf(&tmp[len], sizeof(tmp) - len, "\n");
+
+	return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
+
+BATTERY_DEBUG_ATTRIBUTE(debug_ravg_bins_fops, debug_get_ravg_bins, NULL);
+
 
 #endif
 
@@ -5716,6 +6327,7 @@ static ssize_t batt_set_chg_deadline(struct device *dev,
 
 	changed = batt_health_set_chg_deadline(&batt_drv->chg_health,
 					       deadline_s);
+	batt_health_plan_reset(batt_drv);
 	mutex_unlock(&batt_drv->chg_lock);
 
 	if (changed)
@@ -5787,7 +6399,7 @@ static ssize_t ssoc_details_show(struct device *dev,
 	}
 
 	len = scnprintf(
-		buf, sizeof(ssoc_state->ssoc_state_cstr),
+		buf, SSOC_STATE_BUF_SZ,
 		"soc: l=%d%% gdf=%d.%02d uic=%d.%02d rl=%d.%02d\n"
 		"curve:%s\n"
 		"status: ct=%d rl=%d s=%d\n",
@@ -6233,7 +6845,10 @@ static ssize_t aacr_state_store(struct device *dev,
 	if (batt_drv->aacr_state == state)
 		return count;
 
+	mutex_lock(&batt_drv->chg_lock);
 	batt_drv->aacr_state = state;
+	aacr_build_table(batt_drv);
+	mutex_unlock(&batt_drv->chg_lock);
 	return count;
 }
 
@@ -6261,7 +6876,10 @@ static ssize_t aacr_cycle_grace_store(struct device *dev,
 	if (ret < 0)
 		return ret;
 
+	mutex_lock(&batt_drv->chg_lock);
 	batt_drv->aacr_cycle_grace = value;
+	aacr_build_table(batt_drv);
+	mutex_unlock(&batt_drv->chg_lock);
 	return count;
 }
 
@@ -6289,7 +6907,10 @@ static ssize_t aacr_cycle_max_store(struct device *dev,
 	if (ret < 0)
 		return ret;
 
+	mutex_lock(&batt_drv->chg_lock);
 	batt_drv->aacr_cycle_max = value;
+	aacr_build_table(batt_drv);
+	mutex_unlock(&batt_drv->chg_lock);
 	return count;
 }
 
@@ -6304,6 +6925,38 @@ static ssize_t aacr_cycle_max_show(struct device *dev,
 
 static const DEVICE_ATTR_RW(aacr_cycle_max);
 
+static ssize_t aacr_algo_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct power_supply *psy = container_of(dev, struct power_supply, dev);
+	struct batt_drv *batt_drv = power_supply_get_drvdata(psy);
+	int value, ret = 0;
+
+	ret = kstrtoint(buf, 0, &value);
+	if (ret < 0)
+		return ret;
+
+	if (value < BATT_AACR_ALGO_DEFAULT || value >= BATT_AACR_ALGO_MAX)
+		return -ERANGE;
+
+	mutex_lock(&batt_drv->chg_lock);
+	batt_drv->aacr_algo = value;
+	mutex_unlock(&batt_drv->chg_lock);
+	return count;
+}
+
+static ssize_t aacr_algo_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct power_supply *psy = container_of(dev, struct power_supply, dev);
+	struct batt_drv *batt_drv = power_supply_get_drvdata(psy);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", batt_drv->aacr_algo);
+}
+
+static const DEVICE_ATTR_RW(aacr_algo);
+
 /* Swelling  --------------------------------------------------------------- */
 
 static ssize_t swelling_data_show(struct device *dev,
@@ -6804,6 +7457,10 @@ static int batt_init_fs(struct batt_drv *batt_drv)
 	if (ret)
 		dev_err(&batt_drv->psy->dev, "Failed to create resistance_avg\n");
 
+	ret = device_create_file(&batt_drv->psy->dev, &dev_attr_resistance_avg_ci);
+	if (ret)
+		dev_err(&batt_drv->psy->dev, "Failed to create resistance_avg_ci\n");
+
 	ret = device_create_file(&batt_drv->psy->dev, &dev_attr_resistance);
 	if (ret)
 		dev_err(&batt_drv->psy->dev, "Failed to create resistance\n");
@@ -6838,6 +7495,10 @@ static int batt_init_fs(struct batt_drv *batt_drv)
 	if (ret)
 		dev_err(&batt_drv->psy->dev, "Failed to create aacr cycle max\n");
 
+	ret = device_create_file(&batt_drv->psy->dev, &dev_attr_aacr_algo);
+	if (ret)
+		dev_err(&batt_drv->psy->dev, "Failed to create aacr algo\n");
+
 	/* health and health index */
 	ret = device_create_file(&batt_drv->psy->dev, &dev_attr_swelling_data);
 	if (ret)
@@ -6886,6 +7547,7 @@ static int batt_init_fs(struct batt_drv *batt_drv)
 		return 0;
 
 	debugfs_create_u32("debug_level", 0644, de, &debug_printk_prlog);
+	gbms_psy_batch_debugfs(&batt_drv->fg_batch, de);
 	debugfs_create_file("cycle_count_sync", 0600, de, batt_drv,
 			    &cycle_count_bins_sync_fops);
 	debugfs_create_file("ssoc_gdf", 0644, de, batt_drv, &debug_ssoc_gdf_fops);
@@ -6893,6 +7555,7 @@ static int batt_init_fs(struct batt_drv *batt_drv)
 	debugfs_create_file("ssoc_rls", 0444, de, batt_drv, &debug_ssoc_rls_fops);
 	debugfs_create_file("ssoc_uicurve", 0644, de, batt_drv,
 			    &debug_ssoc_uicurve_cstr_fops);
+	gbms_journal_debugfs(batt_drv->ssoc_journal, de);
 	debugfs_create_file("force_psy_update", 0400, de, batt_drv,
 			    &debug_force_psy_update_fops);
 	debugfs_create_file("pairing_state", 0200, de, batt_drv, &debug_pairing_fops);
@@ -6947,6 +7610,7 @@ static int batt_init_fs(struct batt_drv *batt_drv)
 	debugfs_create_u32("ravg_soc_high", 0644, de,
 			   &batt_drv->health_data.bhi_data.res_state.ravg_soc_high);
 	debugfs_create_file("ravg", 0400, de,  batt_drv, &debug_ravg_fops);
+	debugfs_create_file("ravg_bins", 0400, de,  batt_drv, &debug_ravg_bins_fops);
 
 	return 0;
 }
@@ -7367,6 +8031,7 @@ static void google_battery_work(struct work_struct *work)
 	const int prev_ssoc = ssoc_get_capacity(ssoc_state);
 	int present, fg_status, batt_temp, ret;
 	bool notify_psy_changed = false;
+	int ccbin_soc = -1;
 
 	pr_debug("battery work item\n");
 
@@ -7424,7 +8089,8 @@ static void google_battery_work(struct work_struct *work)
 			if (ssoc > prev_ssoc)
 				bat_log_ttf_estimate("SSOC", ssoc, batt_drv);
 
-			dump_ssoc_state(ssoc_state, batt_drv->ssoc_log);
+			dump_ssoc_state(ssoc_state, batt_drv->ssoc_journal,
+					batt_drv->ssoc_log);
 			batt_log_csi_info(batt_drv);
 			notify_psy_changed = true;
 		}
@@ -7504,6 +8170,12 @@ static void google_battery_work(struct work_struct *work)
 	if (batt_drv->sd.is_enable)
 		gbatt_record_over_temp(batt_drv);
 
+	/* set from ssoc_update() */
+	if (ssoc_state->ccbin_pending) {
+		ssoc_state->ccbin_pending = false;
+		ccbin_soc = ssoc_state->ccbin_soc;
+	}
+
 	mutex_unlock(&batt_drv->batt_lock);
 
 	/*
@@ -7556,8 +8228,9 @@ static void google_battery_work(struct work_struct *work)
 
 	mutex_unlock(&batt_drv->chg_lock);
 
-	/* TODO: we might not need to do this all the time */
-	batt_cycle_count_update(batt_drv, ssoc_get_real(ssoc_state));
+	/* bins change only on a whole SOC% transition */
+	if (ccbin_soc >= 0)
+		batt_cycle_count_update(batt_drv, ccbin_soc);
 
 reschedule:
 
@@ -7810,7 +8483,8 @@ static void gbatt_reset_curve(struct batt_drv *batt_drv, int ssoc_cap)
 	/* current is the drop point on the discharge curve */
 	ssoc_change_curve_at_gdf(ssoc_state, gdf, cap, type);
 	ssoc_work(ssoc_state, batt_drv->fg_psy);
-	dump_ssoc_state(ssoc_state, batt_drv->ssoc_log);
+	dump_ssoc_state(ssoc_state, batt_drv->ssoc_journal,
+			batt_drv->ssoc_log);
 }
 
 /* splice the curve at point when the SSOC is removed */
@@ -8383,7 +9057,8 @@ static void google_battery_init_work(struct work_struct *work)
 	if (ret < 0 && batt_drv->batt_present)
 		goto retry_init_work;
 
-	dump_ssoc_state(&batt_drv->ssoc_state, batt_drv->ssoc_log);
+	dump_ssoc_state(&batt_drv->ssoc_state, batt_drv->ssoc_journal,
+			batt_drv->ssoc_log);
 
 	ret = gbatt_restore_capacity(batt_drv);
 	if (ret < 0)
@@ -8407,6 +9082,8 @@ static void google_battery_init_work(struct work_struct *work)
 	cev_stats_init(&batt_drv->ce_data, &batt_drv->chg_profile);
 	cev_stats_init(&batt_drv->ce_qual, &batt_drv->chg_profile);
 
+	gbms_psy_batch_init(&batt_drv->fg_batch, GBMS_PSY_BATCH_WINDOW_MS,
+			    psy_changed_batch);
 	batt_drv->fg_nb.notifier_call = psy_changed;
 	ret = power_supply_reg_notifier(&batt_drv->fg_nb);
 	if (ret < 0)
@@ -8685,6 +9362,16 @@ static int google_battery_probe(struct platform_device *pdev)
 		batt_drv->ssoc_log = NULL;
 	}
 
+	batt_drv->ssoc_journal = gbms_journal_create("ssoc", batt_ssoc_jev_fmts,
+						     ARRAY_SIZE(batt_ssoc_jev_fmts),
+						     BATT_SSOC_JOURNAL_ENTRIES);
+	if (IS_ERR(batt_drv->ssoc_journal)) {
+		ret = PTR_ERR(batt_drv->ssoc_journal);
+		dev_err(batt_drv->device,
+			"failed to create ssoc_journal, ret=%d\n", ret);
+		batt_drv->ssoc_journal = NULL;
+	}
+
 	/* RAVG: google_resistance */
 	ret = batt_ravg_init(&batt_drv->health_data.bhi_data.res_state,
 			     pdev->dev.of_node);
@@ -8768,6 +9455,7 @@ static int google_battery_remove(struct platform_device *pdev)
 	if (!batt_drv)
 		return 0;
 
+	gbms_journal_destroy(batt_drv->ssoc_journal);
 	if (batt_drv->ssoc_log)
 		logbuffer_unregister(batt_drv->ssoc_log);
 	if (batt_drv->ttf_stats.ttf_log)
@@ -29,6 +29,8 @@
 #include <linux/slab.h>
 #include <linux/of.h>
 #include <linux/regmap.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
 
 #include "google_psy.h"
 #include "google_bms.h"
@@ -681,6 +683,65 @@ void gbms_logbuffer_prlog(struct logbuffer *log, int level, int debug_no_logbuff
 }
 EXPORT_SYMBOL_GPL(gbms_logbuffer_prlog);
 
+static void gbms_psy_batch_work(struct work_struct *work)
+{
+	struct gbms_psy_batch *batch = container_of(work, struct gbms_psy_batch,
+						    work.work);
+	const unsigned long changed = xchg(&batch->pending, 0);
+
+	if (!changed)
+		return;
+
+	atomic_inc(&batch->executed);
+	batch->fn(batch, changed);
+}
+
+void gbms_psy_batch_init(struct gbms_psy_batch *batch, int window_ms,
+			 void (*fn)(struct gbms_psy_batch *, unsigned long))
+{
+	INIT_DELAYED_WORK(&batch->work, gbms_psy_batch_work);
+	batch->pending = 0;
+	batch->window = msecs_to_jiffies(window_ms);
+	batch->fn = fn;
+	atomic_set(&batch->notified, 0);
+	atomic_set(&batch->executed, 0);
+}
+EXPORT_SYMBOL_GPL(gbms_psy_batch_init);
+
+/* cannot block: called from power supply notifiers */
+void gbms_psy_batch_notify(struct gbms_psy_batch *batch, int source)
+{
+	if (source < 0 || source >= BITS_PER_LONG)
+		return;
+
+	atomic_inc(&batch->notified);
+	set_bit(source, &batch->pending);
+
+	/* no-op when the window is already open */
+	queue_delayed_work(system_wq, &batch->work, batch->window);
+}
+EXPORT_SYMBOL_GPL(gbms_psy_batch_notify);
+
+void gbms_psy_batch_cancel(struct gbms_psy_batch *batch)
+{
+	cancel_delayed_work_sync(&batch->work);
+	batch->pending = 0;
+}
+EXPORT_SYMBOL_GPL(gbms_psy_batch_cancel);
+
+void gbms_psy_batch_debugfs(struct gbms_psy_batch *batch,
+			    struct dentry *parent)
+{
+	if (IS_ERR_OR_NULL(parent))
+		return;
+
+	debugfs_create_atomic_t("psy_notified", 0400, parent,
+				&batch->notified);
+	debugfs_create_atomic_t("psy_executed", 0400, parent,
+				&batch->executed);
+}
+EXPORT_SYMBOL_GPL(gbms_psy_batch_debugfs);
+
 bool chg_state_is_disconnected(const union gbms_charger_state *chg_state)
 {
 	return ((chg_state->f.flags & GBMS_CS_FLAG_BUCK_EN) == 0) &&
@@ -19,6 +19,7 @@
 
 #include <linux/minmax.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 #include <linux/usb/pd.h>
 #include <misc/logbuffer.h>
 #include "gbms_power_supply.h"
@@ -421,6 +422,51 @@ __printf(5,6)
 void gbms_logbuffer_prlog(struct logbuffer *log, int level, int debug_no_logbuffer,
 			  int debug_printk_prlog, const char *f, ...);
 
+/* binary event journal, formatted only on read */
+#define GBMS_JOURNAL_MAX_ARGS	12
+
+struct gbms_journal;
+struct dentry;
+
+struct gbms_journal *gbms_journal_create(const char *name,
+					 const char * const *fmts, int nfmts,
+					 int entries);
+void gbms_journal_destroy(struct gbms_journal *jl);
+void gbms_journal_logv(struct gbms_journal *jl, u16 evid, int nargs,
+		       const s32 *args);
+void gbms_journal_debugfs(struct gbms_journal *jl, struct dentry *parent);
+
+/* fmts[evid] is a printk format that takes only int arguments */
+#define gbms_journal(jl, evid, ...) do {				\
+	const s32 __jargs[] = { __VA_ARGS__ };				\
+									\
+	BUILD_BUG_ON(ARRAY_SIZE(__jargs) > GBMS_JOURNAL_MAX_ARGS);	\
+	gbms_journal_logv(jl, evid, ARRAY_SIZE(__jargs), __jargs);	\
+} while (0)
+
+/*
+ * Coalesce power_supply_changed() bursts: notifiers call
+ * gbms_psy_batch_notify() with the index of the supply that changed and
+ * ->fn runs once per window with the mask of all the supplies that changed.
+ */
+#define GBMS_PSY_BATCH_WINDOW_MS	10
+
+struct gbms_psy_batch {
+	struct delayed_work work;
+	unsigned long pending;
+	unsigned long window;	/* jiffies */
+	void (*fn)(struct gbms_psy_batch *batch, unsigned long changed);
+	atomic_t notified;
+	atomic_t executed;
+};
+
+void gbms_psy_batch_init(struct gbms_psy_batch *batch, int window_ms,
+			 void (*fn)(struct gbms_psy_batch *, unsigned long));
+void gbms_psy_batch_notify(struct gbms_psy_batch *batch, int source);
+void gbms_psy_batch_cancel(struct gbms_psy_batch *batch);
+void gbms_psy_batch_debugfs(struct gbms_psy_batch *batch,
+			    struct dentry *parent);
+
 /* debug/print */
 const char *gbms_chg_type_s(int chg_type);
 const char *gbms_chg_status_s(int chg_status);
@@ -34,6 +34,7 @@
 #include "gbms_power_supply.h"
 #include "google_bms.h"
 #include "google_dc_pps.h"
+#include "google_defender.h"
 #include "google_psy.h"
 
 #ifdef CONFIG_DEBUG_FS
@@ -116,18 +117,6 @@ enum chg_thermal_devices {
 	CHG_TERMAL_DEVICES_COUNT,
 };
 
-enum dock_defend_state {
-       DOCK_DEFEND_DISABLED = -1,
-       DOCK_DEFEND_ENABLED = 0,
-       DOCK_DEFEND_ACTIVE,
-};
-
-enum dock_defend_settings {
-       DOCK_DEFEND_USER_DISABLED = -1,
-       DOCK_DEFEND_USER_CLEARED = 0,
-       DOCK_DEFEND_USER_ENABLED,
-};
-
 struct chg_thermal_device {
 	struct chg_drv *chg_drv;
 
@@ -153,47 +142,39 @@ static void chg_reset_termination_data(struct chg_drv *chg_drv);
 static int chg_vote_input_suspend(struct chg_drv *chg_drv,
 				  char *voter, bool suspend);
 
-struct bd_data {
-	u32 bd_trigger_voltage;	/* also recharge upper bound */
-	u32 bd_trigger_temp;	/* single reading */
-	u32 bd_trigger_time;	/* debounce window after trigger*/
-	u32 bd_drainto_soc;
-	u32 bd_recharge_voltage;
-	u32 bd_recharge_soc;
-
-	u32 bd_resume_abs_temp;	/* at any time after trigger */
-
-	u32 bd_resume_soc;	/* any time after disconnect */
-	u32 bd_resume_time;	/* debounce window for resume temp */
-	u32 bd_resume_temp;	/* check resume_time after disconnect */
-
-	long long temp_sum;
-	ktime_t time_sum;
-
-	int last_voltage;
-	int last_temp;
-	ktime_t last_update;
-
-	ktime_t disconnect_time;
-	u32 triggered;		/* (d) */
-	u32 enabled;		/* (d) */
-	u32 bd_temp_enable;	/* for UI setting interface */
-
-	bool lowerbd_reached;
-	bool bd_temp_dry_run;
-
-	/* dock_defend */
-	u32 dd_triggered;
-	u32 dd_enabled;
-	int dd_state;
-	int dd_settings;
-	int dd_charge_stop_level;
-	int dd_charge_start_level;
-};
+/* levels above the last bin are accounted in the last bin */
+#define CHG_THERMAL_STATS_LEVELS	8
+#define CHG_THERMAL_HIST_VERSION	1
+
+/* time and charge delivered at a thermal level of a cooling device */
+struct thermal_stats_bin {
+	uint32_t time_secs;
+	int32_t charge_uah;
+	uint32_t count;		/* segments closed at this level */
+} __attribute__((packed));
+
+/* thermal_hist: header followed by devices * levels bins */
+struct thermal_stats_hist_hdr {
+	uint8_t version;
+	uint8_t devices;
+	uint8_t levels;
+	uint8_t bin_size;
+} __attribute__((packed));
 
 struct thermal_stats_data {
 	struct mutex lock;
 
+	/*
+	 * A segment is the time between two changes of the levels of the
+	 * cooling devices, charge counter is read only when a segment closes.
+	 */
+	struct thermal_stats_bin
+		hist[CHG_TERMAL_DEVICES_COUNT][CHG_THERMAL_STATS_LEVELS];
+	int seg_level[CHG_TERMAL_DEVICES_COUNT];
+	ktime_t seg_start;
+	int seg_cc;
+	int ibatt_segments;
+
 	int max_thermal_level;
 	int32_t time_limited_sum_secs;
 
@@ -227,7 +208,7 @@ struct chg_drv {
 	struct notifier_block psy_nb;
 	struct delayed_work init_work;
 	struct delayed_work chg_work;
-	struct work_struct chg_psy_work;
+	struct gbms_psy_batch chg_psy_batch;
 	struct wakeup_source *chg_ws;
 	struct alarm chg_wakeup_alarm;
 	u32 tcpm_phandle;
@@ -274,8 +255,6 @@ struct chg_drv {
 	int egain_retries;
 
 	/* retail & battery defender */
-	struct delayed_work bd_work;
-
 	struct mutex bd_lock;
 	struct bd_data bd_state;
 	struct wakeup_source *bd_ws;
@@ -331,20 +310,38 @@ google_chg_alarm_handler(struct alarm *alarm, ktime_t time)
 	return ALARMTIMER_NORESTART;
 }
 
-static void chg_psy_work(struct work_struct *work)
+/* bits in the mask passed to chg_psy_batch() */
+enum chg_psy_source {
+	CHG_PSY_SRC_CHG = 0,
+	CHG_PSY_SRC_BAT,
+	CHG_PSY_SRC_USB,
+	CHG_PSY_SRC_TCPM,
+	CHG_PSY_SRC_EXT,
+	CHG_PSY_SRC_WLC,
+};
+
+/* once per burst of notifications, @changed has a bit per chg_psy_source */
+static void chg_psy_batch(struct gbms_psy_batch *batch, unsigned long changed)
 {
 	struct chg_drv *chg_drv =
-		container_of(work, struct chg_drv, chg_psy_work);
+		container_of(batch, struct chg_drv, chg_psy_batch);
 
+	pr_debug("%s changed=%lx\n", __func__, changed);
 	reschedule_chg_work(chg_drv);
 }
 
+static bool chg_psy_name_is(const struct power_supply *psy, const char *name)
+{
+	return name && !strcmp(psy->desc->name, name);
+}
+
 /* cannot block: run in atomic context when called from chg_psy_changed() */
 static int chg_psy_changed(struct notifier_block *nb,
 		       unsigned long action, void *data)
 {
 	struct power_supply *psy = data;
 	struct chg_drv *chg_drv = container_of(nb, struct chg_drv, psy_nb);
+	int source;
 
 	pr_debug("%s name=%s evt=%lu\n", __func__, psy->desc->name, action);
 
@@ -352,19 +349,22 @@ static int chg_psy_changed(struct notifier_block *nb,
 	    (psy == NULL) || (psy->desc == NULL) || (psy->desc->name == NULL))
 		return NOTIFY_OK;
 
-	if (action == PSY_EVENT_PROP_CHANGED &&
-	    (!strcmp(psy->desc->name, chg_drv->chg_psy_name) ||
-	     !strcmp(psy->desc->name, chg_drv->bat_psy_name) ||
-	     (chg_drv->usb_psy_name &&
-	      !strcmp(psy->desc->name, chg_drv->usb_psy_name)) ||
-	     (chg_drv->tcpm_psy_name &&
-	      !strcmp(psy->desc->name, chg_drv->tcpm_psy_name)) ||
-	     (chg_drv->ext_psy_name &&
-	      !strcmp(psy->desc->name, chg_drv->ext_psy_name)) ||
-	     (chg_drv->wlc_psy_name &&
-	      !strcmp(psy->desc->name, chg_drv->wlc_psy_name)))) {
-		schedule_work(&chg_drv->chg_psy_work);
-	}
+	if (chg_psy_name_is(psy, chg_drv->chg_psy_name))
+		source = CHG_PSY_SRC_CHG;
+	else if (chg_psy_name_is(psy, chg_drv->bat_psy_name))
+		source = CHG_PSY_SRC_BAT;
+	else if (chg_psy_name_is(psy, chg_drv->usb_psy_name))
+		source = CHG_PSY_SRC_USB;
+	else if (chg_psy_name_is(psy, chg_drv->tcpm_psy_name))
+		source = CHG_PSY_SRC_TCPM;
+	else if (chg_psy_name_is(psy, chg_drv->ext_psy_name))
+		source = CHG_PSY_SRC_EXT;
+	else if (chg_psy_name_is(psy, chg_drv->wlc_psy_name))
+		source = CHG_PSY_SRC_WLC;
+	else
+		return NOTIFY_OK;
+
+	gbms_psy_batch_notify(&chg_drv->chg_psy_batch, source);
 	return NOTIFY_OK;
 }
 
@@ -1208,249 +1208,206 @@ static void chg_update_charging_state(struct chg_drv *chg_drv,
 	chg_drv->disable_pwrsrc = disable_pwrsrc;
 }
 
-/*
- * called on init and to reset the trigger
- * TEMP-DEFEND needs to have triggers for voltage, time and temperature, a
- * recharge voltage and some way to resume normal behavior. Resume can happen
- * based on at least ONE of the following criteria:
- * - when battery temperature fall under a limit
- * - at disconnect
- * - after disconnect if the SOC drops under limit
- * - some time after disconnect (optional if temperature under limit)
- */
-static void bd_reset(struct bd_data *bd_state)
-{
-	bool can_resume = bd_state->bd_resume_abs_temp ||
-			  bd_state->bd_resume_time ||
-			  (bd_state->bd_resume_time == 0 &&
-			  bd_state->bd_resume_soc == 0);
-
-	bd_state->time_sum = 0;
-	bd_state->temp_sum = 0;
-	bd_state->last_update = 0;
-	bd_state->last_voltage = 0;
-	bd_state->last_temp = 0;
-	bd_state->triggered = 0;
-	bd_state->dd_triggered = 0;
-
-	/* also disabled when externally triggered, resume_temp is optional */
-	bd_state->enabled = ((bd_state->bd_trigger_voltage &&
-				bd_state->bd_recharge_voltage) ||
-				(bd_state->bd_drainto_soc &&
-				bd_state->bd_recharge_soc)) &&
-			    bd_state->bd_trigger_time &&
-			    bd_state->bd_trigger_temp &&
-			    bd_state->bd_temp_enable &&
-			    can_resume;
-}
-
-/* Defender */
-static void bd_init(struct bd_data *bd_state, struct device *dev)
+static void bd_fan_vote(struct chg_drv *chg_drv, bool enable, int level)
 {
-	int ret;
-
-	ret = of_property_read_u32(dev->of_node, "google,bd-trigger-voltage",
-				   &bd_state->bd_trigger_voltage);
-	if (ret < 0)
-		bd_state->bd_trigger_voltage = 0;
-
-	ret = of_property_read_u32(dev->of_node, "google,bd-drainto-soc",
-				   &bd_state->bd_drainto_soc);
-	if (ret < 0)
-		bd_state->bd_drainto_soc = 0;
-
-	ret = of_property_read_u32(dev->of_node, "google,bd-trigger-temp",
-				   &bd_state->bd_trigger_temp);
-	if (ret < 0)
-		bd_state->bd_trigger_temp = 0;
-
-	ret = of_property_read_u32(dev->of_node, "google,bd-trigger-time",
-				   &bd_state->bd_trigger_time);
-	if (ret < 0)
-		bd_state->bd_trigger_time = 0; /* hours */
-
-	ret = of_property_read_u32(dev->of_node, "google,bd-recharge-voltage",
-				   &bd_state->bd_recharge_voltage);
-	if (ret < 0)
-		bd_state->bd_recharge_voltage = 0;
-
-	ret = of_property_read_u32(dev->of_node, "google,bd-recharge-soc",
-				   &bd_state->bd_recharge_soc);
-	if (ret < 0)
-		bd_state->bd_recharge_soc = 0;
-
-	ret = of_property_read_u32(dev->of_node, "google,bd-resume-abs-temp",
-				   &bd_state->bd_resume_abs_temp);
-	if (ret < 0)
-		bd_state->bd_resume_abs_temp = 0;
-
-	ret = of_property_read_u32(dev->of_node, "google,bd-resume-soc",
-				   &bd_state->bd_resume_soc);
-	if (ret < 0)
-		bd_state->bd_resume_soc = 0;
+	if (!chg_drv->fan_level_votable)
+		chg_drv->fan_level_votable =
+			gvotable_election_get_handle("FAN_LEVEL");
+	if (chg_drv->fan_level_votable)
+		gvotable_cast_int_vote(chg_drv->fan_level_votable,
+				       "MSC_BD", level, enable);
+}
 
-	ret = of_property_read_u32(dev->of_node, "google,bd-resume-temp",
-				   &bd_state->bd_resume_temp);
-	if (ret < 0)
-		bd_state->bd_resume_temp = 0;
+static void thermal_stats_init(struct thermal_stats_data *thermal_stats) {
+	thermal_stats->last_update = 0;
 
-	ret = of_property_read_u32(dev->of_node, "google,bd-resume-time",
-				   &bd_state->bd_resume_time);
-	if (ret < 0)
-		bd_state->bd_resume_time = 0;
+	thermal_stats->max_thermal_level = 0;
+	thermal_stats->time_limited_sum_secs = 0;
 
-	bd_state->bd_temp_dry_run =
-		 of_property_read_bool(dev->of_node, "google,bd-temp-dry-run");
+	thermal_stats->soc_in = -1;
 
-	bd_state->bd_temp_enable =
-		 of_property_read_bool(dev->of_node, "google,bd-temp-enable");
+	thermal_stats->ibatt_min = 0;
+	thermal_stats->ibatt_max = 0;
+	thermal_stats->ibatt_sum = 0;
+	thermal_stats->ibatt_segments = 0;
 
-	/* also call to resume charging */
-	bd_reset(bd_state);
-	if (!bd_state->enabled)
-		dev_warn(dev, "TEMP-DEFEND not enabled\n");
+	thermal_stats->icl_min = 0;
+	thermal_stats->icl_max = 0;
+	thermal_stats->icl_sum = 0;
 
-	pr_info("MSC_BD: trig volt=%d,%d temp=%d,time=%d drainto=%d,%d resume=%d,%d %d,%d\n",
-		bd_state->bd_trigger_voltage, bd_state->bd_recharge_voltage,
-		bd_state->bd_trigger_temp, bd_state->bd_trigger_time,
-		bd_state->bd_drainto_soc, bd_state->bd_recharge_soc,
-		bd_state->bd_resume_abs_temp, bd_state->bd_resume_soc,
-		bd_state->bd_resume_temp, bd_state->bd_resume_time);
+	memset(thermal_stats->hist, 0, sizeof(thermal_stats->hist));
+	memset(thermal_stats->seg_level, 0, sizeof(thermal_stats->seg_level));
+	thermal_stats->seg_start = 0;
 }
 
-static void bd_fan_vote(struct chg_drv *chg_drv, bool enable, int level)
+static struct thermal_stats_bin *
+thermal_stats_bin(struct thermal_stats_data *thermal_stats, int dev, int level)
 {
-	if (!chg_drv->fan_level_votable)
-		chg_drv->fan_level_votable =
-			gvotable_election_get_handle("FAN_LEVEL");
-	if (chg_drv->fan_level_votable)
-		gvotable_cast_int_vote(chg_drv->fan_level_votable,
-				       "MSC_BD", level, enable);
+	level = clamp(level, 0, CHG_THERMAL_STATS_LEVELS - 1);
+	return &thermal_stats->hist[dev][level];
 }
 
-#define FAN_BD_LIMIT_ALARM	75
-#define FAN_BD_LIMIT_HIGH	50
-#define FAN_BD_LIMIT_MED	25
-static int bd_fan_calculate_level(struct bd_data *bd_state)
+/* average battery current in mA over a segment of elap seconds */
+static int thermal_stats_seg_ibatt(int delta_uah, ktime_t elap)
 {
-	const u32 t = bd_state->bd_trigger_time;
-	const ktime_t bd_fan_alarm = t * FAN_BD_LIMIT_ALARM / 100;
-	const ktime_t bd_fan_high = t * FAN_BD_LIMIT_HIGH / 100;
-	const ktime_t bd_fan_med = t * FAN_BD_LIMIT_MED / 100;
-	long long temp_avg = 0;
-	int bd_fan_level = FAN_LVL_NOT_CARE;
+	return div_s64((s64)delta_uah * 3600, elap * 1000);
+}
 
-	if (bd_state->bd_temp_dry_run)
-		return FAN_LVL_NOT_CARE;
+/* NOTE: call holding thermal_stats->lock */
+static void thermal_stats_book_ibatt(struct thermal_stats_data *thermal_stats,
+				     int ibatt_ma, ktime_t elap)
+{
+	if (!thermal_stats->ibatt_segments || ibatt_ma < thermal_stats->ibatt_min)
+		thermal_stats->ibatt_min = ibatt_ma;
+	if (!thermal_stats->ibatt_segments || ibatt_ma > thermal_stats->ibatt_max)
+		thermal_stats->ibatt_max = ibatt_ma;
+	thermal_stats->ibatt_sum += (s64)ibatt_ma * elap;
+	thermal_stats->ibatt_segments += 1;
+}
 
-	if (bd_state->time_sum)
-		temp_avg = bd_state->temp_sum / bd_state->time_sum;
+/*
+ * Close the open segment (if any) and open a new one at the current levels
+ * when open is true. Reads the charge counter once. Battery current is booked
+ * only for segments after the first throttle, same as time_limited_sum_secs:
+ * call before updating max_thermal_level.
+ * NOTE: call holding thermal_stats->lock
+ */
+static void thermal_stats_segment(struct chg_drv *chg_drv, ktime_t now,
+				  bool open)
+{
+	struct thermal_stats_data *thermal_stats = &chg_drv->thermal_stats;
+	const ktime_t elap = now - thermal_stats->seg_start;
+	int i, cc, delta, ioerr;
 
-	if (temp_avg < bd_state->bd_trigger_temp)
-		bd_fan_level = FAN_LVL_NOT_CARE;
-	else if (bd_state->time_sum >= bd_fan_alarm)
-		bd_fan_level = FAN_LVL_ALARM;
-	else if (bd_state->time_sum >= bd_fan_high)
-		bd_fan_level = FAN_LVL_HIGH;
-	else if (bd_state->time_sum >= bd_fan_med)
-		bd_fan_level = FAN_LVL_MED;
+	cc = GPSY_GET_INT_PROP(chg_drv->bat_psy, POWER_SUPPLY_PROP_CHARGE_COUNTER,
+			       &ioerr);
+	if (ioerr < 0) {
+		pr_err("%s: cannot read charge counter (%d)\n", __func__, ioerr);
+		thermal_stats->seg_start = 0;
+		return;
+	}
 
-	pr_debug("bd_fan_level:%d, time_sum:%lld, temp_avg:%lld\n",
-		 bd_fan_level, bd_state->time_sum, temp_avg);
+	if (thermal_stats->seg_start) {
+		delta = cc - thermal_stats->seg_cc;
 
-	return bd_fan_level;
-}
+		for (i = 0; i < CHG_TERMAL_DEVICES_COUNT; i++) {
+			struct thermal_stats_bin *bin =
+				thermal_stats_bin(thermal_stats, i,
+						  thermal_stats->seg_level[i]);
 
-static void thermal_stats_init(struct thermal_stats_data *thermal_stats) {
-	thermal_stats->last_update = 0;
+			bin->charge_uah += delta;
+			bin->count += 1;
+		}
 
-	thermal_stats->max_thermal_level = 0;
-	thermal_stats->time_limited_sum_secs = 0;
+		/* average battery current over the segment */
+		if (thermal_stats->max_thermal_level > 0 && elap > 0)
+			thermal_stats_book_ibatt(thermal_stats,
+					thermal_stats_seg_ibatt(delta, elap),
+					elap);
+	}
 
-	thermal_stats->soc_in = -1;
+	thermal_stats->seg_start = 0;
+	if (!open)
+		return;
 
-	thermal_stats->ibatt_min = 0;
-	thermal_stats->ibatt_max = 0;
-	thermal_stats->ibatt_sum = 0;
+	for (i = 0; i < CHG_TERMAL_DEVICES_COUNT; i++)
+		thermal_stats->seg_level[i] =
+			chg_drv->thermal_devices[i].current_level;
+	thermal_stats->seg_cc = cc;
+	thermal_stats->seg_start = now;
 }
 
 static int chg_work_read_soc(struct power_supply *bat_psy, int *soc);
+
+/*
+ * Called from chg_work while connected. Time and ICL come from the state
+ * that chg_work already has: the battery is read only when the levels of
+ * the cooling devices change and once per session for the SOC.
+ */
 static void thermal_stats_work(struct chg_drv *chg_drv) {
 	struct thermal_stats_data *thermal_stats = &chg_drv->thermal_stats;
-	struct power_supply *bat_psy = chg_drv->bat_psy;
 	const uint16_t icl_settled = chg_drv->chg_state.f.icl;
 	const ktime_t now = get_boot_sec();
-	int i, ibatt_ma, ioerr;
+	bool changed;
+	int i;
 
 	mutex_lock(&thermal_stats->lock);
+	changed = !thermal_stats->seg_start;
+
+	if (thermal_stats->last_update) {
+		const ktime_t elap = now - thermal_stats->last_update;
+
+		for (i = 0; i < CHG_TERMAL_DEVICES_COUNT; i++)
+			thermal_stats_bin(thermal_stats, i,
+					  thermal_stats->seg_level[i])->time_secs += elap;
+
+		if (thermal_stats->max_thermal_level > 0) {
+			thermal_stats->icl_sum += icl_settled * elap;
+			thermal_stats->time_limited_sum_secs += elap;
+		}
+	}
+	thermal_stats->last_update = now;
+
+	for (i = 0; i < CHG_TERMAL_DEVICES_COUNT; i++)
+		if (chg_drv->thermal_devices[i].current_level !=
+		    thermal_stats->seg_level[i])
+			changed = true;
+
+	/* close the segment at the levels it was opened with */
+	if (changed)
+		thermal_stats_segment(chg_drv, now, true);
 
 	/* Calculate the max thermal level across thermal levels */
 	for (i = 0; i < CHG_TERMAL_DEVICES_COUNT; i++) {
 		const int current_level =
 			chg_drv->thermal_devices[i].current_level;
-		const int max_level = thermal_stats->max_thermal_level;
 
-		if (current_level > max_level)
+		if (current_level > thermal_stats->max_thermal_level)
 			thermal_stats->max_thermal_level = current_level;
 	}
 
 	/*
-	 * Do not collect any stats if the thermal level is 0. The max thermal
-	 * level will be cleared by userspace on disconnect.
+	 * Do not collect the summary if the thermal level is 0. The max
+	 * thermal level will be cleared by userspace on disconnect.
 	 */
 	if (thermal_stats->max_thermal_level <= 0)
 		goto thermal_stats_unlock;
 
-	ibatt_ma = GPSY_GET_INT_PROP(bat_psy, POWER_SUPPLY_PROP_CURRENT_NOW,
-				  &ioerr) / 1000;
-	if (ioerr < 0) {
-		pr_err("%s: read ibatt_ma=%d, ioerr=%d\n", __func__, ibatt_ma,
-		       ioerr);
-		goto thermal_stats_unlock;
-	}
-
-	if (thermal_stats->last_update == 0) {
+	if (thermal_stats->soc_in < 0) {
 		int soc, rc;
 
-		rc = chg_work_read_soc(bat_psy, &soc);
+		rc = chg_work_read_soc(chg_drv->bat_psy, &soc);
 		if (rc != 0) {
 			pr_err("%s: error retrieving SOC, return value: %d\n", __func__, rc);
 			goto thermal_stats_unlock;
 		}
 
 		thermal_stats->soc_in = soc;
-
-		thermal_stats->last_update = now;
-
-		thermal_stats->ibatt_min = ibatt_ma;
-		thermal_stats->ibatt_max = ibatt_ma;
-
 		thermal_stats->icl_min = icl_settled;
 		thermal_stats->icl_max = icl_settled;
 	} else {
-		const ktime_t elap = now - thermal_stats->last_update;
-
-		thermal_stats->last_update = now;
-
-		if (ibatt_ma < thermal_stats->ibatt_min)
-			thermal_stats->ibatt_min = ibatt_ma;
-		if (ibatt_ma > thermal_stats->ibatt_max)
-			thermal_stats->ibatt_max = ibatt_ma;
-		thermal_stats->ibatt_sum += ibatt_ma * elap;
-
 		if (icl_settled < thermal_stats->icl_min)
 			thermal_stats->icl_min = icl_settled;
 		if (icl_settled > thermal_stats->icl_max)
 			thermal_stats->icl_max = icl_settled;
-		thermal_stats->icl_sum += icl_settled * elap;
-
-		thermal_stats->time_limited_sum_secs += elap;
 	}
 
 thermal_stats_unlock:
 	mutex_unlock(&thermal_stats->lock);
 }
 
+/* close the open segment on disconnect */
+static void thermal_stats_disconnect(struct chg_drv *chg_drv)
+{
+	struct thermal_stats_data *thermal_stats = &chg_drv->thermal_stats;
+
+	mutex_lock(&thermal_stats->lock);
+	if (thermal_stats->seg_start)
+		thermal_stats_segment(chg_drv, get_boot_sec(), false);
+	thermal_stats->last_update = 0;
+	mutex_unlock(&thermal_stats->lock);
+}
+
 static int thermal_stats_lvl_to_vtier(int thermal_level) {
 	switch (thermal_level) {
 	case 0:
@@ -1476,115 +1433,6 @@ static int msc_temp_defend_dryrun_cb(struct gvotable_election *el,
 	return 0;
 }
 
-/* bd_state->triggered = 1 when charging needs to be disabled */
-static int bd_update_stats(struct bd_data *bd_state,
-			   struct power_supply *bat_psy)
-{
-	const bool triggered = bd_state->triggered;
-	const ktime_t now = get_boot_sec();
-	int ret, vbatt, temp;
-	long long temp_avg;
-
-	if (!bd_state->enabled)
-		return 0;
-
-	vbatt = GPSY_GET_INT_PROP(bat_psy, POWER_SUPPLY_PROP_VOLTAGE_AVG, &ret);
-	if (ret < 0)
-		return ret;
-
-	/* not over vbat and !triggered, nothing to see here */
-	if (vbatt < bd_state->bd_trigger_voltage && !triggered)
-		return 0;
-
-	/* it needs to keep averaging after trigger */
-	temp = GPSY_GET_INT_PROP(bat_psy, POWER_SUPPLY_PROP_TEMP, &ret);
-	if (ret < 0)
-		return ret;
-
-	/* it needs to keep averaging if triggered */
-	if (bd_state->last_update == 0)
-		bd_state->last_update = now;
-
-	if (temp >= bd_state->bd_trigger_temp) {
-		bd_state->time_sum += now - bd_state->last_update;
-		bd_state->temp_sum += temp * (now - bd_state->last_update);
-	}
-
-	bd_state->last_voltage = vbatt;
-	bd_state->last_temp = temp;
-	bd_state->last_update = now;
-
-	/* wait until we have at least bd_trigger_time */
-	if (bd_state->time_sum < bd_state->bd_trigger_time)
-		return 0;
-
-	/* exit and entry criteria on temperature while connected */
-	temp_avg = bd_state->temp_sum / bd_state->time_sum;
-	if (triggered && temp <= bd_state->bd_resume_abs_temp) {
-		pr_info("MSC_BD: resume time_sum=%lld, temp_sum=%lld, temp_avg=%lld\n",
-			bd_state->time_sum, bd_state->temp_sum, temp_avg);
-		bd_reset(bd_state);
-	} else if (!triggered && temp_avg >= bd_state->bd_trigger_temp) {
-		pr_info("MSC_BD: trigger time_sum=%lld, temp_sum=%lld, temp_avg=%lld\n",
-			bd_state->time_sum, bd_state->temp_sum, temp_avg);
-		bd_state->triggered = 1;
-	}
-
-	return 0;
-}
-
-/* @return true if BD needs to be triggered */
-static int bd_recharge_logic(struct bd_data *bd_state, int val)
-{
-	int lowerbd, upperbd;
-	int disable_charging = 0;
-
-	if (!bd_state->triggered && bd_state->dd_triggered) {
-		lowerbd = bd_state->dd_charge_start_level;
-		upperbd = bd_state->dd_charge_stop_level;
-		goto recharge_logic;
-	}
-
-	if (bd_state->bd_drainto_soc && bd_state->bd_recharge_soc) {
-		lowerbd = bd_state->bd_recharge_soc;
-		upperbd = bd_state->bd_drainto_soc;
-	} else if (bd_state->bd_recharge_voltage &&
-			bd_state->bd_trigger_voltage) {
-		lowerbd = bd_state->bd_recharge_voltage;
-		upperbd = bd_state->bd_trigger_voltage;
-	} else {
-		return 0;
-	}
-
-	if (bd_state->bd_temp_dry_run)
-		return 0;
-
-recharge_logic:
-	if (!bd_state->triggered && !bd_state->dd_triggered)
-		return 0;
-
-	/* recharge logic between bd_recharge_voltage and bd_trigger_voltage */
-	if (bd_state->lowerbd_reached && val >= upperbd) {
-		pr_info("MSC_BD lowerbd=%d, upperbd=%d, val=%d, lowerbd_reached=1->0, charging off\n",
-			lowerbd, upperbd, val);
-		bd_state->lowerbd_reached = false;
-		disable_charging = 1;
-	} else if (!bd_state->lowerbd_reached && val > lowerbd) {
-		pr_info("MSC_BD lowerbd=%d, upperbd=%d, val=%d, charging off\n",
-			lowerbd, upperbd, val);
-		disable_charging = 1;
-	} else if (!bd_state->lowerbd_reached && val <= lowerbd) {
-		pr_info("MSC_BD lowerbd=%d, upperbd=%d, val=%d, lowerbd_reached=0->1, charging on\n",
-			lowerbd, upperbd, val);
-		bd_state->lowerbd_reached = true;
-	} else {
-		pr_info("MSC_BD lowerbd=%d, upperbd=%d, val=%d, charging on\n",
-			lowerbd, upperbd, val);
-	}
-
-	return disable_charging;
-}
-
 /* ignore the failure to set CAPACITY: it might not be implemented */
 static int bd_batt_set_soc(struct chg_drv *chg_drv , int soc)
 {
@@ -1657,9 +1505,43 @@ static int chg_work_read_soc(struct power_supply *bat_psy, int *soc)
 }
 
 /*
- * Run in background after disconnect to reset the trigger.
+ * Read what the TEMP-DEFEND policy needs from the battery. TEMP is read only
+ * when the policy will use it (over trigger voltage or triggered).
+ */
+static int bd_read_sample(struct chg_drv *chg_drv, struct bd_sample *sample)
+{
+	const struct bd_data *bd_state = &chg_drv->bd_state;
+	int ret = 0;
+
+	sample->now = get_boot_sec();
+	sample->vbatt = 0;
+	sample->temp = 0;
+	sample->soc = -1;
+
+	if (!bd_state->enabled)
+		return 0;
+
+	sample->vbatt = GPSY_GET_INT_PROP(chg_drv->bat_psy,
+					  POWER_SUPPLY_PROP_VOLTAGE_AVG, &ret);
+	if (ret < 0)
+		return ret;
+
+	/* it needs to keep averaging after trigger */
+	if (bd_stats_needs_temp(bd_state, sample->vbatt)) {
+		sample->temp = GPSY_GET_INT_PROP(chg_drv->bat_psy,
+						 POWER_SUPPLY_PROP_TEMP, &ret);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Run from chg_work() after disconnect to reset the trigger.
  * The UI% is not frozen here: only battery health state (might) remain set to
  * POWER_SUPPLY_HEALTH_OVERHEAT until the condition clears.
+ * Returns the delay in ms for the next run, 0 when done.
  *
  * NOTE: this is only used to clear POWER_SUPPLY_HEALTH_OVERHEAT after
  * disconnect and (possibly to) adjust the UI.
@@ -1667,130 +1549,59 @@ static int chg_work_read_soc(struct power_supply *bat_psy, int *soc)
  *	bd_state->bd_resume_soc == 0 && bd_state->bd_resume_time == 0
  *
  */
-static void bd_work(struct work_struct *work)
+static int chg_bd_disconnected(struct chg_drv *chg_drv)
 {
-	struct chg_drv *chg_drv =
-		container_of(work, struct chg_drv, bd_work.work);
 	struct bd_data *bd_state = &chg_drv->bd_state;
-	const ktime_t now = get_boot_sec();
-	const long long delta_time = now - bd_state->disconnect_time;
-	int interval_ms = CHG_WORK_BD_TRIGGERED_MS;
-	int ret, soc = 0;
-
-	__pm_stay_awake(chg_drv->bd_ws);
+	const bool bd_ena = bd_state->bd_resume_soc || bd_state->bd_resume_time;
+	struct bd_sample sample;
+	int interval_ms = 0;
+	int ret;
 
 	mutex_lock(&chg_drv->bd_lock);
 
-	pr_debug("MSC_BD_WORK: triggered=%d dsc_time=%lld delta=%lld\n",
-		bd_state->triggered, bd_state->disconnect_time, delta_time);
+	/* always track disconnect time */
+	if (!bd_state->disconnect_time)
+		bd_state->disconnect_time = get_boot_sec();
 
-	/* stop running if battery defender or retail mode are triggered */
-	if (!bd_state->triggered || !bd_state->disconnect_time)
+	/* caller might reset bd_state, stop if retail mode is triggered */
+	if (!bd_state->triggered || !bd_ena)
 		goto bd_done;
 
-	/* soc after disconnect (SSOC must not be locked) */
-	if (bd_state->bd_resume_soc &&
-	    chg_work_read_soc(chg_drv->bat_psy, &soc) == 0 &&
-	    soc < bd_state->bd_resume_soc) {
-		pr_info("MSC_BD_WORK: done soc=%d limit=%d\n",
-			soc, bd_state->bd_resume_soc);
-
-		bd_reset(bd_state);
-		goto bd_rerun;
-	}
-
-	/* set on time and temperature, reset on abs temperature */
-	ret = bd_update_stats(bd_state, chg_drv->bat_psy);
+	ret = bd_read_sample(chg_drv, &sample);
 	if (ret < 0) {
 		pr_err("MSC_BD_WORK: update stats: %d\n", ret);
 		interval_ms = 1000;
-		goto bd_rerun;
-	}
-	bd_fan_vote(chg_drv, bd_state->triggered, FAN_LVL_HIGH);
-
-	/* reset on time since disconnect & optional temperature reading */
-	if (bd_state->bd_resume_time && delta_time > bd_state->bd_resume_time) {
-		const int temp = bd_state->last_temp; /* or use avg */
-		int triggered;
-
-		/* single reading < of resume temp, or total average temp */
-		triggered = bd_state->bd_resume_temp &&
-			    temp > bd_state->bd_resume_temp;
-		if (!triggered) {
-			pr_info("MSC_BD_WORK: done time=%lld limit=%d, temp=%d limit=%d\n",
-				delta_time, bd_state->bd_resume_time,
-				temp, bd_state->bd_resume_temp);
-
-			bd_reset(&chg_drv->bd_state);
-			goto bd_rerun;
-		}
+		goto bd_done;
 	}
 
-	pr_debug("MSC_BD_WORK: trig=%d soc=%d time=%lld limit=%d temp=%d limit=%d avg=%lld\n",
-		bd_state->triggered,
-		soc,
-		delta_time, bd_state->bd_resume_time,
-		bd_state->last_temp, bd_state->bd_resume_abs_temp,
-		bd_state->temp_sum / bd_state->time_sum);
+	/* soc after disconnect (SSOC must not be locked) */
+	if (bd_resume_needs_soc(bd_state) &&
+	    chg_work_read_soc(chg_drv->bat_psy, &sample.soc) < 0)
+		sample.soc = -1;
 
-bd_rerun:
-	if (!bd_state->triggered) {
+	if (!bd_disconnected_update(bd_state, &sample)) {
+		bd_fan_vote(chg_drv, true, FAN_LVL_HIGH);
+		interval_ms = CHG_WORK_BD_TRIGGERED_MS;
+	} else {
 		/* disable the overheat flag, race with DWELL-DEFEND */
 		bd_batt_set_overheat(chg_drv, false);
 		chg_update_charging_state(chg_drv, false, false);
-	} else {
-		schedule_delayed_work(&chg_drv->bd_work,
-				      msecs_to_jiffies(interval_ms));
+		bd_fan_vote(chg_drv, false, FAN_LVL_HIGH);
 	}
 
 bd_done:
 	mutex_unlock(&chg_drv->bd_lock);
-
-	__pm_relax(chg_drv->bd_ws);
+	return interval_ms;
 }
 
-static void chg_stop_bd_work(struct chg_drv *chg_drv)
+/* stop tracking disconnect when usb is back */
+static void chg_bd_reconnected(struct chg_drv *chg_drv)
 {
-	/* stop bd_work() when usb is back */
 	mutex_lock(&chg_drv->bd_lock);
-	if (chg_drv->bd_state.disconnect_time) {
-		chg_drv->bd_state.disconnect_time = 0;
-
-		/* might have never been scheduled */
-		cancel_delayed_work(&chg_drv->bd_work);
-	}
+	chg_drv->bd_state.disconnect_time = 0;
 	mutex_unlock(&chg_drv->bd_lock);
 }
 
-/*
- * If triggered, clear overheat and thaw soc on disconnect.
- * NOTE: Do not clear the defender state: will re-evaluate on next connect.
- * NOTE: bd_batt_set_state() needs to come before the chg disable
- */
-static int chg_start_bd_work(struct chg_drv *chg_drv)
-{
-	struct bd_data *bd_state = &chg_drv->bd_state;
-	const bool bd_ena = bd_state->bd_resume_soc || bd_state->bd_resume_time;
-
-	mutex_lock(&chg_drv->bd_lock);
-
-	/* always track disconnect time */
-	if (!bd_state->disconnect_time)
-		bd_state->disconnect_time = get_boot_sec();
-
-	/* caller might reset bd_state */
-	if (!bd_state->triggered || !bd_ena) {
-		mutex_unlock(&chg_drv->bd_lock);
-		return 0;
-	}
-
-	/* bd_work will keep track of time */
-	mod_delayed_work(system_wq, &chg_drv->bd_work, 0);
-	mutex_unlock(&chg_drv->bd_lock);
-
-	return 0;
-}
-
 /* dock_defend */
 static void bd_dd_init(struct chg_drv *chg_drv)
 {
@@ -1822,29 +1633,6 @@ static void bd_dd_init(struct chg_drv *chg_drv)
 		bd_state->dd_state, bd_state->dd_settings);
 }
 
-static int bd_dd_state_update(const int dd_state, const bool dd_triggered, const bool change)
-{
-	int new_state = dd_state;
-
-	switch (new_state) {
-	case DOCK_DEFEND_ENABLED:
-		if (dd_triggered && change)
-			new_state = DOCK_DEFEND_ACTIVE;
-		break;
-	case DOCK_DEFEND_ACTIVE:
-		if (!dd_triggered)
-			new_state = DOCK_DEFEND_ENABLED;
-		break;
-	default:
-		break;
-	}
-
-	return new_state;
-}
-
-#define dd_is_enabled(bd_state) \
-	((bd_state)->dd_state != DOCK_DEFEND_DISABLED && \
-	(bd_state)->dd_settings == DOCK_DEFEND_USER_ENABLED)
 static void bd_dd_run_defender(struct chg_drv *chg_drv, int soc, int *disable_charging, int *disable_pwrsrc)
 {
 	struct bd_data *bd_state = &chg_drv->bd_state;
@@ -1921,7 +1709,7 @@ static int chg_run_defender(struct chg_drv *chg_drv)
 		 * while TEMP-DEFEND is triggered or from Retail Mode.
 		 * Clear the TEMP-DEFEND status (thaw SOC and clear HEALTH) and
 		 * have usespace to report HEALTH status.
-		 * NOTE: if here, bd_work() was already stopped.
+		 * NOTE: if here, chg_bd_disconnected() is not running.
 		 */
 		if (chg_drv->bd_state.triggered) {
 			rc = bd_batt_set_state(chg_drv, false, -1);
@@ -1936,11 +1724,14 @@ static int chg_run_defender(struct chg_drv *chg_drv)
 
 	} else if (chg_drv->bd_state.enabled) {
 		const bool was_triggered = bd_state->triggered;
+		struct bd_sample sample;
 
-		/* bd_work() is not running here */
-		rc = bd_update_stats(bd_state, bat_psy);
+		/* chg_bd_disconnected() is not running here */
+		rc = bd_read_sample(chg_drv, &sample);
 		if (rc < 0)
 			pr_debug("MSC_DB BD update stats: %d\n", rc);
+		else
+			bd_update_stats(bd_state, &sample);
 
 		bd_fan_level = bd_fan_calculate_level(bd_state);
 
@@ -2139,6 +1930,7 @@ static void chg_work(struct work_struct *work)
 	int usb_online, usb_present = 0;
 	int present, online;
 	int update_interval = -1;
+	int bd_interval_ms = 0;
 	bool chg_done = false;
 	int success, rc = 0;
 
@@ -2220,9 +2012,8 @@ static void chg_work(struct work_struct *work)
 		if (chg_drv->bd_state.dd_state == DOCK_DEFEND_ACTIVE)
 			chg_drv->bd_state.dd_state = DOCK_DEFEND_ENABLED;
 
-		rc = chg_start_bd_work(chg_drv);
-		if (rc < 0)
-			goto rerun_error;
+		/* TEMP-DEFEND resume runs from here while disconnected */
+		bd_interval_ms = chg_bd_disconnected(chg_drv);
 
 		if (stop_charging) {
 			int ret;
@@ -2255,6 +2046,8 @@ static void chg_work(struct work_struct *work)
 		if (chg_is_custom_enabled(upperbd, lowerbd) && chg_drv->disable_pwrsrc)
 			chg_run_defender(chg_drv);
 
+		thermal_stats_disconnect(chg_drv);
+
 		/* clear the status */
 		chg_update_csi(chg_drv);
 
@@ -2262,6 +2055,11 @@ static void chg_work(struct work_struct *work)
 		if (chg_drv->disable_pwrsrc)
 			__pm_relax(chg_drv->bd_ws);
 
+		/* keep tracking TEMP-DEFEND resume while triggered */
+		if (bd_interval_ms > 0)
+			schedule_delayed_work(&chg_drv->chg_work,
+					      msecs_to_jiffies(bd_interval_ms));
+
 		goto exit_chg_work;
 	} else {
 		// Run thermal stats when connected to power (preset || online)
@@ -2271,8 +2069,8 @@ static void chg_work(struct work_struct *work)
 			const bool restore_fcc =
 				chg_drv->therm_wlc_override_fcc;
 
-			/* Stop BD work after disconnect */
-			chg_stop_bd_work(chg_drv);
+			/* Stop TEMP-DEFEND resume after disconnect */
+			chg_bd_reconnected(chg_drv);
 
 			/* will re-enable charging after setting FCC,CC_MAX */
 			if (restore_fcc)
@@ -3549,12 +3347,44 @@ thermal_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
 	max_thermal_level = thermal_stats->max_thermal_level;
 	if (max_thermal_level != 0) {
 		const int vtier = thermal_stats_lvl_to_vtier(max_thermal_level);
-		const int32_t elap = thermal_stats->time_limited_sum_secs;
+		const ktime_t now = get_boot_sec();
+		int32_t elap = thermal_stats->time_limited_sum_secs;
+		int32_t ibatt_min = thermal_stats->ibatt_min;
+		int32_t ibatt_max = thermal_stats->ibatt_max;
+		int64_t ibatt_sum = thermal_stats->ibatt_sum;
+		int64_t icl_sum = thermal_stats->icl_sum;
 		int ibatt_avg, icl_avg;
 
+		/* time and ICL since the last chg_work */
+		if (thermal_stats->last_update && now > thermal_stats->last_update) {
+			const ktime_t tail = now - thermal_stats->last_update;
+
+			elap += tail;
+			icl_sum += chg_drv->chg_state.f.icl * tail;
+		}
+
+		/* the open segment is booked only when it closes */
+		if (thermal_stats->seg_start && now > thermal_stats->seg_start) {
+			const ktime_t seg_elap = now - thermal_stats->seg_start;
+			int cc, ioerr, ibatt_ma;
+
+			cc = GPSY_GET_INT_PROP(chg_drv->bat_psy,
+					       POWER_SUPPLY_PROP_CHARGE_COUNTER,
+					       &ioerr);
+			if (ioerr == 0) {
+				ibatt_ma = thermal_stats_seg_ibatt(cc - thermal_stats->seg_cc,
+								   seg_elap);
+				if (!thermal_stats->ibatt_segments || ibatt_ma < ibatt_min)
+					ibatt_min = ibatt_ma;
+				if (!thermal_stats->ibatt_segments || ibatt_ma > ibatt_max)
+					ibatt_max = ibatt_ma;
+				ibatt_sum += (s64)ibatt_ma * seg_elap;
+			}
+		}
+
 		if (elap) {
-			ibatt_avg = thermal_stats->ibatt_sum / elap;
-			icl_avg = thermal_stats->icl_sum / elap;
+			ibatt_avg = ibatt_sum / elap;
+			icl_avg = icl_sum / elap;
 		} else {
 			ibatt_avg = 0;
 			icl_avg = 0;
@@ -3565,10 +3395,10 @@ thermal_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
 				 "%d, %d.0,0,0, 0,0,%d, 0,0,0, %d,%d,%d, %d,%d,%d",
 				 vtier,
 				 thermal_stats->soc_in,
-				 thermal_stats->time_limited_sum_secs,
-				 thermal_stats->ibatt_min,
+				 elap,
+				 ibatt_min,
 				 ibatt_avg,
-				 thermal_stats->ibatt_max,
+				 ibatt_max,
 				 thermal_stats->icl_min,
 				 icl_avg,
 				 thermal_stats->icl_max);
@@ -3601,6 +3431,32 @@ static ssize_t thermal_stats_store(struct device *dev,
 
 static DEVICE_ATTR_RW(thermal_stats);
 
+static ssize_t thermal_hist_read(struct file *filp, struct kobject *kobj,
+				 struct bin_attribute *attr, char *buf,
+				 loff_t off, size_t count)
+{
+	struct chg_drv *chg_drv = dev_get_drvdata(kobj_to_dev(kobj));
+	struct thermal_stats_data *thermal_stats = &chg_drv->thermal_stats;
+	const struct thermal_stats_hist_hdr hdr = {
+		.version = CHG_THERMAL_HIST_VERSION,
+		.devices = CHG_TERMAL_DEVICES_COUNT,
+		.levels = CHG_THERMAL_STATS_LEVELS,
+		.bin_size = sizeof(struct thermal_stats_bin),
+	};
+	u8 data[sizeof(hdr) + sizeof(thermal_stats->hist)];
+
+	memcpy(data, &hdr, sizeof(hdr));
+	mutex_lock(&thermal_stats->lock);
+	memcpy(&data[sizeof(hdr)], thermal_stats->hist,
+	       sizeof(thermal_stats->hist));
+	mutex_unlock(&thermal_stats->lock);
+
+	return memory_read_from_buffer(buf, count, &off, data, sizeof(data));
+}
+
+static BIN_ATTR_RO(thermal_hist, sizeof(struct thermal_stats_hist_hdr) +
+		   sizeof(((struct thermal_stats_data *)0)->hist));
+
 static int chg_init_fs(struct chg_drv *chg_drv)
 {
 	int ret;
@@ -3722,6 +3578,12 @@ static int chg_init_fs(struct chg_drv *chg_drv)
 		return ret;
 	}
 
+	ret = device_create_bin_file(chg_drv->device, &bin_attr_thermal_hist);
+	if (ret != 0) {
+		pr_err("Failed to create thermal_hist, ret=%d\n", ret);
+		return ret;
+	}
+
 	/* dock_defend */
 	if (chg_drv->ext_psy_name) {
 		ret = device_create_file(chg_drv->device, &dev_attr_dd_state);
@@ -3766,6 +3628,7 @@ static int chg_init_fs(struct chg_drv *chg_drv)
 			    chg_drv, &chg_ui_fops);
 	debugfs_create_file("force_reschedule", 0600, chg_drv->debug_entry,
 			    chg_drv, &chg_reschedule_work_fops);
+	gbms_psy_batch_debugfs(&chg_drv->chg_psy_batch, chg_drv->debug_entry);
 
 	debugfs_create_bool("usb_skip_probe", 0600, chg_drv->debug_entry,
 			    &chg_drv->usb_skip_probe);
@@ -5068,12 +4931,12 @@ static int google_charger_probe(struct platform_device *pdev)
 		pr_err("Failed to register wakeup source\n");
 		return -ENODEV;
 	}
-	INIT_DELAYED_WORK(&chg_drv->bd_work, bd_work);
 	bd_init(&chg_drv->bd_state, chg_drv->device);
 
 	INIT_DELAYED_WORK(&chg_drv->init_work, google_charger_init_work);
 	INIT_DELAYED_WORK(&chg_drv->chg_work, chg_work);
-	INIT_WORK(&chg_drv->chg_psy_work, chg_psy_work);
+	gbms_psy_batch_init(&chg_drv->chg_psy_batch, GBMS_PSY_BATCH_WINDOW_MS,
+			    chg_psy_batch);
 	platform_set_drvdata(pdev, chg_drv);
 
 	alarm_init(&chg_drv->chg_wakeup_alarm, ALARM_BOOTTIME,
@@ -5115,6 +4978,7 @@ static int google_charger_remove(struct platform_device *pdev)
 			cancel_work_sync(&chg_drv->chg_term.work);
 		}
 
+		gbms_psy_batch_cancel(&chg_drv->chg_psy_batch);
 		chg_destroy_votables(chg_drv);
 
 		if (chg_drv->chg_psy)
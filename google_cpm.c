@@ -74,6 +74,24 @@
 /* enough time for the charger to settle to a new limit */
 #define GCPM_TAPER_STEP_INTERVAL_S	120
 
+/*
+ * Taper schedule, computed once when the countdown starts: cc_max goes
+ * linearly from start_iin to target_iin (the handoff current to the main
+ * charger) over taper_step_count steps. The voltage and current gates use
+ * averaged readings and latch open, telemetry is not read after that.
+ */
+struct gcpm_taper {
+	bool active;
+	bool gate_open;
+	int start_iin;
+	int target_iin;
+	int cc_max;			/* last preset, -1 when none */
+	int ibatt_avg;			/* EWMA when CURRENT_AVG is missing */
+	int vbatt_avg;			/* EWMA when VOLTAGE_AVG is missing */
+	ktime_t start_time;
+	ktime_t predicted_end;
+};
+
 /* TODO: move to configuration */
 #define DC_TA_VMAX_MV		9800000
 /* TODO: move to configuration */
@@ -224,6 +242,7 @@ struct gcpm_drv  {
 	u32 taper_step_fv_margin;		/* countdown steps before dc_done */
 	u32 taper_step_cc_step;		/* countdown steps before dc_done */
 	int taper_step;			/* actual countdown */
+	struct gcpm_taper taper;	/* schedule, from taper start */
 
 	/* policy: soc% based limits for DC charging */
 	u32 dc_limit_soc_high;		/* DC will not start over high */
@@ -246,6 +265,7 @@ struct gcpm_drv  {
 	bool init_complete;
 	bool resume_complete;
 	struct notifier_block chg_nb;
+	struct gbms_psy_batch chg_psy_batch;
 
 	/* tie up to charger mode */
 	struct gvotable_election *gbms_mode;
@@ -1196,6 +1216,26 @@ static int gcpm_pps_offline(struct gcpm_drv *gcpm)
 	return 0;
 }
 
+static void gcpm_taper_end(struct gcpm_drv *gcpm)
+{
+	struct gcpm_taper *taper = &gcpm->taper;
+	const ktime_t now = get_boot_sec();
+
+	if (!taper->active)
+		return;
+
+	pr_info("CHG_CHK: taper end iin=%d->%d predicted=%lld actual=%lld\n",
+		taper->start_iin, taper->cc_max,
+		taper->predicted_end - taper->start_time,
+		now - taper->start_time);
+	logbuffer_log(gcpm->log, "taper end iin=%d->%d predicted=%lld actual=%lld",
+		      taper->start_iin, taper->cc_max,
+		      taper->predicted_end - taper->start_time,
+		      now - taper->start_time);
+
+	taper->active = false;
+}
+
 /* <=0 to disable, > 0 to enable "n" counts */
 static bool gcpm_taper_ctl(struct gcpm_drv *gcpm, int count)
 {
@@ -1204,6 +1244,7 @@ static bool gcpm_taper_ctl(struct gcpm_drv *gcpm, int count)
 	if (count <= 0) {
 		changed = gcpm->taper_step != 0;
 		gcpm->taper_step = 0;
+		gcpm_taper_end(gcpm);
 	} else if (gcpm->taper_step == 0) {
 		gcpm->taper_step = count;
 		changed = true;
@@ -1212,15 +1253,101 @@ static bool gcpm_taper_ctl(struct gcpm_drv *gcpm, int count)
 	return changed;
 }
 
+/* compute the schedule once, dc_iin is the current at taper start */
+static void gcpm_taper_start(struct gcpm_drv *gcpm, int dc_iin)
+{
+	struct gcpm_taper *taper = &gcpm->taper;
+	int target = dc_iin;
+
+	if (gcpm->taper_step_cc_step) {
+		target = dc_iin - gcpm->taper_step_count * gcpm->taper_step_cc_step;
+		if (target < dc_iin / 2)
+			target = dc_iin / 2;
+	}
+
+	taper->active = true;
+	taper->gate_open = !gcpm->taper_step_voltage && !gcpm->taper_step_current;
+	taper->start_iin = dc_iin;
+	taper->target_iin = target;
+	taper->cc_max = -1;
+	taper->ibatt_avg = -1;
+	taper->vbatt_avg = -1;
+	taper->start_time = get_boot_sec();
+	taper->predicted_end = taper->start_time +
+			       gcpm->taper_step * gcpm->taper_step_interval;
+
+	pr_info("CHG_CHK: taper start iin=%d->%d steps=%d interval=%d\n",
+		dc_iin, target, gcpm->taper_step, gcpm->taper_step_interval);
+}
+
+/* prefer the average from the charger, EWMA of the instant value if not */
+static int gcpm_taper_read_avg(struct power_supply *psy,
+			       enum power_supply_property psp_avg,
+			       enum power_supply_property psp_now,
+			       int *avg)
+{
+	int ret, val;
+
+	val = GPSY_GET_INT_PROP(psy, psp_avg, &ret);
+	if (ret == 0) {
+		*avg = val;
+		return 0;
+	}
+
+	val = GPSY_GET_INT_PROP(psy, psp_now, &ret);
+	if (ret < 0)
+		return ret;
+
+	*avg = *avg < 0 ? val : (*avg * 3 + val) / 4;
+	return 0;
+}
+
+/* optional voltage and current limits before the countdown, latched */
+static bool gcpm_taper_gate(struct gcpm_drv *gcpm, struct power_supply *dc_psy)
+{
+	struct gcpm_taper *taper = &gcpm->taper;
+	int ret;
+
+	if (taper->gate_open)
+		return true;
+
+	/* Optional dc voltage limit */
+	if (gcpm->taper_step_voltage) {
+		ret = gcpm_taper_read_avg(dc_psy, POWER_SUPPLY_PROP_VOLTAGE_AVG,
+					  POWER_SUPPLY_PROP_VOLTAGE_NOW,
+					  &taper->vbatt_avg);
+		if (ret < 0)
+			pr_err("%s: cannot read voltage (%d)", __func__, ret);
+		else if (taper->vbatt_avg < gcpm->taper_step_voltage)
+			return false;
+	}
+
+	/* Optional dc current limit */
+	if (gcpm->taper_step_current) {
+		ret = gcpm_taper_read_avg(dc_psy, POWER_SUPPLY_PROP_CURRENT_AVG,
+					  POWER_SUPPLY_PROP_CURRENT_NOW,
+					  &taper->ibatt_avg);
+		if (ret < 0)
+			pr_err("%s: cannot read current (%d)", __func__, ret);
+		else if (taper->ibatt_avg > gcpm->taper_step_current)
+			return false;
+	}
+
+	taper->gate_open = true;
+	return true;
+}
+
 /*
  * taper off charging current to ease the transition out of CP charging.
- * NOTE: this writes directly to the charging current.
+ * NOTE: this writes directly to the charging current, only when the
+ * scheduled value is below the current DC input current.
  */
-static bool gcpm_taper_step(const struct gcpm_drv *gcpm,
-			   int dc_iin, int taper_step)
+static bool gcpm_taper_step(struct gcpm_drv *gcpm, int dc_iin, int taper_step)
 {
-	const int delta = gcpm->taper_step_count - taper_step;
-	int fv_uv = gcpm->fv_uv, cc_max = dc_iin;
+	struct gcpm_taper *taper = &gcpm->taper;
+	const int count = gcpm->taper_step_count;
+	const int delta = count - taper_step;
+	int fv_uv = gcpm->fv_uv, cc_max;
 	struct power_supply *dc_psy;
 
 	if (taper_step <= 0)
@@ -1233,39 +1360,23 @@ static bool gcpm_taper_step(const struct gcpm_drv *gcpm,
 	if (!dc_psy)
 		return true;
 
-	/* Optional dc voltage limit */
-	if (gcpm->taper_step_voltage) {
-		int vbatt;
-
-		vbatt = GPSY_GET_PROP(dc_psy, POWER_SUPPLY_PROP_VOLTAGE_NOW);
-		if (vbatt < 0)
-			pr_err("%s: cannot read voltage (%d)", __func__, vbatt);
-		else if (vbatt < gcpm->taper_step_voltage)
-			return false;
-	}
-
-	/* Optional dc current limit */
-	if (gcpm->taper_step_current) {
-		int ret, ibatt;
+	if (!taper->active)
+		gcpm_taper_start(gcpm, dc_iin);
 
-		/* TODO: use current average if available */
-		ret = GPSY_GET_INT_PROP(dc_psy, POWER_SUPPLY_PROP_CURRENT_NOW,
-					&ibatt);
-		if (ret < 0)
-			pr_err("%s: cannot read current (%d)", __func__, ret);
-		else if (ibatt > gcpm->taper_step_current)
-			return false;
-	}
+	if (!gcpm_taper_gate(gcpm, dc_psy))
+		return false;
 
-	/* delta < 0 during the grace period, which will increase cc_max */
+	/* delta <= 0 during the grace period, stays at start_iin */
 	fv_uv -= gcpm->taper_step_fv_margin;
-	if (gcpm->taper_step_cc_step) {
-		cc_max -= delta * gcpm->taper_step_cc_step;
-		if (cc_max < dc_iin / 2)
-			cc_max = dc_iin / 2;
-	}
+	cc_max = taper->start_iin;
+	if (delta > 0 && count > 0)
+		cc_max -= (taper->start_iin - taper->target_iin) *
+			  min(delta, count) / count;
 
-	/* increase of cc_max due to delta < 0 are ignored */
+	/*
+	 * increase of cc_max are ignored. dc_iin is the baseline: keep
+	 * presetting until the CP runs at the scheduled current.
+	 */
 	if (cc_max < dc_iin) {
 		int ret;
 
@@ -1279,15 +1390,14 @@ static bool gcpm_taper_step(const struct gcpm_drv *gcpm,
 			return true;
 		}
 
+		taper->cc_max = cc_max;
+		logbuffer_log(gcpm->log, "taper_step=%d delta=%d fv_uv=%d->%d, dc_iin=%d->%d",
+			      taper_step, delta, gcpm->fv_uv, fv_uv, dc_iin, cc_max);
 	} else {
 		pr_debug("CHG_CHK: grace taper_step=%d fv_uv=%d, dc_iin=%d\n",
 			 taper_step, gcpm->fv_uv, dc_iin);
 	}
 
-	logbuffer_log(gcpm->log, "taper_step=%d delta=%d fv_uv=%d->%d, dc_iin=%d->%d",
-		      taper_step, delta, gcpm->fv_uv, fv_uv, dc_iin, cc_max);
-
-
 	/* not done */
 	return false;
 }
@@ -2150,6 +2260,24 @@ static struct power_supply_desc gcpm_psy_desc = {
 #define gcpm_psy_changed_tickle_pps(gcpm) \
 	((gcpm)->dc_state == DC_PASSTHROUGH || (gcpm)->dc_state == DC_RUNNING)
 
+/* bits in the mask passed to gcpm_psy_batch() */
+enum gcpm_psy_source {
+	GCPM_PSY_SRC_ACTIVE = 0,
+	GCPM_PSY_SRC_MAIN,
+	GCPM_PSY_SRC_TCPM,
+	GCPM_PSY_SRC_WLC_DC,
+};
+
+/* once per burst of notifications that need to tickle the PPS loop */
+static void gcpm_psy_batch(struct gbms_psy_batch *batch, unsigned long changed)
+{
+	struct gcpm_drv *gcpm = container_of(batch, struct gcpm_drv,
+					     chg_psy_batch);
+
+	pr_debug("%s changed=%lx\n", __func__, changed);
+	mod_delayed_work(system_wq, &gcpm->pps_work, 0);
+}
+
 static int gcpm_psy_changed(struct notifier_block *nb, unsigned long action,
 			    void *data)
 {
@@ -2157,6 +2285,7 @@ static int gcpm_psy_changed(struct notifier_block *nb, unsigned long action,
 	const int index = gcpm->chg_psy_active;
 	struct power_supply *psy = data;
 	bool tickle_pps_work = false;
+	int source = -1;
 
 	if (index == -1)
 		return NOTIFY_OK;
@@ -2171,24 +2300,28 @@ static int gcpm_psy_changed(struct notifier_block *nb, unsigned long action,
 			power_supply_changed(gcpm->psy);
 
 		tickle_pps_work = gcpm_psy_changed_tickle_pps(gcpm);
+		source = GCPM_PSY_SRC_ACTIVE;
 	} else if (strcmp(psy->desc->name, gcpm->chg_psy_names[0]) == 0) {
 		/* possibly JEITA or other violation, check PPS */
 		tickle_pps_work = gcpm_psy_changed_tickle_pps(gcpm);
+		source = GCPM_PSY_SRC_MAIN;
 	} else if (gcpm->tcpm_psy_name &&
 		   !strcmp(psy->desc->name, gcpm->tcpm_psy_name)) {
 
 		/* from tcpm source (even if not selected) */
 		tickle_pps_work = gcpm_psy_changed_tickle_pps(gcpm);
+		source = GCPM_PSY_SRC_TCPM;
 	} else if (gcpm->wlc_dc_name &&
 	      !strcmp(psy->desc->name, gcpm->wlc_dc_name)) {
 
 		/* from wc source (even if not selected) */
 		tickle_pps_work = gcpm_psy_changed_tickle_pps(gcpm);
+		source = GCPM_PSY_SRC_WLC_DC;
 	}
 
 	/* should tickle the PPS loop only when is running */
 	if (tickle_pps_work)
-		mod_delayed_work(system_wq, &gcpm->pps_work, 0);
+		gbms_psy_batch_notify(&gcpm->chg_psy_batch, source);
 
 	return NOTIFY_OK;
 }
@@ -3578,6 +3711,7 @@ static struct dentry *gcpm_init_fs(struct gcpm_drv *gcpm)
 
 	debugfs_create_file("dc_state", 0644, de, gcpm, &gcpm_debug_dc_state_fops);
 	debugfs_create_file("active", 0644, de, gcpm, &gcpm_debug_active_fops);
+	gbms_psy_batch_debugfs(&gcpm->chg_psy_batch, de);
 	debugfs_create_file("dc_limit_demand", 0644, de, gcpm,
 			    &gcpm_debug_dc_limit_demand_fops);
 
@@ -3766,6 +3900,8 @@ static int google_cpm_probe(struct platform_device *pdev)
 	gcpm->cp_fcc_hold_limit = -1;
 
 	INIT_DELAYED_WORK(&gcpm->pps_work, gcpm_pps_wlc_dc_work);
+	gbms_psy_batch_init(&gcpm->chg_psy_batch, GBMS_PSY_BATCH_WINDOW_MS,
+			    gcpm_psy_batch);
 	INIT_DELAYED_WORK(&gcpm->select_work, gcpm_chg_select_work);
 	INIT_DELAYED_WORK(&gcpm->init_work, gcpm_init_work);
 	mutex_init(&gcpm->chg_psy_lock);
@@ -4011,6 +4147,7 @@ static int google_cpm_remove(struct platform_device *pdev)
 	if (!gcpm)
 		return 0;
 
+	gbms_psy_batch_cancel(&gcpm->chg_psy_batch);
 	gvotable_destroy_election(gcpm->dc_fcc_votable);
 
 	for (i = 0; i < gcpm->chg_psy_count; i++) {
@@ -0,0 +1,343 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright 2022 Google, LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/of.h>
+#include <linux/printk.h>
+#include "google_bms.h"
+#include "google_defender.h"
+
+/*
+ * called on init and to reset the trigger
+ * TEMP-DEFEND needs to have triggers for voltage, time and temperature, a
+ * recharge voltage and some way to resume normal behavior. Resume can happen
+ * based on at least ONE of the following criteria:
+ * - when battery temperature fall under a limit
+ * - at disconnect
+ * - after disconnect if the SOC drops under limit
+ * - some time after disconnect (optional if temperature under limit)
+ */
+void bd_reset(struct bd_data *bd_state)
+{
+	bool can_resume = bd_state->bd_resume_abs_temp ||
+			  bd_state->bd_resume_time ||
+			  (bd_state->bd_resume_time == 0 &&
+			  bd_state->bd_resume_soc == 0);
+
+	bd_state->time_sum = 0;
+	bd_state->temp_sum = 0;
+	bd_state->last_update = 0;
+	bd_state->last_voltage = 0;
+	bd_state->last_temp = 0;
+	bd_state->triggered = 0;
+	bd_state->dd_triggered = 0;
+
+	/* also disabled when externally triggered, resume_temp is optional */
+	bd_state->enabled = ((bd_state->bd_trigger_voltage &&
+				bd_state->bd_recharge_voltage) ||
+				(bd_state->bd_drainto_soc &&
+				bd_state->bd_recharge_soc)) &&
+			    bd_state->bd_trigger_time &&
+			    bd_state->bd_trigger_temp &&
+			    bd_state->bd_temp_enable &&
+			    can_resume;
+}
+
+/* Defender */
+void bd_init(struct bd_data *bd_state, struct device *dev)
+{
+	int ret;
+
+	ret = of_property_read_u32(dev->of_node, "google,bd-trigger-voltage",
+				   &bd_state->bd_trigger_voltage);
+	if (ret < 0)
+		bd_state->bd_trigger_voltage = 0;
+
+	ret = of_property_read_u32(dev->of_node, "google,bd-drainto-soc",
+				   &bd_state->bd_drainto_soc);
+	if (ret < 0)
+		bd_state->bd_drainto_soc = 0;
+
+	ret = of_property_read_u32(dev->of_node, "google,bd-trigger-temp",
+				   &bd_state->bd_trigger_temp);
+	if (ret < 0)
+		bd_state->bd_trigger_temp = 0;
+
+	ret = of_property_read_u32(dev->of_node, "google,bd-trigger-time",
+				   &bd_state->bd_trigger_time);
+	if (ret < 0)
+		bd_state->bd_trigger_time = 0; /* hours */
+
+	ret = of_property_read_u32(dev->of_node, "google,bd-recharge-voltage",
+				   &bd_state->bd_recharge_voltage);
+	if (ret < 0)
+		bd_state->bd_recharge_voltage = 0;
+
+	ret = of_property_read_u32(dev->of_node, "google,bd-recharge-soc",
+				   &bd_state->bd_recharge_soc);
+	if (ret < 0)
+		bd_state->bd_recharge_soc = 0;
+
+	ret = of_property_read_u32(dev->of_node, "google,bd-resume-abs-temp",
+				   &bd_state->bd_resume_abs_temp);
+	if (ret < 0)
+		bd_state->bd_resume_abs_temp = 0;
+
+	ret = of_property_read_u32(dev->of_node, "google,bd-resume-soc",
+				   &bd_state->bd_resume_soc);
+	if (ret < 0)
+		bd_state->bd_resume_soc = 0;
+
+	ret = of_property_read_u32(dev->of_node, "google,bd-resume-temp",
+				   &bd_state->bd_resume_temp);
+	if (ret < 0)
+		bd_state->bd_resume_temp = 0;
+
+	ret = of_property_read_u32(dev->of_node, "google,bd-resume-time",
+				   &bd_state->bd_resume_time);
+	if (ret < 0)
+		bd_state->bd_resume_time = 0;
+
+	bd_state->bd_temp_dry_run =
+		 of_property_read_bool(dev->of_node, "google,bd-temp-dry-run");
+
+	bd_state->bd_temp_enable =
+		 of_property_read_bool(dev->of_node, "google,bd-temp-enable");
+
+	/* also call to resume charging */
+	bd_reset(bd_state);
+	if (!bd_state->enabled)
+		dev_warn(dev, "TEMP-DEFEND not enabled\n");
+
+	pr_info("MSC_BD: trig volt=%d,%d temp=%d,time=%d drainto=%d,%d resume=%d,%d %d,%d\n",
+		bd_state->bd_trigger_voltage, bd_state->bd_recharge_voltage,
+		bd_state->bd_trigger_temp, bd_state->bd_trigger_time,
+		bd_state->bd_drainto_soc, bd_state->bd_recharge_soc,
+		bd_state->bd_resume_abs_temp, bd_state->bd_resume_soc,
+		bd_state->bd_resume_temp, bd_state->bd_resume_time);
+}
+
+#define FAN_BD_LIMIT_ALARM	75
+#define FAN_BD_LIMIT_HIGH	50
+#define FAN_BD_LIMIT_MED	25
+int bd_fan_calculate_level(const struct bd_data *bd_state)
+{
+	const u32 t = bd_state->bd_trigger_time;
+	const ktime_t bd_fan_alarm = t * FAN_BD_LIMIT_ALARM / 100;
+	const ktime_t bd_fan_high = t * FAN_BD_LIMIT_HIGH / 100;
+	const ktime_t bd_fan_med = t * FAN_BD_LIMIT_MED / 100;
+	long long temp_avg = 0;
+	int bd_fan_level = FAN_LVL_NOT_CARE;
+
+	if (bd_state->bd_temp_dry_run)
+		return FAN_LVL_NOT_CARE;
+
+	if (bd_state->time_sum)
+		temp_avg = bd_state->temp_sum / bd_state->time_sum;
+
+	if (temp_avg < bd_state->bd_trigger_temp)
+		bd_fan_level = FAN_LVL_NOT_CARE;
+	else if (bd_state->time_sum >= bd_fan_alarm)
+		bd_fan_level = FAN_LVL_ALARM;
+	else if (bd_state->time_sum >= bd_fan_high)
+		bd_fan_level = FAN_LVL_HIGH;
+	else if (bd_state->time_sum >= bd_fan_med)
+		bd_fan_level = FAN_LVL_MED;
+
+	pr_debug("bd_fan_level:%d, time_sum:%lld, temp_avg:%lld\n",
+		 bd_fan_level, bd_state->time_sum, temp_avg);
+
+	return bd_fan_level;
+}
+
+/* not over vbat and !triggered, nothing to see here */
+bool bd_stats_needs_temp(const struct bd_data *bd_state, int vbatt)
+{
+	return bd_state->enabled &&
+	       (vbatt >= bd_state->bd_trigger_voltage || bd_state->triggered);
+}
+
+/* bd_state->triggered = 1 when charging needs to be disabled */
+void bd_update_stats(struct bd_data *bd_state, const struct bd_sample *sample)
+{
+	const bool triggered = bd_state->triggered;
+	const ktime_t now = sample->now;
+	const int temp = sample->temp;
+	long long temp_avg;
+
+	if (!bd_stats_needs_temp(bd_state, sample->vbatt))
+		return;
+
+	/* it needs to keep averaging if triggered */
+	if (bd_state->last_update == 0)
+		bd_state->last_update = now;
+
+	if (temp >= bd_state->bd_trigger_temp) {
+		bd_state->time_sum += now - bd_state->last_update;
+		bd_state->temp_sum += temp * (now - bd_state->last_update);
+	}
+
+	bd_state->last_voltage = sample->vbatt;
+	bd_state->last_temp = temp;
+	bd_state->last_update = now;
+
+	/* wait until we have at least bd_trigger_time */
+	if (bd_state->time_sum < bd_state->bd_trigger_time)
+		return;
+
+	/* exit and entry criteria on temperature while connected */
+	temp_avg = bd_state->temp_sum / bd_state->time_sum;
+	if (triggered && temp <= bd_state->bd_resume_abs_temp) {
+		pr_info("MSC_BD: resume time_sum=%lld, temp_sum=%lld, temp_avg=%lld\n",
+			bd_state->time_sum, bd_state->temp_sum, temp_avg);
+		bd_reset(bd_state);
+	} else if (!triggered && temp_avg >= bd_state->bd_trigger_temp) {
+		pr_info("MSC_BD: trigger time_sum=%lld, temp_sum=%lld, temp_avg=%lld\n",
+			bd_state->time_sum, bd_state->temp_sum, temp_avg);
+		bd_state->triggered = 1;
+	}
+}
+
+/* @return true if BD needs to be triggered */
+int bd_recharge_logic(struct bd_data *bd_state, int val)
+{
+	int lowerbd, upperbd;
+	int disable_charging = 0;
+
+	if (!bd_state->triggered && bd_state->dd_triggered) {
+		lowerbd = bd_state->dd_charge_start_level;
+		upperbd = bd_state->dd_charge_stop_level;
+		goto recharge_logic;
+	}
+
+	if (bd_state->bd_drainto_soc && bd_state->bd_recharge_soc) {
+		lowerbd = bd_state->bd_recharge_soc;
+		upperbd = bd_state->bd_drainto_soc;
+	} else if (bd_state->bd_recharge_voltage &&
+			bd_state->bd_trigger_voltage) {
+		lowerbd = bd_state->bd_recharge_voltage;
+		upperbd = bd_state->bd_trigger_voltage;
+	} else {
+		return 0;
+	}
+
+	if (bd_state->bd_temp_dry_run)
+		return 0;
+
+recharge_logic:
+	if (!bd_state->triggered && !bd_state->dd_triggered)
+		return 0;
+
+	/* recharge logic between bd_recharge_voltage and bd_trigger_voltage */
+	if (bd_state->lowerbd_reached && val >= upperbd) {
+		pr_info("MSC_BD lowerbd=%d, upperbd=%d, val=%d, lowerbd_reached=1->0, charging off\n",
+			lowerbd, upperbd, val);
+		bd_state->lowerbd_reached = false;
+		disable_charging = 1;
+	} else if (!bd_state->lowerbd_reached && val > lowerbd) {
+		pr_info("MSC_BD lowerbd=%d, upperbd=%d, val=%d, charging off\n",
+			lowerbd, upperbd, val);
+		disable_charging = 1;
+	} else if (!bd_state->lowerbd_reached && val <= lowerbd) {
+		pr_info("MSC_BD lowerbd=%d, upperbd=%d, val=%d, lowerbd_reached=0->1, charging on\n",
+			lowerbd, upperbd, val);
+		bd_state->lowerbd_reached = true;
+	} else {
+		pr_info("MSC_BD lowerbd=%d, upperbd=%d, val=%d, charging on\n",
+			lowerbd, upperbd, val);
+	}
+
+	return disable_charging;
+}
+
+int bd_dd_state_update(const int dd_state, const bool dd_triggered,
+		       const bool change)
+{
+	int new_state = dd_state;
+
+	switch (new_state) {
+	case DOCK_DEFEND_ENABLED:
+		if (dd_triggered && change)
+			new_state = DOCK_DEFEND_ACTIVE;
+		break;
+	case DOCK_DEFEND_ACTIVE:
+		if (!dd_triggered)
+			new_state = DOCK_DEFEND_ENABLED;
+		break;
+	default:
+		break;
+	}
+
+	return new_state;
+}
+
+bool bd_resume_needs_soc(const struct bd_data *bd_state)
+{
+	return bd_state->bd_resume_soc != 0;
+}
+
+/*
+ * Run after disconnect while triggered, return true when TEMP-DEFEND is
+ * cleared. Resume on SOC (SSOC must not be locked), on time and temperature
+ * and on absolute temperature.
+ */
+bool bd_disconnected_update(struct bd_data *bd_state,
+			    const struct bd_sample *sample)
+{
+	const long long delta_time = sample->now - bd_state->disconnect_time;
+
+	if (bd_state->bd_resume_soc && sample->soc >= 0 &&
+	    sample->soc < bd_state->bd_resume_soc) {
+		pr_info("MSC_BD_WORK: done soc=%d limit=%d\n",
+			sample->soc, bd_state->bd_resume_soc);
+
+		bd_reset(bd_state);
+		return true;
+	}
+
+	/* set on time and temperature, reset on abs temperature */
+	bd_update_stats(bd_state, sample);
+	if (!bd_state->triggered)
+		return true;
+
+	/* reset on time since disconnect & optional temperature reading */
+	if (bd_state->bd_resume_time && delta_time > bd_state->bd_resume_time) {
+		const int temp = bd_state->last_temp; /* or use avg */
+		int triggered;
+
+		/* single reading < of resume temp, or total average temp */
+		triggered = bd_state->bd_resume_temp &&
+			    temp > bd_state->bd_resume_temp;
+		if (!triggered) {
+			pr_info("MSC_BD_WORK: done time=%lld limit=%d, temp=%d limit=%d\n",
+				delta_time, bd_state->bd_resume_time,
+				temp, bd_state->bd_resume_temp);
+
+			bd_reset(bd_state);
+			return true;
+		}
+	}
+
+	pr_debug("MSC_BD_WORK: trig=%d soc=%d time=%lld limit=%d temp=%d limit=%d avg=%lld\n",
+		bd_state->triggered,
+		sample->soc,
+		delta_time, bd_state->bd_resume_time,
+		bd_state->last_temp, bd_state->bd_resume_abs_temp,
+		bd_state->time_sum ? bd_state->temp_sum / bd_state->time_sum : 0);
+
+	return false;
+}
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright 2022 Google, LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __GOOGLE_DEFENDER_H_
+#define __GOOGLE_DEFENDER_H_
+
+#include <linux/device.h>
+#include <linux/ktime.h>
+#include <linux/types.h>
+
+/*
+ * TEMP-DEFEND and DOCK-DEFEND policy. The functions here do not access
+ * power supplies: google_charger reads the battery and feeds the samples.
+ */
+
+enum dock_defend_state {
+	DOCK_DEFEND_DISABLED = -1,
+	DOCK_DEFEND_ENABLED = 0,
+	DOCK_DEFEND_ACTIVE,
+};
+
+enum dock_defend_settings {
+	DOCK_DEFEND_USER_DISABLED = -1,
+	DOCK_DEFEND_USER_CLEARED = 0,
+	DOCK_DEFEND_USER_ENABLED,
+};
+
+struct bd_data {
+	u32 bd_trigger_voltage;	/* also recharge upper bound */
+	u32 bd_trigger_temp;	/* single reading */
+	u32 bd_trigger_time;	/* debounce window after trigger*/
+	u32 bd_drainto_soc;
+	u32 bd_recharge_voltage;
+	u32 bd_recharge_soc;
+
+	u32 bd_resume_abs_temp;	/* at any time after trigger */
+
+	u32 bd_resume_soc;	/* any time after disconnect */
+	u32 bd_resume_time;	/* debounce window for resume temp */
+	u32 bd_resume_temp;	/* check resume_time after disconnect */
+
+	long long temp_sum;
+	ktime_t time_sum;
+
+	int last_voltage;
+	int last_temp;
+	ktime_t last_update;
+
+	ktime_t disconnect_time;
+	u32 triggered;		/* (d) */
+	u32 enabled;		/* (d) */
+	u32 bd_temp_enable;	/* for UI setting interface */
+
+	bool lowerbd_reached;
+	bool bd_temp_dry_run;
+
+	/* dock_defend */
+	u32 dd_triggered;
+	u32 dd_enabled;
+	int dd_state;
+	int dd_settings;
+	int dd_charge_stop_level;
+	int dd_charge_start_level;
+};
+
+/* battery reading fed to the policy, now is in seconds since boot */
+struct bd_sample {
+	ktime_t now;
+	int vbatt;	/* POWER_SUPPLY_PROP_VOLTAGE_AVG */
+	int temp;	/* valid when bd_stats_needs_temp() */
+	int soc;	/* -1 when not read, see bd_resume_needs_soc() */
+};
+
+#define dd_is_enabled(bd_state) \
+	((bd_state)->dd_state != DOCK_DEFEND_DISABLED && \
+	(bd_state)->dd_settings == DOCK_DEFEND_USER_ENABLED)
+
+void bd_reset(struct bd_data *bd_state);
+void bd_init(struct bd_data *bd_state, struct device *dev);
+
+bool bd_stats_needs_temp(const struct bd_data *bd_state, int vbatt);
+void bd_update_stats(struct bd_data *bd_state, const struct bd_sample *sample);
+int bd_recharge_logic(struct bd_data *bd_state, int val);
+int bd_fan_calculate_level(const struct bd_data *bd_state);
+int bd_dd_state_update(const int dd_state, const bool dd_triggered,
+		       const bool change);
+
+bool bd_resume_needs_soc(const struct bd_data *bd_state);
+bool bd_disconnected_update(struct bd_data *bd_state,
+			    const struct bd_sample *sample);
+
+#endif /* __GOOGLE_DEFENDER_H_ */
@@ -35,6 +35,70 @@
 #define DUAL_BATT_VFLIP_OFFSET		50000
 #define DUAL_BATT_VFLIP_OFFSET_IDX	0
 
+/* property reads are served from a snapshot younger than this */
+#define DUAL_FG_SNAPSHOT_MAX_AGE_MS	1000
+/* min interval for the dV/dt estimate, cc_max looks ahead one work period */
+#define DUAL_FG_DVDT_MIN_MS		5000
+#define DUAL_FG_LOOKAHEAD_MS		DUAL_FG_WORK_PERIOD_MS
+
+enum gdbatt_fg_idx {
+	GDBATT_FG_BASE = 0,
+	GDBATT_FG_FLIP,
+	GDBATT_FG_NUM,
+};
+
+/* fields of a sample and of the snapshot, valid when the read succeeded */
+#define GDBATT_TEMP		BIT(0)
+#define GDBATT_VBATT		BIT(1)
+#define GDBATT_IBATT		BIT(2)
+#define GDBATT_IAVG		BIT(3)
+#define GDBATT_SOC		BIT(4)
+#define GDBATT_SOC_RAW		BIT(5)
+#define GDBATT_CHARGE_COUNTER	BIT(6)
+
+struct gdbatt_fg_sample {
+	u32 valid;
+	int err;	/* last error */
+	int temp;
+	int vbatt;
+	int ibatt;
+	int iavg;
+	int soc;
+	int soc_raw;
+	int charge_counter;
+	ktime_t ts;
+};
+
+/* each gauge is on its own bus, the two are sampled in parallel */
+struct gdbatt_fg {
+	struct power_supply *psy;
+	struct work_struct sample_work;
+	struct gdbatt_fg_sample sample;
+
+	/* imbalance tracking */
+	ktime_t dv_ts;
+	int dv_vbatt;
+	int dvdt;	/* uV/sec, charging */
+};
+
+/*
+ * aggregate values, computed once per sample of the two gauges. A field is
+ * valid when it was read from both gauges, the others are read directly.
+ */
+struct gdbatt_snapshot {
+	ktime_t ts;	/* 0 when invalid */
+	u32 valid;
+	int capacity;
+	int capacity_raw;
+	int current_now;
+	int current_avg;
+	int charge_counter;
+	int temp;
+	int voltage_now;
+	int soc_delta;	/* base - flip */
+	int volt_delta;	/* base - flip */
+};
+
 struct dual_fg_drv {
 	struct device *device;
 	struct power_supply *psy;
@@ -64,6 +128,9 @@ struct dual_fg_drv {
 	bool cable_in;
 
 	u32 vflip_offset;
+
+	struct gdbatt_fg fg[GDBATT_FG_NUM];
+	struct gdbatt_snapshot snap;
 };
 
 static int gdbatt_resume_check(struct dual_fg_drv *dual_fg_drv) {
@@ -132,34 +199,190 @@ static int gdbatt_select_voltage_idx(struct gbms_chg_profile *profile, int vbatt
 	return vbatt_idx;
 }
 
+static int gdbatt_get_capacity(struct dual_fg_drv *dual_fg_drv, int base_soc, int flip_soc)
+{
+	const int base_full = dual_fg_drv->base_charge_full / 1000;
+	const int flip_full = dual_fg_drv->flip_charge_full / 1000;
+	const int full_sum = base_full + flip_full;
+
+	if (!base_full || !flip_full)
+		return (base_soc + flip_soc) / 2;
+
+	return (base_soc * base_full + flip_soc * flip_full) / full_sum;
+}
+
+/* one failed read does not invalidate the other fields of the sample */
+#define GDBATT_SAMPLE_PROP(s, psy, psp, field, bit)			\
+	do {								\
+		int __err;						\
+									\
+		(s)->field = GPSY_GET_INT_PROP(psy, psp, &__err);	\
+		if (__err == 0)						\
+			(s)->valid |= (bit);				\
+		else							\
+			(s)->err = __err;				\
+	} while (0)
+
+static void gdbatt_fg_sample_work(struct work_struct *work)
+{
+	struct gdbatt_fg *fg = container_of(work, struct gdbatt_fg,
+					    sample_work);
+	struct gdbatt_fg_sample *s = &fg->sample;
+	struct power_supply *psy = fg->psy;
+	int err;
+
+	s->valid = 0;
+	s->err = 0;
+
+	err = gdbatt_get_temp(psy, &s->temp);
+	if (err == 0)
+		s->valid |= GDBATT_TEMP;
+	else
+		s->err = err;
+
+	GDBATT_SAMPLE_PROP(s, psy, POWER_SUPPLY_PROP_VOLTAGE_NOW, vbatt,
+			   GDBATT_VBATT);
+	GDBATT_SAMPLE_PROP(s, psy, POWER_SUPPLY_PROP_CURRENT_NOW, ibatt,
+			   GDBATT_IBATT);
+	GDBATT_SAMPLE_PROP(s, psy, POWER_SUPPLY_PROP_CURRENT_AVG, iavg,
+			   GDBATT_IAVG);
+	GDBATT_SAMPLE_PROP(s, psy, POWER_SUPPLY_PROP_CAPACITY, soc,
+			   GDBATT_SOC);
+	GDBATT_SAMPLE_PROP(s, psy, GBMS_PROP_CAPACITY_RAW, soc_raw,
+			   GDBATT_SOC_RAW);
+	GDBATT_SAMPLE_PROP(s, psy, POWER_SUPPLY_PROP_CHARGE_COUNTER,
+			   charge_counter, GDBATT_CHARGE_COUNTER);
+
+	s->ts = ktime_get_boottime();
+}
+
+/* voltage slope of the pack, reset when the cable is removed */
+static void gdbatt_fg_update_dvdt(struct gdbatt_fg *fg, bool cable_in)
+{
+	const struct gdbatt_fg_sample *s = &fg->sample;
+	s64 elap;
+
+	if (!(s->valid & GDBATT_VBATT))
+		return;
+
+	if (!cable_in) {
+		fg->dv_ts = 0;
+		fg->dvdt = 0;
+		return;
+	}
+
+	elap = fg->dv_ts ? ktime_ms_delta(s->ts, fg->dv_ts) : 0;
+	if (fg->dv_ts && elap < DUAL_FG_DVDT_MIN_MS)
+		return;
+
+	if (fg->dv_ts)
+		fg->dvdt = div64_s64((s64)(s->vbatt - fg->dv_vbatt) * MSEC_PER_SEC,
+				     elap);
+	fg->dv_ts = s->ts;
+	fg->dv_vbatt = s->vbatt;
+}
+
+/*
+ * sample both gauges concurrently, fails only when nothing could be read
+ * from one of the two.
+ * NOTE: call holding fg_lock
+ */
+static int gdbatt_update_snapshot(struct dual_fg_drv *dual_fg_drv)
+{
+	const struct gdbatt_fg_sample *base = &dual_fg_drv->fg[GDBATT_FG_BASE].sample;
+	const struct gdbatt_fg_sample *flip = &dual_fg_drv->fg[GDBATT_FG_FLIP].sample;
+	struct gdbatt_snapshot *snap = &dual_fg_drv->snap;
+	int i;
+
+	dual_fg_drv->fg[GDBATT_FG_BASE].psy = dual_fg_drv->first_fg_psy;
+	dual_fg_drv->fg[GDBATT_FG_FLIP].psy = dual_fg_drv->second_fg_psy;
+
+	for (i = 0; i < GDBATT_FG_NUM; i++)
+		queue_work(system_unbound_wq, &dual_fg_drv->fg[i].sample_work);
+	for (i = 0; i < GDBATT_FG_NUM; i++)
+		flush_work(&dual_fg_drv->fg[i].sample_work);
+
+	snap->ts = 0;
+	snap->valid = base->valid & flip->valid;
+	if (!base->valid)
+		return base->err;
+	if (!flip->valid)
+		return flip->err;
+	if (base->err < 0 || flip->err < 0)
+		pr_debug("partial snapshot valid=%x base=%d flip=%d\n",
+			 snap->valid, base->err, flip->err);
+
+	for (i = 0; i < GDBATT_FG_NUM; i++)
+		gdbatt_fg_update_dvdt(&dual_fg_drv->fg[i], dual_fg_drv->cable_in);
+
+	snap->capacity = gdbatt_get_capacity(dual_fg_drv, base->soc, flip->soc);
+	snap->capacity_raw = gdbatt_get_capacity(dual_fg_drv, base->soc_raw,
+						 flip->soc_raw);
+	snap->current_now = base->ibatt + flip->ibatt;
+	snap->current_avg = base->iavg + flip->iavg;
+	snap->charge_counter = base->charge_counter + flip->charge_counter;
+	snap->temp = MAX(base->temp, flip->temp);
+	snap->voltage_now = (base->vbatt + flip->vbatt) / 2;
+	snap->soc_delta = base->soc - flip->soc;
+	snap->volt_delta = base->vbatt - flip->vbatt;
+	snap->ts = ktime_get_boottime();
+
+	return 0;
+}
+
+/* NOTE: call holding fg_lock */
+static const struct gdbatt_snapshot *
+gdbatt_get_snapshot(struct dual_fg_drv *dual_fg_drv)
+{
+	const struct gdbatt_snapshot *snap = &dual_fg_drv->snap;
+	int ret;
+
+	if (snap->ts && ktime_ms_delta(ktime_get_boottime(), snap->ts) <
+	    DUAL_FG_SNAPSHOT_MAX_AGE_MS)
+		return snap;
+
+	ret = gdbatt_update_snapshot(dual_fg_drv);
+	if (ret < 0)
+		return ERR_PTR(ret);
+
+	return snap;
+}
+
+/* vbatt expected at the next update given the charging slope */
+static int gdbatt_lookahead_vbatt(const struct gdbatt_fg *fg)
+{
+	if (fg->dvdt <= 0)
+		return fg->sample.vbatt;
+
+	return fg->sample.vbatt + fg->dvdt * (DUAL_FG_LOOKAHEAD_MS / MSEC_PER_SEC);
+}
+
+/*
+ * Use the snapshot to select the tier of each pack. The pack that charges
+ * faster reaches the next voltage tier first, vbatt is extrapolated one
+ * work period ahead so that cc_max is lowered before it gets there.
+ * NOTE: call holding fg_lock with a valid snapshot
+ */
 static void gdbatt_select_cc_max(struct dual_fg_drv *dual_fg_drv)
 {
 	struct gbms_chg_profile *profile = &dual_fg_drv->chg_profile;
+	const struct gdbatt_fg *base = &dual_fg_drv->fg[GDBATT_FG_BASE];
+	const struct gdbatt_fg *flip = &dual_fg_drv->fg[GDBATT_FG_FLIP];
+	const struct gdbatt_snapshot *snap = &dual_fg_drv->snap;
 	int base_temp, flip_temp, base_vbatt, flip_vbatt;
 	int base_temp_idx, flip_temp_idx, base_vbatt_idx, flip_vbatt_idx;
 	int base_cc_max, flip_cc_max, cc_max;
-	struct power_supply *base_psy = dual_fg_drv->first_fg_psy;
-	struct power_supply *flip_psy = dual_fg_drv->second_fg_psy;
-	int ret = 0;
 
-	if (!dual_fg_drv->cable_in)
+	if (!dual_fg_drv->cable_in || !snap->ts)
 		goto check_done;
-
-	ret = gdbatt_get_temp(base_psy, &base_temp);
-	if (ret < 0)
+	if ((snap->valid & (GDBATT_TEMP | GDBATT_VBATT)) !=
+	    (GDBATT_TEMP | GDBATT_VBATT))
 		goto check_done;
 
-	ret = gdbatt_get_temp(flip_psy, &flip_temp);
-	if (ret < 0)
-		goto check_done;
-
-	base_vbatt = GPSY_GET_PROP(base_psy, POWER_SUPPLY_PROP_VOLTAGE_NOW);
-	if (base_vbatt < 0)
-		goto check_done;
-
-	flip_vbatt = GPSY_GET_PROP(flip_psy, POWER_SUPPLY_PROP_VOLTAGE_NOW);
-	if (flip_vbatt < 0)
-		goto check_done;
+	base_temp = base->sample.temp;
+	flip_temp = flip->sample.temp;
+	base_vbatt = gdbatt_lookahead_vbatt(base);
+	flip_vbatt = gdbatt_lookahead_vbatt(flip);
 
 	base_temp_idx = gdbatt_select_temp_idx(profile, base_temp);
 	flip_temp_idx = gdbatt_select_temp_idx(profile, flip_temp);
@@ -182,29 +405,18 @@ static void gdbatt_select_cc_max(struct dual_fg_drv *dual_fg_drv)
 		dual_fg_drv->fcc_votable =
 			gvotable_election_get_handle(VOTABLE_MSC_FCC);
 	if (dual_fg_drv->fcc_votable) {
-		pr_info("temp:%d/%d(%d/%d), vbatt:%d/%d(%d/%d), cc_max:%d/%d(%d)\n",
-			base_temp, flip_temp, base_temp_idx, flip_temp_idx, base_vbatt,
-			flip_vbatt, base_vbatt_idx, flip_vbatt_idx, base_cc_max,
-			flip_cc_max, cc_max);
+		pr_info("temp:%d/%d(%d/%d), vbatt:%d/%d(%d/%d), dvdt:%d/%d, dsoc:%d dv:%d cc_max:%d/%d(%d)\n",
+			base_temp, flip_temp, base_temp_idx, flip_temp_idx,
+			base->sample.vbatt, flip->sample.vbatt, base_vbatt_idx,
+			flip_vbatt_idx, base->dvdt, flip->dvdt, snap->soc_delta,
+			snap->volt_delta, base_cc_max, flip_cc_max, cc_max);
 		gvotable_cast_int_vote(dual_fg_drv->fcc_votable,
 				       DUAL_BATT_TEMP_VOTER, cc_max, true);
 		dual_fg_drv->cc_max = cc_max;
 	}
 
 check_done:
-	pr_debug("check done. cable_in=%d (%d)\n", dual_fg_drv->cable_in, ret);
-}
-
-static int gdbatt_get_capacity(struct dual_fg_drv *dual_fg_drv, int base_soc, int flip_soc)
-{
-	const int base_full = dual_fg_drv->base_charge_full / 1000;
-	const int flip_full = dual_fg_drv->flip_charge_full / 1000;
-	const int full_sum = base_full + flip_full;
-
-	if (!base_full || !flip_full)
-		return (base_soc + flip_soc) / 2;
-
-	return (base_soc * base_full + flip_soc * flip_full) / full_sum;
+	pr_debug("check done. cable_in=%d\n", dual_fg_drv->cable_in);
 }
 
 static void google_dual_batt_work(struct work_struct *work)
@@ -223,7 +435,8 @@ static void google_dual_batt_work(struct work_struct *work)
 	if (!base_psy || !flip_psy)
 		goto error_done;
 
-	gdbatt_select_cc_max(dual_fg_drv);
+	if (dual_fg_drv->cable_in && gdbatt_update_snapshot(dual_fg_drv) == 0)
+		gdbatt_select_cc_max(dual_fg_drv);
 
 	base_data = GPSY_GET_PROP(base_psy, POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN);
 	flip_data = GPSY_GET_PROP(flip_psy, POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN);
@@ -241,6 +454,66 @@ error_done:
 	mutex_unlock(&dual_fg_drv->fg_lock);
 }
 
+/*
+ * -ENODATA when the field is not in the snapshot, the caller reads the
+ * property from the two gauges instead.
+ * NOTE: call holding fg_lock
+ */
+static int gdbatt_get_snapshot_prop(struct dual_fg_drv *dual_fg_drv,
+				    enum power_supply_property psp,
+				    union power_supply_propval *val)
+{
+	const struct gdbatt_snapshot *snap;
+	u32 field;
+	int value;
+
+	snap = gdbatt_get_snapshot(dual_fg_drv);
+	if (IS_ERR(snap)) {
+		pr_debug("error %ld reading snapshot prop %d\n",
+			 PTR_ERR(snap), psp);
+		return -ENODATA;
+	}
+
+	switch ((int)psp) {
+	case GBMS_PROP_CAPACITY_RAW:
+		field = GDBATT_SOC_RAW;
+		value = snap->capacity_raw;
+		break;
+	case POWER_SUPPLY_PROP_CAPACITY:
+		field = GDBATT_SOC;
+		value = snap->capacity;
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_COUNTER:
+		field = GDBATT_CHARGE_COUNTER;
+		value = snap->charge_counter;
+		break;
+	case POWER_SUPPLY_PROP_CURRENT_AVG:
+		field = GDBATT_IAVG;
+		value = snap->current_avg;
+		break;
+	case POWER_SUPPLY_PROP_CURRENT_NOW:
+		field = GDBATT_IBATT;
+		value = snap->current_now;
+		break;
+	case POWER_SUPPLY_PROP_TEMP:
+		field = GDBATT_TEMP;
+		value = snap->temp;
+		break;
+	case POWER_SUPPLY_PROP_VOLTAGE_NOW:
+		field = GDBATT_VBATT;
+		value = snap->voltage_now;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (!(snap->valid & field))
+		return -ENODATA;
+
+	val->intval = value;
+	return 0;
+}
+
 static int gdbatt_get_property(struct power_supply *psy,
 				 enum power_supply_property psp,
 				 union power_supply_propval *val)
@@ -263,6 +536,24 @@ static int gdbatt_get_property(struct power_supply *psy,
 
 	mutex_lock(&dual_fg_drv->fg_lock);
 
+	switch (psp) {
+	case GBMS_PROP_CAPACITY_RAW:
+	case POWER_SUPPLY_PROP_CAPACITY:
+	case POWER_SUPPLY_PROP_CHARGE_COUNTER:
+	case POWER_SUPPLY_PROP_CURRENT_AVG:
+	case POWER_SUPPLY_PROP_CURRENT_NOW:
+	case POWER_SUPPLY_PROP_TEMP:
+	case POWER_SUPPLY_PROP_VOLTAGE_NOW:
+		err = gdbatt_get_snapshot_prop(dual_fg_drv, psp, val);
+		if (err != -ENODATA) {
+			mutex_unlock(&dual_fg_drv->fg_lock);
+			return err;
+		}
+		break;
+	default:
+		break;
+	}
+
 	err = power_supply_get_property(dual_fg_drv->first_fg_psy, psp, &fg_1);
 	if (err != 0) {
 		pr_debug("error %d reading first fg prop %d\n", err, psp);
@@ -277,10 +568,9 @@ static int gdbatt_get_property(struct power_supply *psy,
 		return err;
 	}
 
-	switch (psp) {
+	switch ((int)psp) {
+	/* fields that are not in the snapshot */
 	case POWER_SUPPLY_PROP_CHARGE_COUNTER:
-	case POWER_SUPPLY_PROP_CHARGE_FULL:
-	case POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN:
 	case POWER_SUPPLY_PROP_CURRENT_AVG:
 	case POWER_SUPPLY_PROP_CURRENT_NOW:
 		val->intval = fg_1.intval + fg_2.intval;
@@ -288,23 +578,27 @@ static int gdbatt_get_property(struct power_supply *psy,
 	case POWER_SUPPLY_PROP_TEMP:
 		val->intval = MAX(fg_1.intval, fg_2.intval);
 		break;
+	case POWER_SUPPLY_PROP_VOLTAGE_NOW:
+		val->intval = (fg_1.intval + fg_2.intval)/2;
+		break;
+	case GBMS_PROP_CAPACITY_RAW:
+	case POWER_SUPPLY_PROP_CAPACITY:
+		val->intval = gdbatt_get_capacity(dual_fg_drv, fg_1.intval, fg_2.intval);
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_FULL:
+	case POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN:
+		val->intval = fg_1.intval + fg_2.intval;
+		break;
 	case POWER_SUPPLY_PROP_TIME_TO_EMPTY_AVG:
 	case POWER_SUPPLY_PROP_TIME_TO_FULL_AVG:
 		val->intval = MAX(fg_1.intval, fg_2.intval);
 		break;
-	case POWER_SUPPLY_PROP_VOLTAGE_NOW:
-		val->intval = (fg_1.intval + fg_2.intval)/2;
-		break;
 	case POWER_SUPPLY_PROP_VOLTAGE_AVG:
 	case POWER_SUPPLY_PROP_VOLTAGE_MAX_DESIGN:
 	case POWER_SUPPLY_PROP_VOLTAGE_MIN_DESIGN:
 	case POWER_SUPPLY_PROP_VOLTAGE_OCV:
 		val->intval = (fg_1.intval + fg_2.intval)/2;
 		break;
-	case GBMS_PROP_CAPACITY_RAW:
-	case POWER_SUPPLY_PROP_CAPACITY:
-		val->intval = gdbatt_get_capacity(dual_fg_drv, fg_1.intval, fg_2.intval);
-		break;
 	case POWER_SUPPLY_PROP_HEALTH:
 		/* larger one is bad. TODO: confirm its priority */
 		val->intval = MAX(fg_1.intval, fg_2.intval);
@@ -554,6 +848,10 @@ static int google_dual_batt_gauge_probe(struct platform_device *pdev)
 
 	INIT_DELAYED_WORK(&dual_fg_drv->init_work, google_dual_batt_gauge_init_work);
 	INIT_DELAYED_WORK(&dual_fg_drv->gdbatt_work, google_dual_batt_work);
+	INIT_WORK(&dual_fg_drv->fg[GDBATT_FG_BASE].sample_work,
+		  gdbatt_fg_sample_work);
+	INIT_WORK(&dual_fg_drv->fg[GDBATT_FG_FLIP].sample_work,
+		  gdbatt_fg_sample_work);
 	mutex_init(&dual_fg_drv->fg_lock);
 	platform_set_drvdata(pdev, dual_fg_drv);
 
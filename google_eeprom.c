@@ -14,6 +14,10 @@
 #include <linux/nvmem-consumer.h>
 #include <linux/module.h>
 #include <linux/delay.h>
+#include <linux/bitmap.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/workqueue.h>
 #include "gbms_storage.h"
 
 #define BATT_EEPROM_TAG_MINF_OFFSET	0x00
@@ -73,6 +77,37 @@ static struct gbms_storage_desc *gbee_desc;
  */
 #define BATT_WAIT_INTERNAL_WRITE_MS	1
 
+/* writes never cross a page, one write and one wait per page */
+#define GBEE_PAGE_SIZE		16	/* default, google,eeprom-page-size */
+#define GBEE_PAGE_SIZE_MAX	64
+#define GBEE_EEPROM_SIZE	0x400
+
+#define GBEE_WQ_RETRY_MS	1000
+#define GBEE_WQ_RETRY_MAX	3
+
+/*
+ * image[] mirrors the EEPROM: loaded with one read at registration and
+ * kept coherent on write, reads are served from it when valid.
+ * Deferred writes: data is staged in image[] and marked dirty, a work writes
+ * it to the EEPROM. Reads overlay the dirty bytes so callers always see what
+ * they wrote. write_lock serializes the actual EEPROM writes.
+ */
+struct gbee_wq {
+	struct nvmem_device *nvmem;
+	struct mutex lock;
+	struct mutex write_lock;
+	u8 image[GBEE_EEPROM_SIZE];
+	DECLARE_BITMAP(dirty, GBEE_EEPROM_SIZE);
+	struct delayed_work work;
+	size_t page_size;
+	int retries;
+	bool enabled;
+	bool valid;
+	struct dentry *de;
+};
+
+static struct gbee_wq gbee_wq = { .page_size = GBEE_PAGE_SIZE };
+
 int gbee_storage_info(gbms_tag_t tag, size_t *addr, size_t *count, void *ptr)
 {
 	int ret = 0;
@@ -155,6 +190,258 @@ int gbee_storage_info(gbms_tag_t tag, size_t *addr, size_t *count, void *ptr)
 	return ret;
 }
 
+/*
+ * Split the write on page boundaries and skip the pages that already have
+ * the data. Return count or a negative errno.
+ */
+static int gbee_write_pages(struct nvmem_device *nvmem, size_t offset,
+			    const u8 *data, size_t count)
+{
+	const size_t page_size = gbee_wq.page_size;
+	u8 cur[GBEE_PAGE_SIZE_MAX];
+	size_t done = 0;
+	int ret;
+
+	while (done < count) {
+		const size_t addr = offset + done;
+		const size_t chunk = min_t(size_t, count - done,
+					   page_size - addr % page_size);
+
+		ret = nvmem_device_read(nvmem, addr, chunk, cur);
+		if (ret >= 0 && memcmp(cur, &data[done], chunk) == 0) {
+			done += chunk;
+			continue;
+		}
+
+		ret = nvmem_device_write(nvmem, addr, chunk, (void *)&data[done]);
+		if (ret < 0)
+			return ret;
+
+		msleep(BATT_WAIT_INTERNAL_WRITE_MS);
+		done += chunk;
+	}
+
+	return count;
+}
+
+/* replace what was read with the data that is not written yet */
+static void gbee_wq_overlay(size_t offset, u8 *buff, size_t count)
+{
+	unsigned long i;
+
+	if (!gbee_wq.enabled || offset + count > GBEE_EEPROM_SIZE)
+		return;
+
+	mutex_lock(&gbee_wq.lock);
+	i = offset;
+	for_each_set_bit_from(i, gbee_wq.dirty, offset + count)
+		buff[i - offset] = gbee_wq.image[i];
+	mutex_unlock(&gbee_wq.lock);
+}
+
+/* write all the dirty bytes, return the offset of the first failure */
+static int gbee_wq_flush(unsigned long *fail_at)
+{
+	const size_t page_size = gbee_wq.page_size;
+	u8 data[GBEE_PAGE_SIZE_MAX];
+	unsigned long start, end;
+	int ret = 0;
+
+	mutex_lock(&gbee_wq.write_lock);
+
+	while (true) {
+		mutex_lock(&gbee_wq.lock);
+		start = find_first_bit(gbee_wq.dirty, GBEE_EEPROM_SIZE);
+		if (start >= GBEE_EEPROM_SIZE) {
+			gbee_wq.retries = 0;
+			mutex_unlock(&gbee_wq.lock);
+			break;
+		}
+
+		/* one page at most, the run of dirty bytes from start */
+		end = find_next_zero_bit(gbee_wq.dirty, GBEE_EEPROM_SIZE, start);
+		end = min_t(unsigned long, end,
+			    round_down(start, page_size) + page_size);
+		memcpy(data, &gbee_wq.image[start], end - start);
+		bitmap_clear(gbee_wq.dirty, start, end - start);
+		mutex_unlock(&gbee_wq.lock);
+
+		ret = gbee_write_pages(gbee_wq.nvmem, start, data, end - start);
+		if (ret < 0) {
+			mutex_lock(&gbee_wq.lock);
+			/* image has the latest data for these bytes */
+			bitmap_set(gbee_wq.dirty, start, end - start);
+			mutex_unlock(&gbee_wq.lock);
+			*fail_at = start;
+			break;
+		}
+	}
+
+	mutex_unlock(&gbee_wq.write_lock);
+	return ret;
+}
+
+/* the mirror has data that never made it to the EEPROM */
+static void gbee_wq_drop(unsigned long fail_at, int ret)
+{
+	pr_err("cannot write at %lu (%d), dropping pending data\n",
+	       fail_at, ret);
+
+	mutex_lock(&gbee_wq.lock);
+	bitmap_zero(gbee_wq.dirty, GBEE_EEPROM_SIZE);
+	gbee_wq.valid = false;
+	gbee_wq.retries = 0;
+	mutex_unlock(&gbee_wq.lock);
+}
+
+static void gbee_wq_work(struct work_struct *work)
+{
+	unsigned long fail_at = 0;
+	int ret;
+
+	ret = gbee_wq_flush(&fail_at);
+	if (ret >= 0)
+		return;
+
+	if (++gbee_wq.retries > GBEE_WQ_RETRY_MAX) {
+		gbee_wq_drop(fail_at, ret);
+		return;
+	}
+
+	/* gbee_destroy_device() does the last flush */
+	mutex_lock(&gbee_wq.lock);
+	if (gbee_wq.enabled)
+		schedule_delayed_work(&gbee_wq.work,
+				      msecs_to_jiffies(GBEE_WQ_RETRY_MS));
+	mutex_unlock(&gbee_wq.lock);
+}
+
+/* from the mirror when valid, or from the EEPROM with pending writes */
+static int gbee_read(struct nvmem_device *nvmem, size_t offset, void *buff,
+		     size_t count)
+{
+	int ret;
+
+	if (gbee_wq.enabled && offset + count <= GBEE_EEPROM_SIZE) {
+		mutex_lock(&gbee_wq.lock);
+		if (gbee_wq.valid) {
+			memcpy(buff, &gbee_wq.image[offset], count);
+			mutex_unlock(&gbee_wq.lock);
+			return count;
+		}
+		mutex_unlock(&gbee_wq.lock);
+	}
+
+	ret = nvmem_device_read(nvmem, offset, count, buff);
+	if (ret < 0)
+		return ret;
+
+	gbee_wq_overlay(offset, buff, count);
+	return count;
+}
+
+/* straight from the EEPROM, skip the mirror and the pending writes */
+static int gbee_read_device(struct nvmem_device *nvmem, size_t offset,
+			    void *buff, size_t count)
+{
+	int ret;
+
+	ret = nvmem_device_read(nvmem, offset, count, buff);
+	if (ret < 0)
+		return ret;
+
+	return count;
+}
+
+/*
+ * One bulk read, bytes with pending writes keep the staged data. Holds
+ * write_lock so that a write cannot land between the read and the publish.
+ */
+static int gbee_mirror_load(void)
+{
+	unsigned long i;
+	u8 *buff;
+	int ret;
+
+	buff = kmalloc(GBEE_EEPROM_SIZE, GFP_KERNEL);
+	if (!buff)
+		return -ENOMEM;
+
+	mutex_lock(&gbee_wq.write_lock);
+	ret = nvmem_device_read(gbee_wq.nvmem, 0, GBEE_EEPROM_SIZE, buff);
+	if (ret < 0) {
+		pr_err("cannot load mirror (%d)\n", ret);
+		goto exit_unlock;
+	}
+
+	mutex_lock(&gbee_wq.lock);
+	for (i = 0; i < GBEE_EEPROM_SIZE; i++)
+		if (!test_bit(i, gbee_wq.dirty))
+			gbee_wq.image[i] = buff[i];
+	gbee_wq.valid = true;
+	mutex_unlock(&gbee_wq.lock);
+	ret = 0;
+
+exit_unlock:
+	mutex_unlock(&gbee_wq.write_lock);
+	kfree(buff);
+	return ret;
+}
+
+static void gbee_mirror_invalidate(void)
+{
+	mutex_lock(&gbee_wq.lock);
+	gbee_wq.valid = false;
+	mutex_unlock(&gbee_wq.lock);
+}
+
+/*
+ * Stage the write and return, the EEPROM is updated in background. Write
+ * synchronously when sync is set or when the queue is not available.
+ */
+static int gbee_write(struct nvmem_device *nvmem, size_t offset,
+		      const void *data, size_t count, bool sync)
+{
+	int ret;
+
+	if (!gbee_wq.enabled || offset + count > GBEE_EEPROM_SIZE)
+		return gbee_write_pages(nvmem, offset, data, count);
+
+	if (!sync) {
+		mutex_lock(&gbee_wq.lock);
+		if (gbee_wq.enabled) {
+			memcpy(&gbee_wq.image[offset], data, count);
+			bitmap_set(gbee_wq.dirty, offset, count);
+			schedule_delayed_work(&gbee_wq.work, 0);
+			mutex_unlock(&gbee_wq.lock);
+			return count;
+		}
+		mutex_unlock(&gbee_wq.lock);
+	}
+
+	/*
+	 * Pending data for this range is superseded. The mirror takes the
+	 * data only when it reached the EEPROM, it is invalidated on error
+	 * since the device might have been partially written.
+	 */
+	mutex_lock(&gbee_wq.write_lock);
+	mutex_lock(&gbee_wq.lock);
+	bitmap_clear(gbee_wq.dirty, offset, count);
+	mutex_unlock(&gbee_wq.lock);
+
+	ret = gbee_write_pages(nvmem, offset, data, count);
+
+	mutex_lock(&gbee_wq.lock);
+	if (ret < 0)
+		gbee_wq.valid = false;
+	else
+		memcpy(&gbee_wq.image[offset], data, count);
+	mutex_unlock(&gbee_wq.lock);
+	mutex_unlock(&gbee_wq.write_lock);
+
+	return ret;
+}
+
 static int gbee_storage_iter(int index, gbms_tag_t *tag, void *ptr)
 {
 	static const gbms_tag_t keys[] = { GBMS_TAG_BGPN, GBMS_TAG_MINF,
@@ -188,8 +475,7 @@ static int gbee_storage_read(gbms_tag_t tag, void *buff, size_t size, void *ptr)
 		if (size != sizeof(u32))
 			return -ENOMEM;
 
-		ret = nvmem_device_read(nvmem, BATT_EEPROM_TAG_BRID_OFFSET,
-					1, &temp);
+		ret = gbee_read(nvmem, BATT_EEPROM_TAG_BRID_OFFSET, &temp, 1);
 		if (ret < 0)
 			return ret;
 
@@ -205,11 +491,11 @@ static int gbee_storage_read(gbms_tag_t tag, void *buff, size_t size, void *ptr)
 	if (len > size)
 		return -ENOMEM;
 
-	ret = nvmem_device_read(nvmem, offset, len, buff);
-	if (ret == 0)
-		ret = len;
+	ret = gbee_read(nvmem, offset, buff, len);
+	if (ret < 0)
+		return ret;
 
-	return ret;
+	return len;
 }
 
 static bool gbee_storage_is_writable(gbms_tag_t tag)
@@ -236,12 +522,21 @@ static bool gbee_storage_is_writable(gbms_tag_t tag)
 
 }
 
+/*
+ * Pairing data and model state are written synchronously, the callers read
+ * them back to verify. Everything else is written in background.
+ */
+static bool gbee_storage_is_deferred(gbms_tag_t tag)
+{
+	return tag != GBMS_TAG_DINF && tag != GBMS_TAG_GMSR;
+}
+
 static int gbee_storage_write(gbms_tag_t tag, const void *buff, size_t size,
 			      void *ptr)
 {
 	struct nvmem_device *nvmem = ptr;
 	size_t offset = 0, len = 0;
-	int ret, write_size = 0;
+	int ret;
 
 	if (!gbee_storage_is_writable(tag))
 		return -ENOENT;
@@ -252,17 +547,29 @@ static int gbee_storage_write(gbms_tag_t tag, const void *buff, size_t size,
 	if (size > len)
 		return -ENOMEM;
 
-	for (write_size = 0; write_size < size; write_size++) {
-		ret = nvmem_device_write(nvmem, write_size + offset, 1,
-					 &((char *)buff)[write_size]);
-		if (ret < 0)
-			return ret;
-		msleep(BATT_WAIT_INTERNAL_WRITE_MS);
-	}
+	return gbee_write(nvmem, offset, buff, size,
+			  !gbee_storage_is_deferred(tag));
+}
 
-	ret = size;
+/*
+ * idx is the byte offset in the tag. Reads the EEPROM directly, used to verify
+ * a write against what the device actually holds.
+ */
+static int gbee_storage_read_range(gbms_tag_t tag, void *data, size_t count,
+				   int idx, void *ptr)
+{
+	struct nvmem_device *nvmem = GBEE_GET_NVRAM(ptr);
+	size_t offset = 0, len = 0;
+	int ret;
 
-	return ret;
+	ret = GBEE_STORAGE_INFO(tag, &offset, &len, ptr);
+	if (ret < 0)
+		return ret;
+
+	if (idx < 0 || !data || !count || idx + count > len)
+		return -EINVAL;
+
+	return gbee_read_device(nvmem, offset + idx, data, count);
 }
 
 static int gbee_storage_read_data(gbms_tag_t tag, void *data, size_t count,
@@ -276,6 +583,8 @@ static int gbee_storage_read_data(gbms_tag_t tag, void *data, size_t count,
 	case GBMS_TAG_HIST:
 		ret = GBEE_STORAGE_INFO(tag, &offset, &len, ptr);
 		break;
+	case GBMS_TAG_GMSR:
+		return gbee_storage_read_range(tag, data, count, idx, ptr);
 	default:
 		ret = -ENOENT;
 		break;
@@ -303,11 +612,30 @@ static int gbee_storage_read_data(gbms_tag_t tag, void *data, size_t count,
 
 	offset += len * idx;
 
-	ret = nvmem_device_read(nvmem, offset, len, data);
-	if (ret == 0)
-		ret = len;
+	ret = gbee_read(nvmem, offset, data, len);
+	if (ret < 0)
+		return ret;
 
-	return ret;
+	return len;
+}
+
+/* idx is the byte offset in the tag, used to update part of GMSR */
+static int gbee_storage_write_range(gbms_tag_t tag, const void *data,
+				    size_t count, int idx, void *ptr)
+{
+	struct nvmem_device *nvmem = GBEE_GET_NVRAM(ptr);
+	size_t offset = 0, len = 0;
+	int ret;
+
+	ret = GBEE_STORAGE_INFO(tag, &offset, &len, ptr);
+	if (ret < 0)
+		return ret;
+
+	if (idx < 0 || !data || !count || idx + count > len)
+		return -EINVAL;
+
+	return gbee_write(nvmem, offset + idx, data, count,
+			  !gbee_storage_is_deferred(tag));
 }
 
 static int gbee_storage_write_data(gbms_tag_t tag, const void *data,
@@ -315,12 +643,15 @@ static int gbee_storage_write_data(gbms_tag_t tag, const void *data,
 {
 	struct nvmem_device *nvmem = GBEE_GET_NVRAM(ptr);
 	size_t offset = 0, len = 0;
-	int ret, write_size = 0;
+	int ret;
 
 	switch (tag) {
 	case GBMS_TAG_HIST:
 		ret = GBEE_STORAGE_INFO(tag, &offset, &len, ptr);
 		break;
+	case GBMS_TAG_GMSR:
+	case GBMS_TAG_BCNT:
+		return gbee_storage_write_range(tag, data, count, idx, ptr);
 	default:
 		ret = -ENOENT;
 		break;
@@ -341,17 +672,8 @@ static int gbee_storage_write_data(gbms_tag_t tag, const void *data,
 
 	offset += len * idx;
 
-	for (write_size = 0; write_size < len; write_size++) {
-		ret = nvmem_device_write(nvmem, write_size + offset, 1,
-					 &((char *)data)[write_size]);
-		if (ret < 0)
-			return ret;
-		msleep(BATT_WAIT_INTERNAL_WRITE_MS);
-	}
-
-	ret = len;
-
-	return ret;
+	return gbee_write(nvmem, offset, data, len,
+			  !gbee_storage_is_deferred(tag));
 }
 
 static struct gbms_storage_desc gbee_storage_dsc = {
@@ -403,7 +725,7 @@ static int gbms_hist_move(struct nvmem_device *nvmem, int from, int to, int len)
 	if (index == 0)
 		goto exit;
 
-	ret = nvmem_device_write(nvmem, to, (BATT_ONE_HIST_LEN * index), buff);
+	ret = gbee_write_pages(nvmem, to, buff, BATT_ONE_HIST_LEN * index);
 	if (ret < 0)
 		pr_err("%s: cannot write history data (%d)\n", __func__, ret);
 
@@ -450,6 +772,40 @@ static int gbms_lotr_update(struct nvmem_device *nvmem, int lotr_to)
 	return ret;
 }
 
+static int gbee_mirror_get(void *data, u64 *val)
+{
+	*val = gbee_wq.valid;
+	return 0;
+}
+
+/* 0 invalidate the mirror, reads go to the EEPROM. !0 (re)load it */
+static int gbee_mirror_set(void *data, u64 val)
+{
+	if (!val) {
+		gbee_mirror_invalidate();
+		return 0;
+	}
+
+	return gbee_mirror_load();
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(gbee_mirror_fops, gbee_mirror_get, gbee_mirror_set,
+			"%llu\n");
+
+static void gbee_init_fs(void)
+{
+	if (gbee_wq.de)
+		return;
+
+	gbee_wq.de = debugfs_create_dir("google_eeprom", NULL);
+	if (IS_ERR_OR_NULL(gbee_wq.de)) {
+		gbee_wq.de = NULL;
+		return;
+	}
+
+	debugfs_create_file("mirror", 0600, gbee_wq.de, NULL, &gbee_mirror_fops);
+}
+
 static struct gbms_storage_desc *gbms_lotr_2_dsc(int lotr_ver)
 {
 	switch (lotr_ver) {
@@ -468,7 +824,8 @@ static struct gbms_storage_desc *gbms_lotr_2_dsc(int lotr_ver)
  * modifying the implementation of GBEE_GET_NVRAM and GBEE_STORAGE_INFO
  * TODO: map nvram cells to tags
  */
-int gbee_register_device(const char *name, int lotr, struct nvmem_device *nvram)
+int gbee_register_device(const char *name, int lotr, u32 page_size,
+			 struct nvmem_device *nvram)
 {
 	int ret;
 
@@ -483,10 +840,39 @@ int gbee_register_device(const char *name, int lotr, struct nvmem_device *nvram)
 		goto error_exit;
 	}
 
+	/* deferred writes, singleton like gbee_desc */
+	if (!gbee_wq.nvmem) {
+		mutex_init(&gbee_wq.lock);
+		mutex_init(&gbee_wq.write_lock);
+		INIT_DELAYED_WORK(&gbee_wq.work, gbee_wq_work);
+	}
+	if (!page_size) {
+		page_size = GBEE_PAGE_SIZE;
+	} else if (!is_power_of_2(page_size) ||
+		   page_size > GBEE_PAGE_SIZE_MAX ||
+		   page_size > GBEE_EEPROM_SIZE) {
+		pr_warn("gbee %s invalid page size %u, using %d\n",
+			name, page_size, GBEE_PAGE_SIZE);
+		page_size = GBEE_PAGE_SIZE;
+	}
+	gbee_wq.page_size = page_size;
+	gbee_wq.nvmem = nvram;
+	gbee_wq.enabled = true;
+
+	/* after the layout conversion, reads come from RAM from now on */
+	ret = gbee_mirror_load();
+	if (ret < 0)
+		pr_warn("gbee %s no mirror, %d\n", name, ret);
+
 	/* watch out for races on gbee_desc */
 	ret = gbms_storage_register(gbee_desc, name, nvram);
-	if (ret == 0)
+	if (ret == 0) {
+		gbee_init_fs();
 		return 0;
+	}
+
+	gbee_wq.enabled = false;
+	gbee_mirror_invalidate();
 
 error_exit:
 	gbee_desc = NULL;
@@ -496,7 +882,26 @@ EXPORT_SYMBOL_GPL(gbee_register_device);
 
 void gbee_destroy_device(void)
 {
+	unsigned long fail_at = 0;
+	int ret;
+
+	if (!gbee_wq.nvmem)
+		goto exit_done;
+
+	/* no more deferred writes and no more retries */
+	mutex_lock(&gbee_wq.lock);
+	gbee_wq.enabled = false;
+	mutex_unlock(&gbee_wq.lock);
+
+	/* write what is pending, then make sure that the work is idle */
+	ret = gbee_wq_flush(&fail_at);
+	cancel_delayed_work_sync(&gbee_wq.work);
+	if (ret < 0)
+		gbee_wq_drop(fail_at, ret);
 
+exit_done:
+	debugfs_remove_recursive(gbee_wq.de);
+	gbee_wq.de = NULL;
 }
 EXPORT_SYMBOL_GPL(gbee_destroy_device);
 
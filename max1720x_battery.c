@@ -18,6 +18,7 @@
 
 #include <linux/err.h>
 #include <linux/i2c.h>
+#include <linux/log2.h>
 #include <linux/iio/consumer.h>
 #include <linux/interrupt.h>
 #include <linux/module.h>
@@ -98,6 +99,10 @@ struct gbatt_capacity_estimation {
 	int cap_filter_count;
 	int start_cc;
 	int start_vfsoc;
+	/* partial window: connect to disconnect, not persisted */
+	int partial_cc_sum;
+	int partial_vfsoc_sum;
+	int partial_count;
 };
 
 #define DEFAULT_BATTERY_ID		0
@@ -116,6 +121,9 @@ struct gbatt_capacity_estimation {
 
 #define CE_FILTER_COUNT_MAX	15
 
+/* a partial window needs at least this much vfsoc to count */
+#define CE_PARTIAL_MIN_VFSOC	20
+
 #define BHI_CAP_FCN_COUNT	3
 
 #pragma pack(1)
@@ -146,6 +154,22 @@ struct max1720x_history {
 	u16 *history;
 };
 
+/* non blocking model load, see max1720x_model_load() */
+enum max1720x_model_load_state {
+	MAX1720X_MODEL_LOAD_IDLE = 0,
+	MAX1720X_MODEL_LOAD_WAIT_DNR,	/* waiting for FSTAT.DNR to clear */
+	MAX1720X_MODEL_LOAD_LOADING,	/* waiting for CONFIG2.LDMDL to clear */
+};
+
+struct max1720x_model_load_stats {
+	u32 count;
+	u32 failures;
+	u32 dnr_polls;
+	u32 ldmdl_polls;
+	u32 last_ms;
+	u32 max_ms;
+};
+
 struct max1720x_chip {
 	struct device *dev;
 	bool irq_shared;
@@ -175,6 +199,10 @@ struct max1720x_chip {
 	bool model_state_valid;	/* state read from persistent */
 	int model_reload;
 	bool model_ok;		/* model is running */
+	enum max1720x_model_load_state model_load_state;
+	int model_load_polls;
+	ktime_t model_load_start;
+	struct max1720x_model_load_stats model_load_stats;
 
 	/* history */
 	struct mutex history_lock;
@@ -267,6 +295,122 @@ static bool max17x0x_reglog_init(struct max1720x_chip *chip)
 	return chip->regmap.reglog && chip->regmap_nvram.reglog;
 }
 
+/* called from the regmap wrappers in max1720x_battery.h */
+void max17x0x_regprof_log(struct max17x0x_regprof *prof, unsigned int reg,
+			  bool write, int rtn, u64 start_ns,
+			  const struct max17x0x_regsite *site)
+{
+	const u64 delta_ns = ktime_get_ns() - start_ns;
+	const u32 delta_us = div_u64(delta_ns, NSEC_PER_USEC);
+	int bucket, i;
+
+	if (!prof)
+		return;
+
+	bucket = delta_us < 16 ? 0 : ilog2(delta_us) - 3;
+	if (bucket >= MAX17X0X_REGPROF_BUCKETS)
+		bucket = MAX17X0X_REGPROF_BUCKETS - 1;
+
+	spin_lock(&prof->lock);
+	prof->hist[bucket]++;
+
+	if (reg < NB_REGMAP_MAX) {
+		struct max17x0x_regprof_reg *r = &prof->reg[reg];
+
+		if (write)
+			r->writes++;
+		else
+			r->reads++;
+		if (rtn < 0)
+			r->errors++;
+		r->time_ns += delta_ns;
+	}
+
+	/* call sites are identified by their static regsite */
+	for (i = 0; site && i < MAX17X0X_REGPROF_TAGS; i++) {
+		struct max17x0x_regprof_tag *t = &prof->tag[i];
+
+		if (!t->site)
+			t->site = site;
+		if (t->site == site) {
+			t->count++;
+			t->time_ns += delta_ns;
+			break;
+		}
+	}
+	if (site && i == MAX17X0X_REGPROF_TAGS)
+		prof->tag_overflow++;
+
+	spin_unlock(&prof->lock);
+}
+
+static struct max17x0x_regprof *max17x0x_regprof_alloc(struct device *dev)
+{
+	struct max17x0x_regprof *prof;
+
+	prof = devm_kzalloc(dev, sizeof(*prof), GFP_KERNEL);
+	if (prof)
+		spin_lock_init(&prof->lock);
+
+	return prof;
+}
+
+#define MAX17X0X_REGCACHE_TTL_MS	60000
+
+/* max1720x and max_m5 share the address of these registers */
+static const struct {
+	u8 reg;
+	u8 policy;
+} max17x0x_regcache_policy[] = {
+	{ MAX1720X_DESIGNCAP, MAX17X0X_REG_STATIC },
+	{ MAX1720X_ICHGTERM, MAX17X0X_REG_STATIC },
+	{ MAX1720X_FILTERCFG, MAX17X0X_REG_STATIC },
+	{ MAX1720X_RELAXCFG, MAX17X0X_REG_STATIC },
+	{ MAX1720X_VEMPTY, MAX17X0X_REG_STATIC },
+	{ MAX1720X_FULLCAP, MAX17X0X_REG_SLOW },
+	{ MAX1720X_CYCLES, MAX17X0X_REG_SLOW },
+	{ MAX1720X_QRTABLE00, MAX17X0X_REG_SLOW },
+	{ MAX1720X_QRTABLE10, MAX17X0X_REG_SLOW },
+	{ MAX1720X_QRTABLE20, MAX17X0X_REG_SLOW },
+	{ MAX1720X_QRTABLE30, MAX17X0X_REG_SLOW },
+	{ MAX1720X_LEARNCFG, MAX17X0X_REG_SLOW },
+	{ MAX1720X_MISCCFG, MAX17X0X_REG_SLOW },
+	{ MAX1720X_RCOMP0, MAX17X0X_REG_SLOW },
+	{ MAX1720X_TEMPCO, MAX17X0X_REG_SLOW },
+};
+
+/* max1730x has a different layout and runs without cache */
+static void max17x0x_regcache_init(struct max1720x_chip *chip)
+{
+	struct max17x0x_regcache *cache;
+	int i;
+
+	if (chip->gauge_type != MAX1720X_GAUGE_TYPE &&
+	    chip->gauge_type != MAX_M5_GAUGE_TYPE)
+		return;
+
+	cache = devm_kzalloc(chip->dev, sizeof(*cache), GFP_KERNEL);
+	if (!cache)
+		return;
+
+	spin_lock_init(&cache->lock);
+	cache->ttl = msecs_to_jiffies(MAX17X0X_REGCACHE_TTL_MS);
+	for (i = 0; i < ARRAY_SIZE(max17x0x_regcache_policy); i++)
+		cache->policy[max17x0x_regcache_policy[i].reg] =
+			max17x0x_regcache_policy[i].policy;
+	if (chip->gauge_type == MAX_M5_GAUGE_TYPE)
+		cache->policy[MAX_M5_CONVGCFG] = MAX17X0X_REG_STATIC;
+
+	chip->regmap.regcache = cache;
+}
+
+/* the profiler is always on, failing to allocate it is not fatal */
+static void max17x0x_regprof_init(struct max1720x_chip *chip)
+{
+	chip->regmap.regprof = max17x0x_regprof_alloc(chip->dev);
+	chip->regmap_nvram.regprof = max17x0x_regprof_alloc(chip->dev);
+}
+
 /* ------------------------------------------------------------------------- */
 
 
@@ -294,17 +438,27 @@ static inline int max17x0x_reg_read(struct max17x0x_regmap *map,
 {
 	const struct max17x0x_reg *reg;
 	unsigned int tmp;
+	u64 start_ns;
+	u32 gen;
 	int rtn;
 
 	reg = max17x0x_find_by_tag(map, tag);
 	if (!reg)
 		return -EINVAL;
 
+	if (max17x0x_regcache_get(map->regcache, reg->reg, val, &gen))
+		return 0;
+
+	start_ns = ktime_get_ns();
 	rtn = regmap_read(map->regmap, reg->reg, &tmp);
-	if (rtn)
+	max17x0x_regprof_log(map->regprof, reg->reg, false, rtn, start_ns,
+			     MAX17X0X_REGSITE_NAMED("tag"));
+	if (rtn) {
 		pr_err("Failed to read %x\n", reg->reg);
-	else
+	} else {
 		*val = tmp;
+		max17x0x_regcache_fill(map->regcache, reg->reg, tmp, gen);
+	}
 
 	return rtn;
 }
@@ -342,6 +496,7 @@ static int max17x0x_reg_store_sz(struct max17x0x_regmap *map,
 				 const void *data,
 				 int size)
 {
+	u64 start_ns;
 	int i, ret;
 
 	if (size > a->size)
@@ -354,7 +509,11 @@ static int max17x0x_reg_store_sz(struct max17x0x_regmap *map,
 			return -ERANGE;
 
 		for (i = 0; i < size / 2 ; i++) {
+			start_ns = ktime_get_ns();
 			ret = regmap_write(map->regmap, a->map[i], b[i]);
+			max17x0x_regprof_log(map->regprof, a->map[i], true, ret,
+					     start_ns, MAX17X0X_REGSITE_NAMED("map"));
+			max17x0x_regcache_drop(map->regcache, a->map[i], 1);
 			if (ret < 0)
 				break;
 
@@ -363,7 +522,11 @@ static int max17x0x_reg_store_sz(struct max17x0x_regmap *map,
 	} else if (a->type == GBMS_ATOM_TYPE_SET) {
 		ret = -EINVAL;
 	} else {
+		start_ns = ktime_get_ns();
 		ret = regmap_raw_write(map->regmap, a->base, data, size);
+		max17x0x_regprof_log(map->regprof, a->base, true, ret,
+				     start_ns, MAX17X0X_REGSITE_NAMED("raw"));
+		max17x0x_regcache_drop(map->regcache, a->base, size / 2);
 
 		if (map->reglog) {
 			const u16 *b = (u16 *)data;
@@ -382,6 +545,7 @@ static int max17x0x_reg_load_sz(struct max17x0x_regmap *map,
 				void *data,
 				int size)
 {
+	u64 start_ns;
 	int ret;
 
 	if (size > a->size)
@@ -396,9 +560,13 @@ static int max17x0x_reg_load_sz(struct max17x0x_regmap *map,
 			return -ERANGE;
 
 		for (i = 0; i < size / 2 ; i++) {
+			start_ns = ktime_get_ns();
 			ret = regmap_read(map->regmap,
 					  (unsigned int)a->map[i],
 					  &tmp);
+			max17x0x_regprof_log(map->regprof, a->map[i], false,
+					     ret, start_ns,
+					     MAX17X0X_REGSITE_NAMED("map"));
 			if (ret < 0)
 				break;
 			b[i] = tmp;
@@ -406,7 +574,10 @@ static int max17x0x_reg_load_sz(struct max17x0x_regmap *map,
 	} else if (a->type == GBMS_ATOM_TYPE_SET) {
 		ret = -EINVAL;
 	} else {
+		start_ns = ktime_get_ns();
 		ret = regmap_raw_read(map->regmap, a->base, data, size);
+		max17x0x_regprof_log(map->regprof, a->base, false, ret,
+				     start_ns, MAX17X0X_REGSITE_NAMED("raw"));
 	}
 
 	return ret;
@@ -920,6 +1091,10 @@ static int max1720x_model_reload(struct max1720x_chip *chip, bool force)
 	if (!force && (pending || disabled))
 		return -EEXIST;
 
+	/* cannot restart while the gauge is loading the model */
+	if (chip->model_load_state != MAX1720X_MODEL_LOAD_IDLE)
+		return -EBUSY;
+
 	version_now = max_m5_model_read_version(chip->model_data);
 	version_load = max_m5_fg_model_version(chip->model_data);
 
@@ -1701,14 +1876,16 @@ static void batt_ce_dump_data(const struct gbatt_capacity_estimation *cap_esti,
 			    " delta_cc_sum: %d"
 			    " delta_vfsoc_sum: %d"
 			    " state: %d"
-			    " cable: %d",
+			    " cable: %d"
+			    " partial: %d",
 			    cap_esti->cap_filter_count,
 			    cap_esti->start_cc,
 			    cap_esti->start_vfsoc,
 			    cap_esti->delta_cc_sum,
 			    cap_esti->delta_vfsoc_sum,
 			    cap_esti->estimate_state,
-			    cap_esti->cable_in);
+			    cap_esti->cable_in,
+			    cap_esti->partial_count);
 }
 
 static int batt_ce_load_data(struct max17x0x_regmap *map,
@@ -1762,12 +1939,85 @@ static void batt_ce_stop_estimation(struct gbatt_capacity_estimation *cap_esti,
 	cap_esti->start_cc = 0;
 }
 
+/*
+ * Stream one window (delta_cc, delta_vfsoc) into a running sum: the sums
+ * decay by 1/filt_length once the filter is full.
+ */
+static void batt_ce_accumulate(int *cc_sum, int *vfsoc_sum, int *count,
+			       int delta_cc, int delta_vfsoc, int filt_length)
+{
+	if (*count >= filt_length) {
+		*cc_sum -= *cc_sum / filt_length;
+		*vfsoc_sum -= *vfsoc_sum / filt_length;
+	}
+
+	*cc_sum += delta_cc;
+	*vfsoc_sum += delta_vfsoc;
+	*count += 1;
+}
+
+/* full windows only, partial windows are not reported as the estimate */
 static int batt_ce_full_estimate(struct gbatt_capacity_estimation *ce)
 {
 	return (ce->cap_filter_count > 0) && (ce->delta_vfsoc_sum > 0) ?
 		ce->delta_cc_sum / ce->delta_vfsoc_sum : -1;
 }
 
+/* debug only, from connect to disconnect when the full window was missed */
+static int batt_ce_partial_estimate(struct gbatt_capacity_estimation *ce)
+{
+	return (ce->partial_count > 0) && (ce->partial_vfsoc_sum > 0) ?
+		ce->partial_cc_sum / ce->partial_vfsoc_sum : -1;
+}
+
+/* 0-100, grows with the number of full windows in the estimate */
+static int batt_ce_confidence(const struct gbatt_capacity_estimation *ce)
+{
+	const int length = ce->cap_filt_length > 0 ? ce->cap_filt_length : 1;
+	int conf;
+
+	if (ce->cap_filter_count <= 0 || ce->delta_vfsoc_sum <= 0)
+		return 0;
+
+	conf = ce->cap_filter_count * 100 / length;
+	return conf > 100 ? 100 : conf;
+}
+
+/* call holding &cap_esti->batt_ce_lock, close the partial window */
+static void batt_ce_partial_close(struct max1720x_chip *chip,
+				  struct gbatt_capacity_estimation *cap_esti)
+{
+	const int lsb = max_m5_cap_lsb(chip->model_data);
+	int delta_cc, delta_vfsoc, vfsoc, rc;
+
+	/* the full window already used this session */
+	if (cap_esti->estimate_state != ESTIMATE_NONE)
+		return;
+
+	rc = max1720x_update_battery_qh_based_capacity(chip);
+	if (rc < 0)
+		return;
+
+	vfsoc = max1720x_get_battery_vfsoc(chip);
+	if (vfsoc < 0)
+		return;
+
+	delta_vfsoc = vfsoc - cap_esti->start_vfsoc;
+	delta_cc = reg_to_micro_amp_h(chip->current_capacity, chip->RSense,
+				      lsb) / 1000 - cap_esti->start_cc;
+	if (delta_vfsoc < CE_PARTIAL_MIN_VFSOC || delta_cc <= 0)
+		return;
+
+	batt_ce_accumulate(&cap_esti->partial_cc_sum,
+			   &cap_esti->partial_vfsoc_sum,
+			   &cap_esti->partial_count,
+			   delta_cc, delta_vfsoc, cap_esti->cap_filt_length);
+
+	logbuffer_log(chip->ce_log, "partial delta[cc=%d,vfsoc=%d] ce[%d]=%d",
+		      delta_cc, delta_vfsoc, cap_esti->partial_count,
+		      cap_esti->partial_cc_sum / cap_esti->partial_vfsoc_sum);
+}
+
 /* Measure the deltaCC, deltaVFSOC and CapacityFiltered */
 static void batt_ce_capacityfiltered_work(struct work_struct *work)
 {
@@ -1777,7 +2027,6 @@ static void batt_ce_capacityfiltered_work(struct work_struct *work)
 	const int lsb = max_m5_cap_lsb(chip->model_data);
 	int settle_cc = 0, settle_vfsoc = 0;
 	int delta_cc = 0, delta_vfsoc = 0;
-	int cc_sum = 0, vfsoc_sum = 0;
 	bool valid_estimate = false;
 	int rc = 0;
 	int data;
@@ -1806,20 +2055,11 @@ static void batt_ce_capacityfiltered_work(struct work_struct *work)
 	delta_vfsoc = settle_vfsoc - cap_esti->start_vfsoc;
 
 	if ((delta_cc > 0) && (delta_vfsoc > 0)) {
-
-		cc_sum = delta_cc + cap_esti->delta_cc_sum;
-		vfsoc_sum = delta_vfsoc + cap_esti->delta_vfsoc_sum;
-
-		if (cap_esti->cap_filter_count >= cap_esti->cap_filt_length) {
-			const int filter_divisor = cap_esti->cap_filt_length;
-
-			cc_sum -= cap_esti->delta_cc_sum/filter_divisor;
-			vfsoc_sum -= cap_esti->delta_vfsoc_sum/filter_divisor;
-		}
-
-		cap_esti->cap_filter_count++;
-		cap_esti->delta_cc_sum = cc_sum;
-		cap_esti->delta_vfsoc_sum = vfsoc_sum;
+		batt_ce_accumulate(&cap_esti->delta_cc_sum,
+				   &cap_esti->delta_vfsoc_sum,
+				   &cap_esti->cap_filter_count,
+				   delta_cc, delta_vfsoc,
+				   cap_esti->cap_filt_length);
 		batt_ce_store_data(&chip->regmap_nvram, &chip->cap_estimate);
 
 		valid_estimate = true;
@@ -1844,9 +2084,10 @@ exit:
 }
 
 /*
- * batt_ce_init(): estimate_state = ESTIMATE_NONE
- * batt_ce_start(): estimate_state = ESTIMATE_NONE -> ESTIMATE_PENDING
+ * GBMS_CE_CTRL_START, batt_ce_init(): estimate_state = ESTIMATE_NONE
+ * GBMS_CE_CTRL_EOC, batt_ce_start(): ESTIMATE_NONE -> ESTIMATE_PENDING
  * batt_ce_capacityfiltered_work(): ESTIMATE_PENDING->ESTIMATE_DONE
+ * GBMS_CE_CTRL_STOP: batt_ce_partial_close() when not ESTIMATE_DONE
  */
 static int batt_ce_start(struct gbatt_capacity_estimation *cap_esti,
 			 int cap_tsettle_ms)
@@ -2112,20 +2353,20 @@ static int max1720x_get_property(struct power_supply *psy,
 	}
 	pm_runtime_put_sync(chip->dev);
 
+	/* model_work doesn't hold model_lock while the gauge loads the model */
+	if (chip->model_load_state != MAX1720X_MODEL_LOAD_IDLE) {
+		mutex_unlock(&chip->model_lock);
+		return -EAGAIN;
+	}
+
 	switch (psp) {
 	case POWER_SUPPLY_PROP_STATUS:
 		err = max1720x_get_battery_status(chip);
 		if (err < 0)
 			break;
 
-		/*
-		 * Capacity estimation must run only once.
-		 * NOTE: this is a getter with a side effect
-		 */
+		/* capacity estimation is driven by GBMS_PROP_BATT_CE_CTRL */
 		val->intval = err;
-		if (err == POWER_SUPPLY_STATUS_FULL)
-			batt_ce_start(&chip->cap_estimate,
-				      chip->cap_estimate.cap_tsettle);
 		/* return data ok */
 		err = 0;
 		break;
@@ -2305,6 +2546,9 @@ static int max1720x_get_property(struct power_supply *psy,
 	case GBMS_PROP_CHARGE_FULL_ESTIMATE:
 		val->intval = batt_ce_full_estimate(&chip->cap_estimate);
 		break;
+	case GBMS_PROP_CHARGE_FULL_ESTIMATE_CONF:
+		val->intval = batt_ce_confidence(&chip->cap_estimate);
+		break;
 	case GBMS_PROP_CAPACITY_FADE_RATE:
 		val->intval = max1720x_get_fade_rate(chip);
 		break;
@@ -2350,19 +2594,29 @@ static int max1720x_health_update_ai(struct max1720x_chip *chip, int impedance)
 }
 
 
-static void max1720x_fixup_capacity(struct max1720x_chip *chip, int plugged)
+/* snap is filled here and can be shared with max1720x_monitor_log_data() */
+static void max1720x_fixup_capacity(struct max1720x_chip *chip, int plugged,
+				    struct max1720x_drift_snapshot *snap)
 {
 	struct max1720x_drift_data *ddata = &chip->drift_data;
 	int ret, cycle_count, cap_lsb;
 	u16 data16;
 
+	snap->valid = false;
+
 	/* do not execute when POR is set */
 	ret = REGMAP_READ(&chip->regmap, MAX1720X_STATUS, &data16);
 	if (ret < 0 || data16 & MAX1720X_STATUS_POR)
 		return;
 
+	ret = max1720x_drift_snapshot_read(ddata, &chip->regmap, snap);
+	if (ret < 0) {
+		dev_err(chip->dev, "cannot read drift snapshot (%d)\n", ret);
+		return;
+	}
+
 	/* capacity outliers: fix rcomp0, tempco */
-	ret = max1720x_fixup_comp(ddata, &chip->regmap, plugged);
+	ret = max1720x_fixup_comp(ddata, &chip->regmap, snap, plugged);
 	if (ret > 0) {
 		chip->comp_update_count += 1;
 
@@ -2381,7 +2635,8 @@ static void max1720x_fixup_capacity(struct max1720x_chip *chip, int plugged)
 
 	/* capacity outliers: fix capacity */
 	cap_lsb = max_m5_cap_lsb(chip->model_data);
-	ret = max1720x_fixup_dxacc(ddata, &chip->regmap, cycle_count, plugged, cap_lsb);
+	ret = max1720x_fixup_dxacc(ddata, &chip->regmap, snap, cycle_count,
+				   plugged, cap_lsb);
 	if (ret > 0) {
 		chip->dxacc_update_count += 1;
 
@@ -2415,6 +2670,18 @@ static int max1720x_set_property(struct power_supply *psy,
 
 	switch (psp) {
 	case GBMS_PROP_BATT_CE_CTRL:
+		if (val->intval != GBMS_CE_CTRL_STOP &&
+		    val->intval != GBMS_CE_CTRL_START &&
+		    val->intval != GBMS_CE_CTRL_EOC) {
+			rc = -EINVAL;
+			break;
+		}
+
+		/* Capacity estimation must run only once per session */
+		if (val->intval == GBMS_CE_CTRL_EOC) {
+			batt_ce_start(ce, ce->cap_tsettle);
+			break;
+		}
 
 		mutex_lock(&ce->batt_ce_lock);
 
@@ -2424,7 +2691,7 @@ static int max1720x_set_property(struct power_supply *psy,
 			return -EAGAIN;
 		}
 
-		if (val->intval) {
+		if (val->intval == GBMS_CE_CTRL_START) {
 
 			if (!ce->cable_in) {
 				rc = batt_ce_init(ce, chip);
@@ -2434,6 +2701,8 @@ static int max1720x_set_property(struct power_supply *psy,
 		} else if (ce->cable_in) {
 			if (ce->estimate_state == ESTIMATE_PENDING)
 				cancel_delayed_work_sync(&ce->settle_timer);
+			else
+				batt_ce_partial_close(chip, ce);
 
 			/* race with batt_ce_capacityfiltered_work() */
 			batt_ce_stop_estimation(ce, ESTIMATE_NONE);
@@ -2478,66 +2747,33 @@ static int max1720x_property_is_writeable(struct power_supply *psy,
 	return 0;
 }
 
-static int max1720x_monitor_log_data(struct max1720x_chip *chip)
+/* reuse snap when valid (from the drift check), read it otherwise */
+static int max1720x_monitor_log_data(struct max1720x_chip *chip,
+				     struct max1720x_drift_snapshot *snap)
 {
-	u16 data, repsoc, vfsoc, avcap, repcap, fullcap, fullcaprep;
-	u16 fullcapnom, qh0, qh, dqacc, dpacc, qresidual, fstat;
+	struct max1720x_drift_snapshot local;
 	int ret = 0, charge_counter = -1;
+	u16 data, repsoc;
 
-	ret = REGMAP_READ(&chip->regmap, MAX1720X_REPSOC, &data);
-	if (ret < 0)
-		return ret;
-
-	repsoc = (data >> 8) & 0x00FF;
-	if (repsoc == chip->pre_repsoc)
-		return ret;
-
-	ret = REGMAP_READ(&chip->regmap, MAX1720X_VFSOC, &vfsoc);
-	if (ret < 0)
-		return ret;
-
-	ret = REGMAP_READ(&chip->regmap, MAX1720X_AVCAP, &avcap);
-	if (ret < 0)
-		return ret;
-
-	ret = REGMAP_READ(&chip->regmap, MAX1720X_REPCAP, &repcap);
-	if (ret < 0)
-		return ret;
-
-	ret = REGMAP_READ(&chip->regmap, MAX1720X_FULLCAP, &fullcap);
-	if (ret < 0)
-		return ret;
-
-	ret = REGMAP_READ(&chip->regmap, MAX1720X_FULLCAPREP, &fullcaprep);
-	if (ret < 0)
-		return ret;
-
-	ret = REGMAP_READ(&chip->regmap, MAX1720X_FULLCAPNOM, &fullcapnom);
-	if (ret < 0)
-		return ret;
-
-	ret = REGMAP_READ(&chip->regmap, MAX1720X_QH0, &qh0);
-	if (ret < 0)
-		return ret;
-
-	ret = REGMAP_READ(&chip->regmap, MAX1720X_QH, &qh);
-	if (ret < 0)
-		return ret;
-
-	ret = REGMAP_READ(&chip->regmap, MAX1720X_DQACC, &dqacc);
-	if (ret < 0)
-		return ret;
+	if (!snap || !snap->valid) {
+		ret = REGMAP_READ(&chip->regmap, MAX1720X_REPSOC, &data);
+		if (ret < 0)
+			return ret;
 
-	ret = REGMAP_READ(&chip->regmap, MAX1720X_DPACC, &dpacc);
-	if (ret < 0)
-		return ret;
+		repsoc = (data >> 8) & 0x00FF;
+		if (repsoc == chip->pre_repsoc)
+			return ret;
 
-	ret = REGMAP_READ(&chip->regmap, MAX1720X_QRESIDUAL, &qresidual);
-	if (ret < 0)
-		return ret;
+		snap = &local;
+		ret = max1720x_drift_snapshot_read(&chip->drift_data,
+						   &chip->regmap, snap);
+		if (ret < 0)
+			return ret;
+	}
 
-	ret = REGMAP_READ(&chip->regmap, MAX1720X_FSTAT, &fstat);
-	if (ret < 0)
+	data = snap->repsoc;
+	repsoc = (data >> 8) & 0x00FF;
+	if (repsoc == chip->pre_repsoc)
 		return ret;
 
 	ret = max1720x_update_battery_qh_based_capacity(chip);
@@ -2548,13 +2784,14 @@ static int max1720x_monitor_log_data(struct max1720x_chip *chip)
 			     "%s %02X:%04X %02X:%04X %02X:%04X %02X:%04X %02X:%04X"
 			     " %02X:%04X %02X:%04X %02X:%04X %02X:%04X %02X:%04X"
 			     " %02X:%04X %02X:%04X %02X:%04X CC:%d",
-			     chip->max1720x_psy_desc.name, MAX1720X_REPSOC, data, MAX1720X_VFSOC,
-			     vfsoc, MAX1720X_AVCAP, avcap, MAX1720X_REPCAP, repcap,
-			     MAX1720X_FULLCAP, fullcap, MAX1720X_FULLCAPREP, fullcaprep,
-			     MAX1720X_FULLCAPNOM, fullcapnom, MAX1720X_QH0, qh0,
-			     MAX1720X_QH, qh, MAX1720X_DQACC, dqacc, MAX1720X_DPACC, dpacc,
-			     MAX1720X_QRESIDUAL, qresidual, MAX1720X_FSTAT, fstat,
-			     charge_counter);
+			     chip->max1720x_psy_desc.name, MAX1720X_REPSOC, data,
+			     MAX1720X_VFSOC, snap->vfsoc, MAX1720X_AVCAP, snap->avcap,
+			     MAX1720X_REPCAP, snap->repcap, MAX1720X_FULLCAP, snap->fullcap,
+			     MAX1720X_FULLCAPREP, snap->fullcaprep,
+			     MAX1720X_FULLCAPNOM, snap->fullcapnom, MAX1720X_QH0, snap->qh0,
+			     MAX1720X_QH, snap->qh, MAX1720X_DQACC, snap->dqacc,
+			     MAX1720X_DPACC, snap->dpacc, MAX1720X_QRESIDUAL, snap->qresidual,
+			     MAX1720X_FSTAT, snap->fstat, charge_counter);
 
 	chip->pre_repsoc = repsoc;
 
@@ -2583,6 +2820,7 @@ static int max17x0x_fg_reset(struct max1720x_chip *chip)
 			    rset->map16[0], rset->map16[1], rset->map16[2]);
 
 	err = REGMAP_WRITE(&chip->regmap, rset->map16[0], rset->map16[1]);
+	max17x0x_regcache_invalidate(chip->regmap.regcache);
 	if (err < 0) {
 		dev_err(chip->dev, "FG_RESET error writing Config2 (%d)\n",
 				   err);
@@ -2643,6 +2881,7 @@ static int max1720x_full_reset(struct max1720x_chip *chip)
 
 	REGMAP_WRITE(&chip->regmap, MAX17XXX_COMMAND,
 		     MAX1720X_COMMAND_HARDWARE_RESET);
+	max17x0x_regcache_invalidate(chip->regmap.regcache);
 
 	msleep(MAX17X0X_TPOR_MS);
 
@@ -2762,6 +3001,7 @@ static irqreturn_t max1720x_fg_irq_thread_fn(int irq, void *obj)
 
 	if (fg_status & MAX1720X_STATUS_POR) {
 		dev_warn(chip->dev, "POR is set\n");
+		max17x0x_regcache_invalidate(chip->regmap.regcache);
 
 		/* trigger model load */
 		mutex_lock(&chip->model_lock);
@@ -2828,14 +3068,15 @@ static irqreturn_t max1720x_fg_irq_thread_fn(int irq, void *obj)
 	/* SOC interrupts need to go through all the time */
 	if (fg_status & MAX1720X_STATUS_DSOCI) {
 		const bool plugged = chip->cap_estimate.cable_in;
+		struct max1720x_drift_snapshot snap = { .valid = false };
 
 		if (max1720x_check_drift_on_soc(&chip->drift_data))
-			max1720x_fixup_capacity(chip, plugged);
+			max1720x_fixup_capacity(chip, plugged, &snap);
 
 		if (storm)
 			pr_debug("Force power_supply_change in storm\n");
 		else
-			max1720x_monitor_log_data(chip);
+			max1720x_monitor_log_data(chip, &snap);
 
 		storm = false;
 	}
@@ -3432,6 +3673,19 @@ static int debug_ce_start(void *data, u64 val)
 
 DEFINE_SIMPLE_ATTRIBUTE(debug_ce_start_fops, NULL, debug_ce_start, "%llu\n");
 
+static int debug_ce_partial_get(void *data, u64 *val)
+{
+	struct max1720x_chip *chip = (struct max1720x_chip *)data;
+
+	mutex_lock(&chip->cap_estimate.batt_ce_lock);
+	*val = batt_ce_partial_estimate(&chip->cap_estimate);
+	mutex_unlock(&chip->cap_estimate.batt_ce_lock);
+	return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(debug_ce_partial_fops, debug_ce_partial_get, NULL,
+			"%lld\n");
+
 /* Model reload will be disabled if the node is not found */
 static int max1720x_init_model(struct max1720x_chip *chip)
 {
@@ -3490,6 +3744,12 @@ static int debug_batt_id_set(void *data, u64 val)
 
 	mutex_lock(&chip->model_lock);
 
+	/* model_work uses model_data while the gauge loads the model */
+	if (chip->model_load_state != MAX1720X_MODEL_LOAD_IDLE) {
+		mutex_unlock(&chip->model_lock);
+		return -EBUSY;
+	}
+
 	/* reset state (if needed) */
 	if (chip->model_data)
 		max_m5_free_data(chip->model_data);
@@ -3498,12 +3758,12 @@ static int debug_batt_id_set(void *data, u64 val)
 	/* re-init the model data (lookup in DT) */
 	ret = max1720x_init_model(chip);
 	if (ret == 0)
-		max1720x_model_reload(chip, true);
+		ret = max1720x_model_reload(chip, true);
 
 	mutex_unlock(&chip->model_lock);
 
 	dev_info(chip->dev, "Force model for batt_id=%llu (%d)\n", val, ret);
-	return 0;
+	return ret < 0 ? ret : 0;
 }
 
 DEFINE_SIMPLE_ATTRIBUTE(debug_batt_id_fops, NULL, debug_batt_id_set, "%llu\n");
@@ -3586,6 +3846,125 @@ static ssize_t debug_get_reglog_writes(struct file *filp,
 BATTERY_DEBUG_ATTRIBUTE(debug_reglog_writes_fops,
 			debug_get_reglog_writes, NULL);
 
+static int debug_regprof_show(struct seq_file *s, void *unused)
+{
+	struct max17x0x_regprof *prof = s->private;
+	struct max17x0x_regprof *copy;
+	int i;
+
+	copy = kmalloc(sizeof(*copy), GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	spin_lock(&prof->lock);
+	memcpy(copy, prof, sizeof(*copy));
+	spin_unlock(&prof->lock);
+
+	seq_puts(s, "reg   reads  writes  errors     time_us\n");
+	for (i = 0; i < NB_REGMAP_MAX; i++) {
+		const struct max17x0x_regprof_reg *r = &copy->reg[i];
+
+		if (!r->reads && !r->writes)
+			continue;
+
+		seq_printf(s, "%02X %7u %7u %7u %11llu\n", i, r->reads,
+			   r->writes, r->errors,
+			   div_u64(r->time_ns, NSEC_PER_USEC));
+	}
+
+	seq_puts(s, "\ncount     time_us  site\n");
+	for (i = 0; i < MAX17X0X_REGPROF_TAGS && copy->tag[i].site; i++) {
+		const struct max17x0x_regsite *site = copy->tag[i].site;
+
+		seq_printf(s, "%5u %11llu  %s:%d %s\n", copy->tag[i].count,
+			   div_u64(copy->tag[i].time_ns, NSEC_PER_USEC),
+			   site->func, site->line, site->name);
+	}
+	if (copy->tag_overflow)
+		seq_printf(s, "%5u  (other sites)\n", copy->tag_overflow);
+
+	seq_puts(s, "\nlatency_us:");
+	for (i = 0; i < MAX17X0X_REGPROF_BUCKETS - 1; i++)
+		seq_printf(s, " <%u:%u", 16 << i, copy->hist[i]);
+	seq_printf(s, " >=%u:%u", 16 << (i - 1), copy->hist[i]);
+	seq_putc(s, '\n');
+
+	kfree(copy);
+	return 0;
+}
+
+static int debug_regprof_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, debug_regprof_show, inode->i_private);
+}
+
+/* any write resets the counters */
+static ssize_t debug_regprof_reset(struct file *filp,
+				   const char __user *user_buf,
+				   size_t count, loff_t *ppos)
+{
+	struct max17x0x_regprof *prof =
+		((struct seq_file *)filp->private_data)->private;
+
+	spin_lock(&prof->lock);
+	memset(prof->reg, 0, sizeof(prof->reg));
+	memset(prof->tag, 0, sizeof(prof->tag));
+	memset(prof->hist, 0, sizeof(prof->hist));
+	prof->tag_overflow = 0;
+	spin_unlock(&prof->lock);
+
+	return count;
+}
+
+static const struct file_operations debug_regprof_fops = {
+	.owner = THIS_MODULE,
+	.open = debug_regprof_open,
+	.read = seq_read,
+	.write = debug_regprof_reset,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int debug_drift_stats_show(struct seq_file *s, void *unused)
+{
+	const struct max1720x_drift_stats *st = s->private;
+
+	seq_printf(s, "snapshot: reads=%u errors=%u\n",
+		   st->snapshots, st->snapshot_errors);
+	seq_printf(s, "comp: checks=%u fixes=%u errors=%u\n",
+		   st->comp_checks, st->comp_fixes, st->comp_errors);
+	seq_printf(s, "dxacc: checks=%u in_range=%u aligned=%u fixes=%u errors=%u\n",
+		   st->dxacc_checks, st->dxacc_in_range, st->dxacc_aligned,
+		   st->dxacc_fixes, st->dxacc_errors);
+	return 0;
+}
+
+static int debug_drift_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, debug_drift_stats_show, inode->i_private);
+}
+
+/* any write resets the counters */
+static ssize_t debug_drift_stats_reset(struct file *filp,
+				       const char __user *user_buf,
+				       size_t count, loff_t *ppos)
+{
+	struct max1720x_drift_stats *st =
+		((struct seq_file *)filp->private_data)->private;
+
+	memset(st, 0, sizeof(*st));
+	return count;
+}
+
+static const struct file_operations debug_drift_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = debug_drift_stats_open,
+	.read = seq_read,
+	.write = debug_drift_stats_reset,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static ssize_t max1720x_show_custom_model(struct file *filp, char __user *buf,
 					  size_t count, loff_t *ppos)
 {
@@ -3680,6 +4059,8 @@ static ssize_t max1720x_show_debug_data(struct file *filp, char __user *buf,
 	u16 data;
 	int ret;
 
+	/* always from the device */
+	max17x0x_regcache_drop(chip->regmap.regcache, chip->debug_reg_address, 1);
 	ret = REGMAP_READ(&chip->regmap, chip->debug_reg_address, &data);
 	if (ret < 0)
 		return ret;
@@ -3861,6 +4242,7 @@ static int max17x0x_init_sysfs(struct max1720x_chip *chip)
 	debugfs_create_file("nvram_por", 0440, de, chip, &debug_nvram_por_fops);
 	debugfs_create_file("fg_reset", 0400, de, chip, &debug_fg_reset_fops);
 	debugfs_create_file("ce_start", 0400, de, chip, &debug_ce_start_fops);
+	debugfs_create_file("ce_partial", 0400, de, chip, &debug_ce_partial_fops);
 	debugfs_create_file("fake_battery", 0400, de, chip, &debug_fake_battery_fops);
 	debugfs_create_file("batt_id", 0600, de, chip, &debug_batt_id_fops);
 	debugfs_create_file("force_psy_update", 0600, de, chip, &debug_force_psy_update_fops);
@@ -3875,15 +4257,46 @@ static int max17x0x_init_sysfs(struct max1720x_chip *chip)
 					chip->regmap_nvram.reglog,
 					&debug_reglog_writes_fops);
 
+	if (chip->regmap.regprof)
+		debugfs_create_file("regmap_prof", 0640, de,
+				    chip->regmap.regprof,
+				    &debug_regprof_fops);
+
+	if (chip->regmap_nvram.regprof)
+		debugfs_create_file("regmap_nvram_prof", 0640, de,
+				    chip->regmap_nvram.regprof,
+				    &debug_regprof_fops);
+
+	if (chip->regmap.regcache) {
+		debugfs_create_u32("regcache_hits", 0444, de,
+				   &chip->regmap.regcache->hits);
+		debugfs_create_u32("regcache_misses", 0444, de,
+				   &chip->regmap.regcache->misses);
+	}
+
 	if (chip->gauge_type == MAX_M5_GAUGE_TYPE)
 		debugfs_create_file("fg_model", 0444, de, chip,
 				    &debug_m5_custom_model_fops);
 	debugfs_create_bool("model_ok", 0444, de, &chip->model_ok);
+	debugfs_create_u32("model_load_count", 0444, de,
+			   &chip->model_load_stats.count);
+	debugfs_create_u32("model_load_failures", 0444, de,
+			   &chip->model_load_stats.failures);
+	debugfs_create_u32("model_load_dnr_polls", 0444, de,
+			   &chip->model_load_stats.dnr_polls);
+	debugfs_create_u32("model_load_ldmdl_polls", 0444, de,
+			   &chip->model_load_stats.ldmdl_polls);
+	debugfs_create_u32("model_load_last_ms", 0444, de,
+			   &chip->model_load_stats.last_ms);
+	debugfs_create_u32("model_load_max_ms", 0444, de,
+			   &chip->model_load_stats.max_ms);
 	debugfs_create_file("sync_model", 0400, de, chip,
 			    &debug_sync_model_fops);
 
 	/* capacity drift fixup, one of MAX1720X_DA_VER_* */
 	debugfs_create_u32("algo_ver", 0644, de, &chip->drift_data.algo_ver);
+	debugfs_create_file("drift_stats", 0640, de, &chip->drift_data.stats,
+			    &debug_drift_stats_fops);
 
 	/* new debug interface */
 	debugfs_create_u32("address", 0600, de, &chip->debug_reg_address);
@@ -4137,10 +4550,77 @@ static int max1720x_set_next_update(struct max1720x_chip *chip)
 	return 0;
 }
 
+static void max1720x_model_load_poll(struct max1720x_chip *chip)
+{
+	chip->model_load_polls += 1;
+	mod_delayed_work(system_wq, &chip->model_work,
+			 msecs_to_jiffies(MAX_M5_MODEL_LOAD_POLL_MS));
+}
+
+static void max1720x_model_load_end(struct max1720x_chip *chip, int ret)
+{
+	struct max1720x_model_load_stats *stats = &chip->model_load_stats;
+	const s64 elap = ktime_ms_delta(ktime_get(), chip->model_load_start);
+
+	/* the gauge recomputes learned registers from the new model */
+	max17x0x_regcache_invalidate(chip->regmap.regcache);
+	chip->model_load_state = MAX1720X_MODEL_LOAD_IDLE;
+
+	stats->count += 1;
+	if (ret < 0)
+		stats->failures += 1;
+	stats->last_ms = elap;
+	if (elap > stats->max_ms)
+		stats->max_ms = elap;
+}
+
+/*
+ * Load the model without sleeping in the work: wait for FSTAT.DNR to clear,
+ * start the load and wait for CONFIG2.LDMDL to clear rescheduling model_work
+ * every MAX_M5_MODEL_LOAD_POLL_MS. Return -EINPROGRESS while waiting.
+ * NOTE: call holding model_lock
+ */
 static int max1720x_model_load(struct max1720x_chip *chip)
 {
 	int ret;
 
+	switch (chip->model_load_state) {
+	case MAX1720X_MODEL_LOAD_WAIT_DNR: {
+		const bool ready = max_m5_model_data_ready(chip->model_data);
+
+		chip->model_load_stats.dnr_polls += 1;
+		if (!ready && chip->model_load_polls < MAX_M5_MODEL_LOAD_POLL_MAX) {
+			max1720x_model_load_poll(chip);
+			return -EINPROGRESS;
+		}
+
+		/* load even when DNR does not clear */
+		if (ready)
+			dev_info(chip->dev, "data ready after %d polls\n",
+				 chip->model_load_polls);
+		else
+			dev_warn(chip->dev, "data not ready after %d polls, loading anyway\n",
+				 chip->model_load_polls);
+		goto start_load;
+	}
+	case MAX1720X_MODEL_LOAD_LOADING:
+		chip->model_load_stats.ldmdl_polls += 1;
+		ret = max_m5_load_gauge_model_done(chip->model_data);
+		if (ret == -EINPROGRESS) {
+			if (chip->model_load_polls < MAX_M5_MODEL_LOAD_POLL_MAX) {
+				max1720x_model_load_poll(chip);
+				return -EINPROGRESS;
+			}
+
+			ret = -ETIMEDOUT;
+		}
+
+		max1720x_model_load_end(chip, ret);
+		goto load_done;
+	default:
+		break;
+	}
+
 	/* retrieve model state from permanent storage only on boot */
 	if (!chip->model_state_valid) {
 
@@ -4158,8 +4638,27 @@ static int max1720x_model_load(struct max1720x_chip *chip)
 		/* use the state from the DT when GMSR is invalid */
 	}
 
+	chip->model_load_start = ktime_get();
+	chip->model_load_state = MAX1720X_MODEL_LOAD_WAIT_DNR;
+	chip->model_load_polls = 0;
+	if (!max_m5_model_data_ready(chip->model_data)) {
+		max1720x_model_load_poll(chip);
+		return -EINPROGRESS;
+	}
+
+start_load:
+	ret = max_m5_load_gauge_model_start(chip->model_data);
+	if (ret < 0) {
+		max1720x_model_load_end(chip, ret);
+	} else {
+		chip->model_load_state = MAX1720X_MODEL_LOAD_LOADING;
+		chip->model_load_polls = 0;
+		max1720x_model_load_poll(chip);
+		return -EINPROGRESS;
+	}
+
+load_done:
 	/* failure on the gauge: retry as long as model_reload > IDLE */
-	ret = max_m5_load_gauge_model(chip->model_data);
 	if (ret < 0) {
 		dev_err(chip->dev, "Load Model Failed ret=%d\n", ret);
 		return -EAGAIN;
@@ -4195,7 +4694,10 @@ static void max1720x_model_work(struct work_struct *work)
 	if (chip->model_reload >= MAX_M5_LOAD_MODEL_REQUEST) {
 
 		rc = max1720x_model_load(chip);
-		if (rc == 0) {
+		if (rc == -EINPROGRESS) {
+			mutex_unlock(&chip->model_lock);
+			return;
+		} else if (rc == 0) {
 			rc = max1720x_clear_por(chip);
 
 			dev_info(chip->dev, "Model OK, Clear Power-On Reset (%d)\n",
@@ -4221,8 +4723,12 @@ static void max1720x_model_work(struct work_struct *work)
 	}
 
 	/* b/171741751, fix capacity drift (if POR is cleared) */
-	if (max1720x_check_drift_enabled(&chip->drift_data))
-		max1720x_fixup_capacity(chip, chip->cap_estimate.cable_in);
+	if (max1720x_check_drift_enabled(&chip->drift_data)) {
+		struct max1720x_drift_snapshot snap;
+
+		max1720x_fixup_capacity(chip, chip->cap_estimate.cable_in,
+					&snap);
+	}
 
 	/* save state only when model is running */
 	if (chip->model_ok) {
@@ -5607,6 +6113,9 @@ static int max1720x_probe(struct i2c_client *client,
 	dev_warn(chip->dev, "device gauge_type: %d shadow_override=%d\n",
 		 chip->gauge_type, chip->shadow_override);
 
+	max17x0x_regprof_init(chip);
+	max17x0x_regcache_init(chip);
+
 	if (of_property_read_bool(dev->of_node, "maxim,log_writes")) {
 		bool debug_reglog;
 
@@ -21,6 +21,10 @@
 #include <linux/device.h>
 #include <linux/regmap.h>
 #include <linux/math64.h>
+#include <linux/bitmap.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
 
 #define MAX1720X_GAUGE_TYPE	0
 #define MAX1730X_GAUGE_TYPE	1
@@ -128,6 +132,74 @@ struct max17x0x_reglog {
 	int count[NB_REGMAP_MAX];
 };
 
+/*
+ * Access profile: per register and per call site counters, time on the bus
+ * and a log2 latency histogram. A call site is a static max17x0x_regsite
+ * created where REGMAP_READ/WRITE is expanded.
+ */
+#define MAX17X0X_REGPROF_TAGS		128
+#define MAX17X0X_REGPROF_BUCKETS	10	/* <16us, <32us .. >=4ms */
+
+struct max17x0x_regprof_reg {
+	u32 reads;
+	u32 writes;
+	u32 errors;
+	u64 time_ns;
+};
+
+struct max17x0x_regsite {
+	const char *func;
+	int line;
+	const char *name;	/* register or operation */
+};
+
+#define MAX17X0X_REGSITE_NAMED(str) ({					\
+	static const struct max17x0x_regsite __regsite = {		\
+		.func = __func__, .line = __LINE__, .name = str,	\
+	};								\
+	&__regsite;							\
+})
+
+#define MAX17X0X_REGSITE(what) MAX17X0X_REGSITE_NAMED(#what)
+
+struct max17x0x_regprof_tag {
+	const struct max17x0x_regsite *site;
+	u32 count;
+	u64 time_ns;
+};
+
+struct max17x0x_regprof {
+	spinlock_t lock;
+	struct max17x0x_regprof_reg reg[NB_REGMAP_MAX];
+	struct max17x0x_regprof_tag tag[MAX17X0X_REGPROF_TAGS];
+	u32 tag_overflow;
+	u32 hist[MAX17X0X_REGPROF_BUCKETS];
+};
+
+/*
+ * Register cache in front of REGMAP_READ/REGMAP_WRITE. STATIC registers are
+ * only changed by the host, SLOW registers are learned by the gauge and are
+ * re-read after ttl. Everything else is VOLATILE and always read from the
+ * device. The cache is dropped on POR, model load and fg reset.
+ */
+enum max17x0x_reg_policy {
+	MAX17X0X_REG_VOLATILE = 0,
+	MAX17X0X_REG_STATIC,
+	MAX17X0X_REG_SLOW,
+};
+
+struct max17x0x_regcache {
+	spinlock_t lock;
+	u8 policy[NB_REGMAP_MAX];
+	u16 data[NB_REGMAP_MAX];
+	unsigned long read_at[NB_REGMAP_MAX];
+	u32 gen[NB_REGMAP_MAX];		/* bumped on put and drop */
+	DECLARE_BITMAP(valid, NB_REGMAP_MAX);
+	unsigned long ttl;		/* jiffies, SLOW registers */
+	u32 hits;
+	u32 misses;
+};
+
 struct max17x0x_regtags {
 	const struct max17x0x_reg *map;
 	unsigned int max;
@@ -137,6 +209,8 @@ struct max17x0x_regmap {
 	struct regmap *regmap;
 	struct max17x0x_regtags regtags;
 	struct max17x0x_reglog *reglog;
+	struct max17x0x_regprof *regprof;
+	struct max17x0x_regcache *regcache;
 };
 
 int max1720x_get_capacity(struct i2c_client *client, int *iic_raw);
@@ -169,36 +243,142 @@ static inline void max17x0x_reglog_log(struct max17x0x_reglog *reglog,
 }
 #endif
 
+void max17x0x_regprof_log(struct max17x0x_regprof *prof, unsigned int reg,
+			  bool write, int rtn, u64 start_ns,
+			  const struct max17x0x_regsite *site);
+
+/*
+ * true when *val has a valid cached value for reg. On a miss *gen is the
+ * generation to pass to max17x0x_regcache_fill() after reading the device.
+ */
+static inline bool max17x0x_regcache_get(struct max17x0x_regcache *cache,
+					 unsigned int reg, u16 *val, u32 *gen)
+{
+	bool hit = false;
+
+	*gen = 0;
+	if (!cache || reg >= NB_REGMAP_MAX ||
+	    cache->policy[reg] == MAX17X0X_REG_VOLATILE)
+		return false;
+
+	spin_lock(&cache->lock);
+	*gen = cache->gen[reg];
+	if (test_bit(reg, cache->valid) &&
+	    (cache->policy[reg] == MAX17X0X_REG_STATIC ||
+	     time_before(jiffies, cache->read_at[reg] + cache->ttl))) {
+		*val = cache->data[reg];
+		hit = true;
+		cache->hits++;
+	} else {
+		cache->misses++;
+	}
+	spin_unlock(&cache->lock);
+
+	return hit;
+}
+
+static inline void max17x0x_regcache_put(struct max17x0x_regcache *cache,
+					 unsigned int reg, u16 val)
+{
+	if (!cache || reg >= NB_REGMAP_MAX ||
+	    cache->policy[reg] == MAX17X0X_REG_VOLATILE)
+		return;
+
+	spin_lock(&cache->lock);
+	cache->data[reg] = val;
+	cache->read_at[reg] = jiffies;
+	cache->gen[reg]++;
+	__set_bit(reg, cache->valid);
+	spin_unlock(&cache->lock);
+}
+
+/*
+ * Cache a value read from the device. Skipped when the register was written
+ * or dropped since max17x0x_regcache_get() returned gen: the value read might
+ * be older than what is in the cache (or in the device) now.
+ */
+static inline void max17x0x_regcache_fill(struct max17x0x_regcache *cache,
+					  unsigned int reg, u16 val, u32 gen)
+{
+	if (!cache || reg >= NB_REGMAP_MAX ||
+	    cache->policy[reg] == MAX17X0X_REG_VOLATILE)
+		return;
+
+	spin_lock(&cache->lock);
+	if (cache->gen[reg] == gen) {
+		cache->data[reg] = val;
+		cache->read_at[reg] = jiffies;
+		cache->gen[reg]++;
+		__set_bit(reg, cache->valid);
+	}
+	spin_unlock(&cache->lock);
+}
+
+/* drop count registers starting at reg, call when writing around the cache */
+static inline void max17x0x_regcache_drop(struct max17x0x_regcache *cache,
+					  unsigned int reg, unsigned int count)
+{
+	unsigned int i;
+
+	if (!cache || reg >= NB_REGMAP_MAX)
+		return;
+	if (count > NB_REGMAP_MAX - reg)
+		count = NB_REGMAP_MAX - reg;
+
+	spin_lock(&cache->lock);
+	bitmap_clear(cache->valid, reg, count);
+	for (i = 0; i < count; i++)
+		cache->gen[reg + i]++;
+	spin_unlock(&cache->lock);
+}
+
+static inline void max17x0x_regcache_invalidate(struct max17x0x_regcache *cache)
+{
+	max17x0x_regcache_drop(cache, 0, NB_REGMAP_MAX);
+}
+
 static inline int max17x0x_regmap_read(const struct max17x0x_regmap *map,
 				       unsigned int reg,
 				       u16 *val,
-				       const char *name)
+				       const struct max17x0x_regsite *site)
 {
-	int rtn;
+	const char *name = site->name;
 	unsigned int tmp;
+	u64 start_ns;
+	u32 gen;
+	int rtn;
 
 	if (!map->regmap) {
 		pr_err("Failed to read %s, no regmap\n", name);
 		return -EIO;
 	}
 
+	if (max17x0x_regcache_get(map->regcache, reg, val, &gen))
+		return 0;
+
+	start_ns = ktime_get_ns();
 	rtn = regmap_read(map->regmap, reg, &tmp);
-	if (rtn)
+	max17x0x_regprof_log(map->regprof, reg, false, rtn, start_ns, site);
+	if (rtn) {
 		pr_err("Failed to read %s\n", name);
-	else
+	} else {
 		*val = tmp;
+		max17x0x_regcache_fill(map->regcache, reg, tmp, gen);
+	}
 
 	return rtn;
 }
 
 #define REGMAP_READ(regmap, what, dst) \
-	max17x0x_regmap_read(regmap, what, dst, #what)
+	max17x0x_regmap_read(regmap, what, dst, MAX17X0X_REGSITE(what))
 
 static inline int max17x0x_regmap_write(const struct max17x0x_regmap *map,
 				       unsigned int reg,
 				       u16 data,
-				       const char *name)
+				       const struct max17x0x_regsite *site)
 {
+	const char *name = site->name;
+	u64 start_ns;
 	int rtn;
 
 	if (!map->regmap) {
@@ -206,9 +386,15 @@ static inline int max17x0x_regmap_write(const struct max17x0x_regmap *map,
 		return -EIO;
 	}
 
+	start_ns = ktime_get_ns();
 	rtn = regmap_write(map->regmap, reg, data);
-	if (rtn)
+	max17x0x_regprof_log(map->regprof, reg, true, rtn, start_ns, site);
+	if (rtn) {
 		pr_err("Failed to write %s\n", name);
+		max17x0x_regcache_drop(map->regcache, reg, 1);
+	} else {
+		max17x0x_regcache_put(map->regcache, reg, data);
+	}
 
 	max17x0x_reglog_log(map->reglog, reg, data, rtn);
 
@@ -216,14 +402,15 @@ static inline int max17x0x_regmap_write(const struct max17x0x_regmap *map,
 }
 
 #define REGMAP_WRITE(regmap, what, value) \
-	max17x0x_regmap_write(regmap, what, value, #what)
+	max17x0x_regmap_write(regmap, what, value, MAX17X0X_REGSITE(what))
 
 #define WAIT_VERIFY	(10 * USEC_PER_MSEC) /* 10 msec */
 static inline int max1720x_regmap_writeverify(const struct max17x0x_regmap *map,
 					unsigned int reg,
 					u16 data,
-					const char *name)
+					const struct max17x0x_regsite *site)
 {
+	const char *name = site->name;
 	int tmp, ret, retries;
 
 	if (!map->regmap) {
@@ -232,25 +419,35 @@ static inline int max1720x_regmap_writeverify(const struct max17x0x_regmap *map,
 	}
 
 	for (retries = 3; retries > 0; retries--) {
+		u64 start_ns = ktime_get_ns();
+
 		ret = regmap_write(map->regmap, reg, data);
+		max17x0x_regprof_log(map->regprof, reg, true, ret, start_ns,
+				     site);
 		if (ret < 0)
 			continue;
 
 		usleep_range(WAIT_VERIFY, WAIT_VERIFY + 100);
 
+		start_ns = ktime_get_ns();
 		ret = regmap_read(map->regmap, reg, &tmp);
+		max17x0x_regprof_log(map->regprof, reg, false, ret, start_ns,
+				     site);
 		if (ret < 0)
 			continue;
 
-		if (tmp == data)
+		if (tmp == data) {
+			max17x0x_regcache_put(map->regcache, reg, data);
 			return 0;
+		}
 	}
 
+	max17x0x_regcache_drop(map->regcache, reg, 1);
 	return -EIO;
 }
 
 #define REGMAP_WRITE_VERIFY(regmap, what, value) \
-	max1720x_regmap_writeverify(regmap, what, value, #what)
+	max1720x_regmap_writeverify(regmap, what, value, MAX17X0X_REGSITE(what))
 
 enum max1720x_drift_algo_version {
 	MAX1720X_DA_VER_NONE = -1,	/* MW RC2 */
@@ -266,6 +463,44 @@ enum max1720x_drift_algo_version {
 #define max1720x_check_drift_delay(dd) \
 		((dd)->algo_ver == MAX1720X_DA_VER_MWA1 ? 351 : 0)
 
+/*
+ * Registers sampled once per DSOCI (or per model_work pass). The drift
+ * fixups evaluate from here and the monitor log reuses it, corrections
+ * written by the fixups are reflected back into the snapshot.
+ */
+struct max1720x_drift_snapshot {
+	bool valid;
+	u16 repcap;		/* 0x05, with repsoc */
+	u16 repsoc;
+	u16 qresidual;
+	u16 fullcap;
+	u16 avcap;
+	u16 fullcapnom;
+	u16 fullcaprep;
+	u16 rcomp0;		/* 0x38, with tempco */
+	u16 tempco;
+	u16 fstat;
+	u16 dqacc;		/* 0x45, with dpacc */
+	u16 dpacc;
+	u16 qh0;		/* 0x4C, with qh */
+	u16 qh;
+	u16 vfsoc;
+};
+
+/* per rule counters, reported in drift_stats */
+struct max1720x_drift_stats {
+	u32 snapshots;
+	u32 snapshot_errors;
+	u32 comp_checks;
+	u32 comp_fixes;
+	u32 comp_errors;
+	u32 dxacc_checks;
+	u32 dxacc_in_range;	/* FullCapNom within the fade model */
+	u32 dxacc_aligned;	/* dQAcc/dPAcc already at target */
+	u32 dxacc_fixes;
+	u32 dxacc_errors;
+};
+
 /* fix to capacity estimation */
 struct max1720x_drift_data {
 	u16 rsense;
@@ -278,6 +513,8 @@ struct max1720x_drift_data {
 	int ini_rcomp0;
 	int ini_tempco;
 	int ini_filtercfg;
+
+	struct max1720x_drift_stats stats;
 };
 
 struct max1720x_dyn_filtercfg {
@@ -289,11 +526,16 @@ struct max1720x_dyn_filtercfg {
 	struct mutex lock;
 };
 
+extern int max1720x_drift_snapshot_read(struct max1720x_drift_data *ddata,
+					struct max17x0x_regmap *map,
+					struct max1720x_drift_snapshot *snap);
 extern int max1720x_fixup_comp(struct max1720x_drift_data *ddata,
 			       struct max17x0x_regmap *map,
+			       struct max1720x_drift_snapshot *snap,
 			       int plugged);
 extern int max1720x_fixup_dxacc(struct max1720x_drift_data *ddata,
 				struct max17x0x_regmap *map,
+				struct max1720x_drift_snapshot *snap,
 				int cycle_count,
 				int plugged,
 				int lsb);
@@ -9,6 +9,7 @@
 #include <linux/i2c.h>
 #include <linux/pm_runtime.h>
 #include <linux/regmap.h>
+#include <linux/stddef.h>
 #include <linux/time.h>
 #include "gbms_power_supply.h"
 #include "google_bms.h"
@@ -29,16 +30,80 @@
 enum {
 	MAX17X0X_REPCAP		= 0x05,
 	MAX17X0X_REPSOC		= 0x06,
+	MAX17X0X_QRESIDUAL	= 0x0C,
 	MAX17X0X_MIXCAP 	= 0x0F,
+	MAX17X0X_FULLCAP	= 0x10,
+	MAX17X0X_AVCAP		= 0x1F,
 	MAX17X0X_FULLCAPNOM	= 0x23,
 	MAX17X0X_FULLCAPREP	= 0x35,
 	MAX17X0X_RCOMP0		= 0x38,	/* 16 bits in MW A1+ */
 	MAX17X0X_TEMPCO		= 0x39,
+	MAX17X0X_FSTAT		= 0x3D,
 	MAX17X0X_DQACC		= 0x45,
 	MAX17X0X_DPACC		= 0x46,
+	MAX17X0X_QH0		= 0x4C,
+	MAX17X0X_QH		= 0x4D,
 	MAX17X0X_VFSOC		= 0xFF,
 };
 
+/* contiguous registers are read in one transfer into adjacent fields */
+struct max1720x_drift_run {
+	u8 reg;
+	u8 count;
+	size_t offset;
+};
+
+#define DRIFT_RUN(r, n, field) \
+	{ r, n, offsetof(struct max1720x_drift_snapshot, field) }
+
+static const struct max1720x_drift_run max1720x_drift_runs[] = {
+	DRIFT_RUN(MAX17X0X_REPCAP, 2, repcap),
+	DRIFT_RUN(MAX17X0X_QRESIDUAL, 1, qresidual),
+	DRIFT_RUN(MAX17X0X_FULLCAP, 1, fullcap),
+	DRIFT_RUN(MAX17X0X_AVCAP, 1, avcap),
+	DRIFT_RUN(MAX17X0X_FULLCAPNOM, 1, fullcapnom),
+	DRIFT_RUN(MAX17X0X_FULLCAPREP, 1, fullcaprep),
+	DRIFT_RUN(MAX17X0X_RCOMP0, 2, rcomp0),
+	DRIFT_RUN(MAX17X0X_FSTAT, 1, fstat),
+	DRIFT_RUN(MAX17X0X_DQACC, 2, dqacc),
+	DRIFT_RUN(MAX17X0X_QH0, 2, qh0),
+	DRIFT_RUN(MAX17X0X_VFSOC, 1, vfsoc),
+};
+
+/* 0 on success, snap->valid is false on error */
+int max1720x_drift_snapshot_read(struct max1720x_drift_data *ddata,
+				 struct max17x0x_regmap *map,
+				 struct max1720x_drift_snapshot *snap)
+{
+	int i, err = 0;
+
+	snap->valid = false;
+	if (!map->regmap)
+		return -EIO;
+
+	for (i = 0; i < ARRAY_SIZE(max1720x_drift_runs); i++) {
+		const struct max1720x_drift_run *run = &max1720x_drift_runs[i];
+		const u64 start_ns = ktime_get_ns();
+
+		err = regmap_raw_read(map->regmap, run->reg,
+				      (u8 *)snap + run->offset,
+				      run->count * sizeof(u16));
+		max17x0x_regprof_log(map->regprof, run->reg, false, err,
+				     start_ns, MAX17X0X_REGSITE_NAMED("snapshot"));
+		if (err < 0)
+			break;
+	}
+
+	if (err < 0) {
+		ddata->stats.snapshot_errors += 1;
+		return -EIO;
+	}
+
+	ddata->stats.snapshots += 1;
+	snap->valid = true;
+	return 0;
+}
+
 /* 1 = success, 0 compare error, < 0 error */
 static int max1720x_update_compare(struct max17x0x_regmap *map, int reg,
 				   u16 data0, u16 data1)
@@ -47,6 +112,7 @@ static int max1720x_update_compare(struct max17x0x_regmap *map, int reg,
 	int ret;
 
 	ret = regmap_raw_write(map->regmap, reg, data, sizeof(data));
+	max17x0x_regcache_drop(map->regcache, reg, ARRAY_SIZE(data));
 	if (ret < 0)
 		return -EIO;
 
@@ -64,27 +130,33 @@ static int max1720x_update_capacity(struct max17x0x_regmap *map,
 				    u16 mixcap, u16 repcap,
 				    u16 fullcaprep)
 {
-	u16 temp;
-	int err;
-
-	err = REGMAP_WRITE(map, MAX17X0X_MIXCAP, mixcap);
-	if (err == 0)
-		err = REGMAP_READ(map, MAX17X0X_MIXCAP, &temp);
-	if (err < 0 || temp != mixcap)
-		return 0;
-
 	/* RepCap and FullCapRep must be updated together */
-	err = REGMAP_WRITE(map, MAX17X0X_REPCAP, repcap);
-	if (err == 0)
-		err = REGMAP_READ(map, MAX17X0X_REPCAP, &temp);
-	if (err < 0 || temp != repcap)
+	const struct reg_sequence seq[] = {
+		{ MAX17X0X_MIXCAP, mixcap },
+		{ MAX17X0X_REPCAP, repcap },
+		{ MAX17X0X_FULLCAPREP, fullcaprep },
+	};
+	u64 start_ns;
+	u16 temp;
+	int i, err;
+
+	start_ns = ktime_get_ns();
+	err = regmap_multi_reg_write(map->regmap, seq, ARRAY_SIZE(seq));
+	max17x0x_regprof_log(map->regprof, MAX17X0X_MIXCAP, true, err,
+			     start_ns, MAX17X0X_REGSITE_NAMED("multi"));
+	for (i = 0; i < ARRAY_SIZE(seq); i++) {
+		max17x0x_regcache_drop(map->regcache, seq[i].reg, 1);
+		max17x0x_reglog_log(map->reglog, seq[i].reg, seq[i].def, err);
+	}
+	if (err < 0)
 		return 0;
 
-	err = REGMAP_WRITE(map, MAX17X0X_FULLCAPREP, fullcaprep);
-	if (err == 0)
-		err = REGMAP_READ(map, MAX17X0X_FULLCAPREP, &temp);
-	if (err < 0 || temp != fullcaprep)
-		return 0;
+	for (i = 0; i < ARRAY_SIZE(seq); i++) {
+		err = max17x0x_regmap_read(map, seq[i].reg, &temp,
+					   MAX17X0X_REGSITE_NAMED("verify"));
+		if (err < 0 || temp != seq[i].def)
+			return 0;
+	}
 
 	return 1;
 }
@@ -140,28 +212,33 @@ static int max1720x_capacity_check(int fullcapnom, int cycle_count,
 
 int max1720x_fixup_dxacc(struct max1720x_drift_data *ddata,
 			 struct max17x0x_regmap *map,
+			 struct max1720x_drift_snapshot *snap,
 			 int cycle_count,
 			 int plugged,
 			 int lsb)
 {
-	u16 temp, vfsoc = 0, repsoc = 0, fullcapnom, mixcap, repcap, fcrep;
+	const u16 fullcapnom = snap->fullcapnom;
+	const u16 vfsoc = snap->vfsoc, repsoc = snap->repsoc;
+	u16 mixcap, repcap, fcrep;
 	int capacity, new_capacity;
 	int dpacc, dqacc;
 	int err, loops;
 
 	if (ddata->design_capacity <= 0 || ALGO_VER_CHECK(ddata->algo_ver))
 		return 0;
+	if (!snap->valid)
+		return -EINVAL;
 
-	err = REGMAP_READ(map, MAX17X0X_FULLCAPNOM, &fullcapnom);
-	if (err < 0)
-		return err;
+	ddata->stats.dxacc_checks += 1;
 
 	capacity = reg_to_micro_amp_h(fullcapnom, ddata->rsense, lsb) / 1000;
 
 	/* return the expected FCN, done if the same of th eold one */
 	new_capacity = max1720x_capacity_check(capacity, cycle_count, ddata);
-	if (new_capacity == capacity)
+	if (new_capacity == capacity) {
+		ddata->stats.dxacc_in_range += 1;
 		return 0;
+	}
 
 	/* You can use a ratio of dPAcc = 0x190 ( = 25%) with dQACC with 64 mAh
 	 * LSB. Can make dPACC larger (ex 0xC80, 200%) and give dQAcc a smaller
@@ -175,27 +252,14 @@ int max1720x_fixup_dxacc(struct max1720x_drift_data *ddata,
 	dpacc = 0xc80;
 
 	/* will not update if dqacc/dpacc is already in line */
-	err = REGMAP_READ(map, MAX17X0X_DQACC, &temp);
-	if (err == 0 && temp == dqacc) {
-		err = REGMAP_READ(map, MAX17X0X_DPACC, &temp);
-		if (err == 0 && temp == dpacc) {
-			pr_debug("Fix capacity: same dqacc=0x%x dpacc=0x%x\n",
-				 dqacc, dpacc);
-			return 0;
-		}
-	}
-
-	/* fast convergence, avoid ghost drain */
-	err = REGMAP_READ(map, MAX17X0X_VFSOC, &vfsoc);
-	if (err == 0)
-		err = REGMAP_READ(map, MAX17X0X_REPSOC, &repsoc);
-	if (err < 0) {
-		pr_warn("Fix capacity: fcn=%d new=%d vfsoc=0x%x repsoc=0x%x (%d)\n",
-			fullcapnom, new_capacity, vfsoc, repsoc, err);
-		return err;
+	if (snap->dqacc == dqacc && snap->dpacc == dpacc) {
+		pr_debug("Fix capacity: same dqacc=0x%x dpacc=0x%x\n",
+			 dqacc, dpacc);
+		ddata->stats.dxacc_aligned += 1;
+		return 0;
 	}
 
-	/* vfsoc/repsoc perc, lsb = 1/256 */
+	/* fast convergence, avoid ghost drain. vfsoc/repsoc perc, lsb = 1/256 */
 	mixcap = (((u32)vfsoc) * fcrep) / 25600;
 	repcap = (((u32)repsoc) * fcrep) / 25600;
 
@@ -209,6 +273,10 @@ int max1720x_fixup_dxacc(struct max1720x_drift_data *ddata,
 	}
 
 	pr_info("Fix capacity: fixing caps retries=%d (%d)\n", loops, err);
+	if (err > 0) {
+		snap->repcap = repcap;
+		snap->fullcaprep = fcrep;
+	}
 
 	/* 3 loops suggested from vendor */
 	for (loops = 0; loops < 3; loops++) {
@@ -226,7 +294,18 @@ int max1720x_fixup_dxacc(struct max1720x_drift_data *ddata,
 
 	/* TODO:  b/144630261 fix Google Capacity */
 
-	return (loops == 3) ? -ETIMEDOUT : err;
+	if (loops == 3)
+		err = -ETIMEDOUT;
+
+	if (err > 0) {
+		snap->dqacc = dqacc;
+		snap->dpacc = dpacc;
+		ddata->stats.dxacc_fixes += 1;
+	} else if (err < 0) {
+		ddata->stats.dxacc_errors += 1;
+	}
+
+	return err;
 }
 
 /* Tempco and rcomp0 must remain within the following limits to avoid capacity
@@ -340,19 +419,20 @@ static bool max1720x_comp_check(u16 *new_rcomp0, u16 *new_tempco,
 /* fix rcomp0 and tempco */
 int max1720x_fixup_comp(struct max1720x_drift_data *ddata,
 			struct max17x0x_regmap *map,
+			struct max1720x_drift_snapshot *snap,
 			int plugged)
 {
-	u16 new_rcomp0, new_tempco, data[2] = { 0 };
+	const u16 data[2] = { snap->rcomp0, snap->tempco };
+	u16 new_rcomp0, new_tempco;
 	int err, loops;
 
 	if (ddata->ini_rcomp0 == -1 || ddata->ini_tempco == -1 ||
 	    ALGO_VER_CHECK(ddata->algo_ver))
 		return 0;
+	if (!snap->valid)
+		return -EINVAL;
 
-	err = regmap_raw_read(map->regmap, MAX17X0X_RCOMP0, data,
-			      sizeof(data));
-	if (err < 0)
-		return -EIO;
+	ddata->stats.comp_checks += 1;
 
 	new_rcomp0 = data[0];
 	new_tempco = data[1];
@@ -377,5 +457,16 @@ int max1720x_fixup_comp(struct max1720x_drift_data *ddata,
 	pr_info("Fix rcomp0=0x%x->0x%x tempco:0x%x->0x%x, retries=%d, (%d)\n",
 		data[0], new_rcomp0, data[1], new_tempco, loops, err);
 
-	return (loops == 3) ? -ETIMEDOUT : err;
+	if (loops == 3)
+		err = -ETIMEDOUT;
+
+	if (err > 0) {
+		snap->rcomp0 = new_rcomp0;
+		snap->tempco = new_tempco;
+		ddata->stats.comp_fixes += 1;
+	} else if (err < 0) {
+		ddata->stats.comp_errors += 1;
+	}
+
+	return err;
 }
@@ -6,6 +6,7 @@
  */
 
 #include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/gpio.h>
 #include <linux/gpio/consumer.h>
@@ -16,6 +17,8 @@
 #include <linux/mutex.h>
 #include <linux/of_gpio.h>
 #include <linux/regmap.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
 
 #include <misc/logbuffer.h>
 #include "max77759_maxq.h"
@@ -73,20 +76,54 @@
 
 #define LOG_BUFFER_SIZE   256
 
+/* latency buckets are log2(ms): <1ms, <2ms, <4ms ... >=256ms */
+#define MAXQ_LATENCY_BUCKETS			10
+
+struct maxq_opcode_stats {
+	u32 count;
+	u32 errors;
+	u32 batched;
+	u32 max_ms;
+	u32 latency[MAXQ_LATENCY_BUCKETS];
+};
+
+static const u8 maxq_stats_opcodes[] = {
+	OPCODE_GPIO_TRIGGER_READ,
+	OPCODE_GPIO_TRIGGER_WRITE,
+	OPCODE_GPIO_CONTROL_READ,
+	OPCODE_GPIO_CONTROL_WRITE,
+	OPCODE_USER_SPACE_READ,
+	OPCODE_USER_SPACE_WRITE,
+	OPCODE_CHECK_CC_AND_SBU,
+};
+
 struct max77759_maxq {
 	struct completion reply_done;
-	/* Denotes the current request in progress. */
+	/* Last request number assigned in maxq_submit_request(). */
 	unsigned int req_no;
+	/* Denotes the current request in progress. */
+	unsigned int req_active;
 	/* Updated by the irq handler. */
 	unsigned int req_done;
-	/* Protects req_no and req_done variables. */
+	/* Protects req_active and req_done variables. */
 	struct mutex req_lock;
 	struct logbuffer *log;
 	bool init_done;
 	struct regmap *regmap;
 
-	/* To make sure that there is only one request in progress. */
-	struct mutex maxq_lock;
+	/*
+	 * Requests are queued and run one at a time from req_work, the
+	 * mailbox holds a single request. queue_lock protects queue, req_no,
+	 * stats and removing.
+	 */
+	struct mutex queue_lock;
+	struct list_head queue;
+	bool removing;
+	struct workqueue_struct *wq;
+	struct work_struct req_work;
+	struct maxq_opcode_stats stats[ARRAY_SIZE(maxq_stats_opcodes)];
+	struct dentry *de;
+
 	u8 request_opcode;
 	bool poll;
 };
@@ -182,20 +219,20 @@ exit:
 	return ret;
 }
 
-static int maxq_issue_opcode_command(struct max77759_maxq *maxq, u8 *request,
-				     u8 request_length, u8 *response,
-				     u8 response_length)
+/* Run one request on the mailbox, called only from req_work */
+static int maxq_execute_request(struct max77759_maxq *maxq,
+				unsigned int current_request,
+				const u8 *request, u8 request_length,
+				u8 *response, u8 response_length)
 {
-	unsigned int current_request;
 	int ret = -ENODEV;
 
 	if (!maxq->init_done)
 		return ret;
 
-	mutex_lock(&maxq->maxq_lock);
 	maxq->request_opcode = request[REQUEST_OPCODE];
 	mutex_lock(&maxq->req_lock);
-	current_request = ++maxq->req_no;
+	maxq->req_active = current_request;
 
 	logbuffer_log(maxq->log, "MAXQ REQ:current_req: %u opcode:%u",
 		      current_request, maxq->request_opcode);
@@ -219,10 +256,245 @@ static int maxq_issue_opcode_command(struct max77759_maxq *maxq, u8 *request,
 					    response, response_length);
 req_unlock:
 	mutex_unlock(&maxq->req_lock);
-	mutex_unlock(&maxq->maxq_lock);
 	return ret;
 }
 
+static bool maxq_is_user_space_read(const struct maxq_request *req)
+{
+	return req->request[ADDR_OPCODE] == OPCODE_USER_SPACE_READ &&
+	       req->request_len >= OPCODE_USER_SPACE_R_REQ_LEN;
+}
+
+/*
+ * Move to @batch the user space reads that follow @first in the queue and
+ * that can be served with a single read together with it. Stops at the
+ * first request that is not a read to keep the order with writes.
+ * Caller holds queue_lock.
+ */
+static void maxq_batch_reads_locked(struct max77759_maxq *maxq,
+				    struct maxq_request *first,
+				    struct list_head *batch)
+{
+	int lo = first->request[START_ADDR];
+	int hi = lo + first->request[DATA_LEN];
+	struct maxq_request *req, *tmp;
+
+	list_for_each_entry_safe(req, tmp, &maxq->queue, node) {
+		int start, end;
+
+		if (!maxq_is_user_space_read(req))
+			break;
+
+		start = req->request[START_ADDR];
+		end = start + req->request[DATA_LEN];
+		if (start > hi || end < lo)
+			break;
+		/* data must fit in the response after DATA_START */
+		if (max(hi, end) - min(lo, start) >
+		    OPCODE_USER_SPACE_R_RES_LEN - DATA_START)
+			break;
+
+		lo = min(lo, start);
+		hi = max(hi, end);
+		list_move_tail(&req->node, batch);
+	}
+}
+
+/* single read covering all the requests in @batch */
+static void maxq_run_read_batch(struct max77759_maxq *maxq,
+				struct list_head *batch)
+{
+	struct maxq_request *first, *req;
+	u8 request[OPCODE_USER_SPACE_R_REQ_LEN];
+	u8 response[OPCODE_USER_SPACE_R_RES_LEN];
+	int lo = OPCODE_USER_SPACE_MAX_ADDR + 1, hi = 0;
+	int ret;
+
+	list_for_each_entry(req, batch, node) {
+		lo = min_t(int, lo, req->request[START_ADDR]);
+		hi = max_t(int, hi, req->request[START_ADDR] +
+				    req->request[DATA_LEN]);
+	}
+
+	first = list_first_entry(batch, struct maxq_request, node);
+	request[ADDR_OPCODE] = OPCODE_USER_SPACE_READ;
+	request[START_ADDR] = lo;
+	request[DATA_LEN] = hi - lo;
+
+	logbuffer_log(maxq->log, "MAXQ batch read req:%u start:%#x length:%#x",
+		      first->req_no, lo, hi - lo);
+	ret = maxq_execute_request(maxq, first->req_no, request,
+				   OPCODE_USER_SPACE_R_REQ_LEN, response,
+				   OPCODE_USER_SPACE_R_RES_LEN);
+
+	list_for_each_entry(req, batch, node) {
+		const int offset = req->request[START_ADDR] - lo;
+		const int len = req->request[DATA_LEN];
+
+		req->ret = ret;
+		if (ret < 0)
+			continue;
+
+		/* same layout as a response to the original request */
+		memcpy(req->response, response,
+		       min_t(int, req->response_len, DATA_START));
+		if (req->response_len > DATA_START)
+			memcpy(&req->response[DATA_START],
+			       &response[DATA_START + offset],
+			       min_t(int, req->response_len - DATA_START, len));
+	}
+}
+
+static struct maxq_opcode_stats *maxq_opcode_stats(struct max77759_maxq *maxq,
+						   u8 opcode)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(maxq_stats_opcodes); i++)
+		if (maxq_stats_opcodes[i] == opcode)
+			return &maxq->stats[i];
+
+	return NULL;
+}
+
+/* Caller holds queue_lock */
+static void maxq_stats_update_locked(struct max77759_maxq *maxq,
+				     const struct maxq_request *req,
+				     bool batched)
+{
+	struct maxq_opcode_stats *stats;
+	s64 elap;
+	int bucket;
+
+	stats = maxq_opcode_stats(maxq, req->request[REQUEST_OPCODE]);
+	if (!stats)
+		return;
+
+	elap = ktime_ms_delta(ktime_get(), req->queued);
+	bucket = elap > 0 ? fls64(elap) : 0;
+	if (bucket >= MAXQ_LATENCY_BUCKETS)
+		bucket = MAXQ_LATENCY_BUCKETS - 1;
+
+	stats->count += 1;
+	if (req->ret < 0)
+		stats->errors += 1;
+	if (batched)
+		stats->batched += 1;
+	if (elap > stats->max_ms)
+		stats->max_ms = elap;
+	stats->latency[bucket] += 1;
+}
+
+static void maxq_req_work(struct work_struct *work)
+{
+	struct max77759_maxq *maxq =
+		container_of(work, struct max77759_maxq, req_work);
+	struct maxq_request *req, *tmp;
+	LIST_HEAD(batch);
+	bool batched;
+
+	while (true) {
+		mutex_lock(&maxq->queue_lock);
+		req = list_first_entry_or_null(&maxq->queue,
+					       struct maxq_request, node);
+		if (req) {
+			list_move_tail(&req->node, &batch);
+			if (maxq_is_user_space_read(req))
+				maxq_batch_reads_locked(maxq, req, &batch);
+		}
+		mutex_unlock(&maxq->queue_lock);
+
+		if (!req)
+			break;
+
+		batched = !list_is_singular(&batch);
+		if (batched)
+			maxq_run_read_batch(maxq, &batch);
+		else
+			req->ret = maxq_execute_request(maxq, req->req_no,
+							req->request,
+							req->request_len,
+							req->response,
+							req->response_len);
+
+		mutex_lock(&maxq->queue_lock);
+		list_for_each_entry(req, &batch, node)
+			maxq_stats_update_locked(maxq, req, batched);
+		mutex_unlock(&maxq->queue_lock);
+
+		/* the callback might free the request */
+		list_for_each_entry_safe(req, tmp, &batch, node) {
+			list_del_init(&req->node);
+			req->complete(req, req->data);
+		}
+	}
+}
+
+/*
+ * Queue a request, req->complete() is called from the MAXQ work with
+ * req->ret set once the response is in req->response. Returns the
+ * request number (also in req->req_no) or a negative errno.
+ */
+int maxq_submit_request(struct max77759_maxq *maxq, struct maxq_request *req)
+{
+	int ret;
+
+	if (!maxq->init_done)
+		return -ENODEV;
+	if (!req->complete || !req->request_len ||
+	    req->request_len > MAXQ_REQUEST_MAX_LEN)
+		return -EINVAL;
+
+	mutex_lock(&maxq->queue_lock);
+	if (maxq->removing) {
+		mutex_unlock(&maxq->queue_lock);
+		return -ENODEV;
+	}
+
+	req->req_no = ++maxq->req_no;
+	req->queued = ktime_get();
+	req->ret = -EINPROGRESS;
+	list_add_tail(&req->node, &maxq->queue);
+	ret = req->req_no;
+	mutex_unlock(&maxq->queue_lock);
+
+	queue_work(maxq->wq, &maxq->req_work);
+	return ret & INT_MAX;
+}
+EXPORT_SYMBOL_GPL(maxq_submit_request);
+
+static void maxq_request_wake(struct maxq_request *req, void *data)
+{
+	complete(data);
+}
+
+/* synchronous wrapper around maxq_submit_request() */
+static int maxq_issue_opcode_command(struct max77759_maxq *maxq, u8 *request,
+				     u8 request_length, u8 *response,
+				     u8 response_length)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct maxq_request req = {
+		.request_len = request_length,
+		.response = response,
+		.response_len = response_length,
+		.complete = maxq_request_wake,
+		.data = &done,
+	};
+	int ret;
+
+	if (request_length > MAXQ_REQUEST_MAX_LEN)
+		return -EINVAL;
+
+	memcpy(req.request, request, request_length);
+	ret = maxq_submit_request(maxq, &req);
+	if (ret < 0)
+		return ret;
+
+	wait_for_completion(&done);
+	return req.ret;
+}
+
 static void maxq_log_array(struct max77759_maxq *maxq, char *title,
 			   u8 *data, int length)
 {
@@ -320,7 +592,7 @@ static int maxq_rs_read(struct max77759_maxq *maxq, gbms_tag_t tag, u8 *data)
 	if (tag == GBMS_TAG_RSBM)
 		buff[RS_TAG_OFFSET_ADDR] = RSBM_ADDR;
 	else if (tag == GBMS_TAG_RSBR)
-		buff[RS_TAG_OFFSET_ADDR] = RSBM_ADDR;
+		buff[RS_TAG_OFFSET_ADDR] = RSBR_ADDR;
 	else
 		return -EINVAL;
 
@@ -416,7 +688,7 @@ static struct gbms_storage_desc maxq_storage_dsc = {
 void maxq_irq(struct max77759_maxq *maxq)
 {
 	mutex_lock(&maxq->req_lock);
-	maxq->req_done = maxq->req_no;
+	maxq->req_done = maxq->req_active;
 	logbuffer_log(maxq->log, "MAXQ IRQ: req_done: %u", maxq->req_done);
 	complete(&maxq->reply_done);
 	mutex_unlock(&maxq->req_lock);
@@ -570,6 +842,30 @@ int maxq_gpio_trigger_write(struct max77759_maxq *maxq, u8 gpio, bool trigger_fa
 }
 EXPORT_SYMBOL_GPL(maxq_gpio_trigger_write);
 
+static int maxq_stats_show(struct seq_file *s, void *data)
+{
+	struct max77759_maxq *maxq = s->private;
+	int i, j;
+
+	mutex_lock(&maxq->queue_lock);
+	seq_printf(s, "opcode count errors batched max_ms latency_log2_ms[%d]\n",
+		   MAXQ_LATENCY_BUCKETS);
+	for (i = 0; i < ARRAY_SIZE(maxq_stats_opcodes); i++) {
+		const struct maxq_opcode_stats *stats = &maxq->stats[i];
+
+		seq_printf(s, "%#04x %u %u %u %u", maxq_stats_opcodes[i],
+			   stats->count, stats->errors, stats->batched,
+			   stats->max_ms);
+		for (j = 0; j < MAXQ_LATENCY_BUCKETS; j++)
+			seq_printf(s, " %u", stats->latency[j]);
+		seq_putc(s, '\n');
+	}
+	mutex_unlock(&maxq->queue_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(maxq_stats);
+
 struct max77759_maxq *maxq_init(struct device *dev, struct regmap *regmap,
 				bool poll)
 {
@@ -588,10 +884,24 @@ struct max77759_maxq *maxq_init(struct device *dev, struct regmap *regmap,
 	maxq->regmap = regmap;
 
 	init_completion(&maxq->reply_done);
-	mutex_init(&maxq->maxq_lock);
 	mutex_init(&maxq->req_lock);
+	mutex_init(&maxq->queue_lock);
+	INIT_LIST_HEAD(&maxq->queue);
+	INIT_WORK(&maxq->req_work, maxq_req_work);
 	maxq->poll = poll;
 
+	maxq->wq = alloc_ordered_workqueue("maxq", 0);
+	if (!maxq->wq) {
+		if (maxq->log)
+			logbuffer_unregister(maxq->log);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	maxq->de = debugfs_create_dir("max77759_maxq", NULL);
+	if (!IS_ERR_OR_NULL(maxq->de))
+		debugfs_create_file("latency", 0400, maxq->de, maxq,
+				    &maxq_stats_fops);
+
 	ret = gbms_storage_register(&maxq_storage_dsc,
 				    "max77759_maxq", maxq);
 	if (ret < 0)
@@ -607,8 +917,17 @@ EXPORT_SYMBOL_GPL(maxq_init);
 
 void maxq_remove(struct max77759_maxq *maxq)
 {
+	/* no new requests, queued requests complete with -ENODEV */
+	mutex_lock(&maxq->queue_lock);
+	maxq->removing = true;
+	mutex_unlock(&maxq->queue_lock);
+
 	maxq->init_done = false;
-	logbuffer_unregister(maxq->log);
+	flush_workqueue(maxq->wq);
+	destroy_workqueue(maxq->wq);
+	debugfs_remove_recursive(maxq->de);
+	if (maxq->log)
+		logbuffer_unregister(maxq->log);
 }
 EXPORT_SYMBOL_GPL(maxq_remove);
 MODULE_AUTHOR("Badhri Jagan Sridharan <badhri@google.com>");
@@ -6,9 +6,35 @@
  *
  */
 
+#include <linux/ktime.h>
+#include <linux/list.h>
+
+#define MAXQ_REQUEST_MAX_LEN	33
+
+/*
+ * Asynchronous MAXQ request, the request number is assigned on submit and
+ * complete() is called once the response is in response.
+ */
+struct maxq_request {
+	struct list_head node;
+	u8 request[MAXQ_REQUEST_MAX_LEN];
+	u8 request_len;
+	u8 *response;
+	u8 response_len;
+
+	unsigned int req_no;
+	ktime_t queued;
+	int ret;
+
+	void (*complete)(struct maxq_request *req, void *data);
+	void *data;
+};
+
 #if IS_ENABLED(CONFIG_MAXQ_MAX77759)
 
 struct max77759_maxq;
+extern int maxq_submit_request(struct max77759_maxq *maxq,
+			       struct maxq_request *req);
 extern struct max77759_maxq *maxq_init(struct device *dev,
 				       struct regmap *regmap,
 				       bool poll);
@@ -25,6 +51,12 @@ extern int maxq_gpio_control_write(struct max77759_maxq *maxq, u8 gpio);
 extern int maxq_gpio_trigger_read(struct max77759_maxq *maxq, u8 gpio, bool *trigger_falling);
 extern int maxq_gpio_trigger_write(struct max77759_maxq *maxq, u8 gpio, bool trigger_falling);
 # else
+static inline int maxq_submit_request(struct max77759_maxq *maxq,
+				      struct maxq_request *req)
+{
+	return -EINVAL;
+}
+
 static inline int maxq_gpio_trigger_read(struct max77759_maxq *maxq, u8 gpio, bool *trigger_falling)
 {
 	return -EINVAL;
@@ -127,6 +127,7 @@ int max_m5_reg_write(struct i2c_client *client, unsigned int reg,
 	if (!m5_data || !m5_data->regmap)
 		return -ENODEV;
 
+	max17x0x_regcache_drop(m5_data->regmap->regcache, reg, 1);
 	return regmap_write(m5_data->regmap->regmap, reg, val);
 }
 EXPORT_SYMBOL_GPL(max_m5_reg_write);
@@ -414,6 +415,7 @@ int max_m5_reset_state_data(struct max_m5_data *m5_data)
 	int ret = 0;
 
 	memset(&data, 0xff, sizeof(data));
+	m5_data->model_save_valid = false;
 
 	ret = gbms_storage_write(GBMS_TAG_GMSR, &data, sizeof(data));
 	if (ret < 0)
@@ -455,11 +457,21 @@ static int max_m5_period2caplsb(u16 taskperiod)
 	return cap_lsb;
 }
 
-/* 0 is ok */
-int max_m5_load_gauge_model(struct max_m5_data *m5_data)
+/* check FStat.DNR to wait it clear for data ready */
+bool max_m5_model_data_ready(struct max_m5_data *m5_data)
+{
+	u16 data;
+	int ret;
+
+	ret = REGMAP_READ(m5_data->regmap, MAX_M5_FSTAT, &data);
+	return ret == 0 && !(data & MAX_M5_FSTAT_DNR);
+}
+
+/* 0 is ok, caller polls max_m5_load_gauge_model_done() */
+int max_m5_load_gauge_model_start(struct max_m5_data *m5_data)
 {
 	struct max17x0x_regmap *regmap = m5_data->regmap;
-	int ret, retries;
+	int ret;
 	u16 data;
 
 	if (!regmap)
@@ -468,15 +480,6 @@ int max_m5_load_gauge_model(struct max_m5_data *m5_data)
 	if (!m5_data || !m5_data->custom_model || !m5_data->custom_model_size)
 		return -ENODATA;
 
-	/* check FStat.DNR to wait it clear for data ready */
-	for (retries = 20; retries > 0; retries--) {
-		ret = REGMAP_READ(regmap, MAX_M5_FSTAT, &data);
-		if (ret == 0 && !(data & MAX_M5_FSTAT_DNR))
-			break;
-		msleep(50);
-	}
-	dev_info(m5_data->dev, "retries:%d, FSTAT:%#x\n", retries, data);
-
 	/* loading in progress, this is not good (tm) */
 	ret = REGMAP_READ(regmap, MAX_M5_CONFIG2, &data);
 	if (ret == 0 && (data & MAX_M5_CONFIG2_LDMDL)) {
@@ -539,31 +542,30 @@ int max_m5_load_gauge_model(struct max_m5_data *m5_data)
 		return ret;
 	}
 
-	/* around 400ms for this usually */
-	for (retries = 20; retries > 0; retries--) {
-
-		mdelay(50);
-
-		ret = REGMAP_READ(regmap, MAX_M5_CONFIG2, &data);
-		if (ret == 0 && !(data & MAX_M5_CONFIG2_LDMDL)) {
-			int temp;
-
-			temp = max_m5_model_read_version(m5_data);
-			if (m5_data->model_version == MAX_M5_INVALID_VERSION) {
-				dev_info(m5_data->dev, "No Model Version, Current %x\n",
-					 temp);
-			} else if (temp != m5_data->model_version) {
-				dev_info(m5_data->dev, "Model Version %x, Mismatch %x\n",
-					 m5_data->model_version, temp);
-				return -EINVAL;
-			}
+	return 0;
+}
 
-			return 0;
-		}
+/* around 400ms for this usually, -EINPROGRESS until LDMDL clears */
+int max_m5_load_gauge_model_done(struct max_m5_data *m5_data)
+{
+	int ret, temp;
+	u16 data;
 
+	ret = REGMAP_READ(m5_data->regmap, MAX_M5_CONFIG2, &data);
+	if (ret < 0 || (data & MAX_M5_CONFIG2_LDMDL))
+		return -EINPROGRESS;
+
+	temp = max_m5_model_read_version(m5_data);
+	if (m5_data->model_version == MAX_M5_INVALID_VERSION) {
+		dev_info(m5_data->dev, "No Model Version, Current %x\n",
+			 temp);
+	} else if (temp != m5_data->model_version) {
+		dev_info(m5_data->dev, "Model Version %x, Mismatch %x\n",
+			 m5_data->model_version, temp);
+		return -EINVAL;
 	}
 
-	return -ETIMEDOUT;
+	return 0;
 }
 
 /* algo version is ignored here, check code in max1720x_outliers */
@@ -669,6 +671,8 @@ int max_m5_load_state_data(struct max_m5_data *m5_data)
 	if (crc != m5_data->model_save.crc)
 		return -EINVAL;
 
+	m5_data->model_save_valid = true;
+
 	cp->rcomp0 = m5_data->model_save.rcomp0;
 	cp->tempco = m5_data->model_save.tempco;
 	cp->fullcaprep = m5_data->model_save.fullcaprep;
@@ -685,57 +689,104 @@ int max_m5_load_state_data(struct max_m5_data *m5_data)
 	return 0;
 }
 
-/* save/commit parameters and model state to permanent storage */
+static void max_m5_fill_state_data(struct model_state_save *state,
+				   const struct max_m5_data *m5_data)
+{
+	const struct max_m5_custom_parameters *cp = &m5_data->parameters;
+
+	state->rcomp0 = cp->rcomp0;
+	state->tempco = cp->tempco;
+	state->fullcaprep = cp->fullcaprep;
+	state->fullcapnom = cp->fullcapnom;
+	state->qresidual00 = cp->qresidual00;
+	state->qresidual10 = cp->qresidual10;
+	state->qresidual20 = cp->qresidual20;
+	state->qresidual30 = cp->qresidual30;
+
+	state->cycles = m5_data->cycles;
+	state->cv_mixcap = m5_data->cv_mixcap;
+	state->halftime = m5_data->halftime;
+}
+
+/*
+ * Write the runs of bytes that differ from the last persisted copy, CRC
+ * included. Returns -ENOENT when the provider cannot do partial writes.
+ */
+static int max_m5_write_state_delta(const struct model_state_save *next,
+				    const struct model_state_save *prev)
+{
+	const u8 *now = (const u8 *)next, *was = (const u8 *)prev;
+	const int size = sizeof(*next);
+	int start, end, ret;
+
+	for (start = 0; start < size; start = end) {
+		if (now[start] == was[start]) {
+			end = start + 1;
+			continue;
+		}
+
+		for (end = start + 1; end < size && now[end] != was[end]; end++)
+			;
+
+		ret = gbms_storage_write_data(GBMS_TAG_GMSR, &now[start],
+					      end - start, start);
+		if (ret < 0)
+			return ret;
+		if (ret != end - start)
+			return -ERANGE;
+	}
+
+	return 0;
+}
+
+/*
+ * save/commit parameters and model state to permanent storage.
+ * Only the fields that changed since the last save are written when the
+ * persisted copy is known.
+ */
 int max_m5_save_state_data(struct max_m5_data *m5_data)
 {
-	struct max_m5_custom_parameters *cp = &m5_data->parameters;
-	struct model_state_save rb;
-	int ret = 0;
+	struct model_state_save next, rb;
+	int ret = -ENOENT;
 
-	m5_data->model_save.rcomp0 = cp->rcomp0;
-	m5_data->model_save.tempco = cp->tempco;
-	m5_data->model_save.fullcaprep = cp->fullcaprep;
-	m5_data->model_save.fullcapnom = cp->fullcapnom;
-	m5_data->model_save.qresidual00 = cp->qresidual00;
-	m5_data->model_save.qresidual10 = cp->qresidual10;
-	m5_data->model_save.qresidual20 = cp->qresidual20;
-	m5_data->model_save.qresidual30 = cp->qresidual30;
-
-	m5_data->model_save.cycles = m5_data->cycles;
-	m5_data->model_save.cv_mixcap = m5_data->cv_mixcap;
-	m5_data->model_save.halftime = m5_data->halftime;
-
-	m5_data->model_save.crc = max_m5_data_crc("save",
-				  &m5_data->model_save);
-
-	ret = gbms_storage_write(GBMS_TAG_GMSR,
-				 (const void *)&m5_data->model_save,
-				 sizeof(m5_data->model_save));
-	if (ret < 0)
-		return ret;
+	memset(&next, 0, sizeof(next));
+	max_m5_fill_state_data(&next, m5_data);
+	next.crc = max_m5_data_crc("save", &next);
 
-	if (ret != sizeof(m5_data->model_save))
-		return -ERANGE;
+	if (m5_data->model_save_valid) {
+		if (memcmp(&next, &m5_data->model_save, sizeof(next)) == 0)
+			return 0;
+
+		ret = max_m5_write_state_delta(&next, &m5_data->model_save);
+	}
+
+	/* partial write not supported or not possible */
+	if (ret < 0) {
+		m5_data->model_save_valid = false;
 
-	/* Read back to make sure data all good */
-	ret = gbms_storage_read(GBMS_TAG_GMSR, &rb, sizeof(rb));
+		ret = gbms_storage_write(GBMS_TAG_GMSR, &next, sizeof(next));
+		if (ret < 0)
+			return ret;
+		if (ret != sizeof(next))
+			return -ERANGE;
+	}
+
+	/*
+	 * Read back to make sure data all good. read_data goes to the device,
+	 * read can be served from a RAM copy of the storage.
+	 */
+	ret = gbms_storage_read_data(GBMS_TAG_GMSR, &rb, sizeof(rb), 0);
+	if (ret == -ENOENT)
+		ret = gbms_storage_read(GBMS_TAG_GMSR, &rb, sizeof(rb));
 	if (ret < 0) {
 		dev_info(m5_data->dev, "Read Back Data Failed ret=%d\n", ret);
+		m5_data->model_save_valid = false;
 		return ret;
 	}
 
-	if (rb.rcomp0 != m5_data->model_save.rcomp0 ||
-	    rb.tempco != m5_data->model_save.tempco ||
-	    rb.fullcaprep != m5_data->model_save.fullcaprep ||
-	    rb.fullcapnom != m5_data->model_save.fullcapnom ||
-	    rb.qresidual00 != m5_data->model_save.qresidual00 ||
-	    rb.qresidual10 != m5_data->model_save.qresidual10 ||
-	    rb.qresidual20 != m5_data->model_save.qresidual20 ||
-	    rb.qresidual30 != m5_data->model_save.qresidual30 ||
-	    rb.cycles != m5_data->model_save.cycles ||
-	    rb.cv_mixcap != m5_data->model_save.cv_mixcap ||
-	    rb.halftime != m5_data->model_save.halftime ||
-	    rb.crc != m5_data->model_save.crc)
+	m5_data->model_save = next;
+	m5_data->model_save_valid = memcmp(&rb, &next, sizeof(rb)) == 0;
+	if (!m5_data->model_save_valid)
 		return -EINVAL;
 
 	return 0;
@@ -763,50 +814,53 @@ int max_m5_model_check_state(struct max_m5_data *m5_data)
 	return 0;
 }
 
+/* state registers are read with two bulk transfers */
+#define MAX_M5_STATE_BLK0_START	MAX_M5_QRTABLE00
+#define MAX_M5_STATE_BLK0_END	MAX_M5_QRTABLE30
+#define MAX_M5_STATE_BLK0_LEN	(MAX_M5_STATE_BLK0_END - MAX_M5_STATE_BLK0_START + 1)
+#define MAX_M5_STATE_BLK0(data, reg)	(data)[(reg) - MAX_M5_STATE_BLK0_START]
+
 /*
  * read fuel gauge state to parameters/model state.
  * NOTE: Called on boot if POR is not set or during save state.
  */
 int max_m5_model_read_state(struct max_m5_data *m5_data)
 {
-	int rc;
+	struct max_m5_custom_parameters *cp = &m5_data->parameters;
 	struct max17x0x_regmap *regmap = m5_data->regmap;
+	u16 blk0[MAX_M5_STATE_BLK0_LEN], blk1[2];
+	int rc;
 
-	rc= REGMAP_READ(regmap, MAX_M5_RCOMP0, &m5_data->parameters.rcomp0);
-	if (rc == 0)
-		rc = REGMAP_READ(regmap, MAX_M5_TEMPCO,
-				 &m5_data->parameters.tempco);
-	if (rc == 0)
-		rc = REGMAP_READ(regmap, MAX_M5_FULLCAPREP,
-				 &m5_data->parameters.fullcaprep);
-	if (rc == 0)
-		rc = REGMAP_READ(regmap, MAX_M5_CYCLES, &m5_data->cycles);
-	if (rc == 0)
-		rc = REGMAP_READ(regmap, MAX_M5_FULLCAPNOM,
-				 &m5_data->parameters.fullcapnom);
-	if (rc == 0)
-		rc = REGMAP_READ(regmap, MAX_M5_QRTABLE00,
-				 &m5_data->parameters.qresidual00);
-	if (rc == 0)
-		rc = REGMAP_READ(regmap, MAX_M5_QRTABLE10,
-				 &m5_data->parameters.qresidual10);
-	if (rc == 0)
-		rc = REGMAP_READ(regmap, MAX_M5_QRTABLE20,
-				 &m5_data->parameters.qresidual20);
-	if (rc == 0)
-		rc = REGMAP_READ(regmap, MAX_M5_QRTABLE30,
-				 &m5_data->parameters.qresidual30);
-	if (rc == 0)
-		rc = REGMAP_READ(regmap, MAX_M5_CV_MIXCAP,
-				 &m5_data->cv_mixcap);
-	if (rc == 0)
-		rc = REGMAP_READ(regmap, MAX_M5_CV_HALFTIME,
-				 &m5_data->halftime);
+	if (!regmap || !regmap->regmap)
+		return -EIO;
+
+	/* 0x12 ... 0x42, all readable and none clear on read */
+	rc = regmap_raw_read(regmap->regmap, MAX_M5_STATE_BLK0_START, blk0,
+			     sizeof(blk0));
 	if (rc == 0)
-		rc = REGMAP_READ(regmap, MAX_M5_CGAIN,
-				 &m5_data->parameters.cgain);
+		rc = regmap_raw_read(regmap->regmap, MAX_M5_CV_MIXCAP, blk1,
+				     sizeof(blk1));
+	if (rc < 0) {
+		dev_err(m5_data->dev, "cannot read model state (%d)\n", rc);
+		return rc;
+	}
 
-	return rc;
+	cp->rcomp0 = MAX_M5_STATE_BLK0(blk0, MAX_M5_RCOMP0);
+	cp->tempco = MAX_M5_STATE_BLK0(blk0, MAX_M5_TEMPCO);
+	cp->fullcaprep = MAX_M5_STATE_BLK0(blk0, MAX_M5_FULLCAPREP);
+	m5_data->cycles = MAX_M5_STATE_BLK0(blk0, MAX_M5_CYCLES);
+	cp->fullcapnom = MAX_M5_STATE_BLK0(blk0, MAX_M5_FULLCAPNOM);
+	cp->qresidual00 = MAX_M5_STATE_BLK0(blk0, MAX_M5_QRTABLE00);
+	cp->qresidual10 = MAX_M5_STATE_BLK0(blk0, MAX_M5_QRTABLE10);
+	cp->qresidual20 = MAX_M5_STATE_BLK0(blk0, MAX_M5_QRTABLE20);
+	cp->qresidual30 = MAX_M5_STATE_BLK0(blk0, MAX_M5_QRTABLE30);
+	cp->cgain = MAX_M5_STATE_BLK0(blk0, MAX_M5_CGAIN);
+
+	/* MAX_M5_CV_HALFTIME follows MAX_M5_CV_MIXCAP */
+	m5_data->cv_mixcap = blk1[0];
+	m5_data->halftime = blk1[1];
+
+	return 0;
 }
 
 ssize_t max_m5_model_state_cstr(char *buf, int max,
@@ -118,8 +118,9 @@ struct max_m5_data {
 	u32 model_version;
 	bool force_reset_model_data;
 
-	/* to/from GMSR */
+	/* to/from GMSR, last copy persisted when model_save_valid */
 	struct model_state_save model_save;
+	bool model_save_valid;
 };
 
 /** ------------------------------------------------------------------------ */
@@ -181,8 +182,18 @@ int max_m5_save_state_data(struct max_m5_data *m5_data);
 int max_m5_model_read_state(struct max_m5_data *m5_data);
 int max_m5_model_check_state(struct max_m5_data *m5_data);
 
-/* load model to gauge */
-int max_m5_load_gauge_model(struct max_m5_data *m5_data);
+/*
+ * load model to gauge, non blocking. Poll max_m5_model_data_ready() until
+ * true (or give up), then max_m5_load_gauge_model_start() and poll
+ * max_m5_load_gauge_model_done() every MAX_M5_MODEL_LOAD_POLL_MS until it
+ * stops returning -EINPROGRESS.
+ */
+#define MAX_M5_MODEL_LOAD_POLL_MS	50
+#define MAX_M5_MODEL_LOAD_POLL_MAX	20
+
+bool max_m5_model_data_ready(struct max_m5_data *m5_data);
+int max_m5_load_gauge_model_start(struct max_m5_data *m5_data);
+int max_m5_load_gauge_model_done(struct max_m5_data *m5_data);
 
 int max_m5_fixup_outliers(struct max1720x_drift_data *ddata,
 			  struct max_m5_data *m5_data);
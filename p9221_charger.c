@@ -20,6 +20,8 @@
 #include <linux/kernel.h>
 #include <linux/delay.h>
 #include <linux/alarmtimer.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
 #include "p9221_charger.h"
 #include "p9221-dt-bindings.h"
 #include "google_dc_pps.h"
@@ -379,7 +381,12 @@ no_fod:
 
 #define CC_DATA_LOCK_MS		250
 
-static int p9221_send_data(struct p9221_charger_data *charger)
+/*
+ * buf is copied to the chip before returning. The sysfs path stages the
+ * data in tx_buf, /dev/p9221_comms passes its own ring slot.
+ */
+static int p9221_send_data_buf(struct p9221_charger_data *charger,
+			       const u8 *buf, size_t len)
 {
 	int ret;
 	ktime_t now = get_boot_msec();
@@ -399,13 +406,13 @@ static int p9221_send_data(struct p9221_charger_data *charger)
 
 	mutex_lock(&charger->cmd_lock);
 
-	ret = charger->chip_set_data_buf(charger, charger->tx_buf, charger->tx_len);
+	ret = charger->chip_set_data_buf(charger, buf, len);
 	if (ret) {
 		dev_err(&charger->client->dev, "Failed to load tx %d\n", ret);
 		goto error;
 	}
 
-	ret = charger->chip_set_cc_send_size(charger, charger->tx_len);
+	ret = charger->chip_set_cc_send_size(charger, len);
 	if (ret) {
 		dev_err(&charger->client->dev, "Failed to load txsz %d\n", ret);
 		goto error;
@@ -424,6 +431,11 @@ error:
 	return ret;
 }
 
+static int p9221_send_data(struct p9221_charger_data *charger)
+{
+	return p9221_send_data_buf(charger, charger->tx_buf, charger->tx_len);
+}
+
 static int p9221_send_ccreset(struct p9221_charger_data *charger);
 
 /* call with lock on mutex_lock(&charger->stats_lock) */
@@ -515,6 +527,488 @@ static int p9221_send_ccreset(struct p9221_charger_data *charger)
 	return charger->chip_send_ccreset(charger);
 }
 
+/*
+ * In-band communication queue.
+ * Slots are reserved with p9221_comms_slot() and published with
+ * p9221_comms_commit() by the producer, read with p9221_comms_peek() and
+ * released with p9221_comms_pop() by the consumer. head and tail are free
+ * running, the ring is full when they are slots apart.
+ */
+static u8 *p9221_comms_slot(struct p9221_comms_ring *ring)
+{
+	const unsigned int head = ring->head;
+	const unsigned int tail = smp_load_acquire(&ring->tail);
+
+	if (head - tail >= ring->slots)
+		return NULL;
+
+	return &ring->data[(head & (ring->slots - 1)) * ring->slot_size];
+}
+
+static void p9221_comms_commit(struct p9221_comms_ring *ring, size_t len)
+{
+	const unsigned int head = ring->head;
+
+	ring->len[head & (ring->slots - 1)] = len;
+	smp_store_release(&ring->head, head + 1);
+}
+
+static const u8 *p9221_comms_peek(struct p9221_comms_ring *ring, size_t *len)
+{
+	const unsigned int tail = ring->tail;
+	const unsigned int head = smp_load_acquire(&ring->head);
+	const unsigned int slot = tail & (ring->slots - 1);
+
+	if (head == tail)
+		return NULL;
+
+	*len = ring->len[slot];
+	return &ring->data[slot * ring->slot_size];
+}
+
+static void p9221_comms_pop(struct p9221_comms_ring *ring)
+{
+	smp_store_release(&ring->tail, ring->tail + 1);
+}
+
+static bool p9221_comms_empty(const struct p9221_comms_ring *ring)
+{
+	return READ_ONCE(ring->head) == READ_ONCE(ring->tail);
+}
+
+static bool p9221_comms_full(const struct p9221_comms_ring *ring)
+{
+	return READ_ONCE(ring->head) - READ_ONCE(ring->tail) >= ring->slots;
+}
+
+/* called from the IRQ thread, newest packets are dropped on overflow */
+static void p9221_comms_rx_push(struct p9221_charger_data *charger,
+				const u8 *buf, size_t len)
+{
+	struct p9221_comms *comms = &charger->comms;
+	u8 *slot;
+
+	if (!comms->added)
+		return;
+
+	slot = p9221_comms_slot(&comms->rx);
+	if (!slot) {
+		comms->rx_dropped++;
+		dev_warn_ratelimited(&charger->client->dev,
+				     "comms: rx ring full, dropped=%u\n",
+				     comms->rx_dropped);
+		return;
+	}
+
+	memcpy(slot, buf, len);
+	p9221_comms_commit(&comms->rx, len);
+	wake_up_interruptible(&comms->ref->wq);
+}
+
+/*
+ * Send the oldest queued packet when the channel is idle. Called when a
+ * packet is queued and when the previous transfer completes or times out.
+ */
+static void p9221_comms_tx_kick(struct p9221_charger_data *charger)
+{
+	struct p9221_comms *comms = &charger->comms;
+	const u8 *pkt;
+	size_t len;
+	int ret;
+
+	mutex_lock(&comms->send_lock);
+	if (comms->tx_inflight || !charger->online)
+		goto unlock;
+
+	pkt = p9221_comms_peek(&comms->tx, &len);
+	if (!pkt)
+		goto unlock;
+
+	/* tx_buf belongs to the sysfs txdata/txlen path, send from the slot */
+	ret = set_renego_state(charger, P9XXX_SEND_DATA);
+	if (ret == 0) {
+		charger->tx_done = false;
+		ret = p9221_send_data_buf(charger, pkt, len);
+		if (ret) {
+			charger->tx_done = true;
+			set_renego_state(charger, P9XXX_AVAILABLE);
+		}
+	}
+
+	if (ret) {
+		/* RX restarts the queue when waiting for the other side */
+		if (!charger->cc_data_lock.cc_use ||
+		    charger->cc_data_lock.cc_rcv_at != 0)
+			mod_delayed_work(system_wq, &comms->tx_work,
+				msecs_to_jiffies(P9221_COMMS_RETRY_MS));
+		goto unlock;
+	}
+
+	comms->tx_inflight = true;
+	p9221_comms_pop(&comms->tx);
+	wake_up_interruptible(&comms->ref->wq);
+
+	mod_delayed_work(system_wq, &charger->tx_work,
+			 msecs_to_jiffies(P9221_TX_TIMEOUT_MS));
+unlock:
+	mutex_unlock(&comms->send_lock);
+}
+
+static void p9221_comms_tx_done(struct p9221_charger_data *charger)
+{
+	struct p9221_comms *comms = &charger->comms;
+
+	if (!comms->added)
+		return;
+
+	mutex_lock(&comms->send_lock);
+	comms->tx_inflight = false;
+	mutex_unlock(&comms->send_lock);
+
+	p9221_comms_tx_kick(charger);
+}
+
+static void p9221_comms_tx_work(struct work_struct *work)
+{
+	struct p9221_charger_data *charger = container_of(work,
+			struct p9221_charger_data, comms.tx_work.work);
+
+	p9221_comms_tx_kick(charger);
+}
+
+/* drop everything queued, wake up waiters so they can see offline */
+static void p9221_comms_flush(struct p9221_charger_data *charger)
+{
+	struct p9221_comms *comms = &charger->comms;
+
+	if (!comms->added)
+		return;
+
+	cancel_delayed_work(&comms->tx_work);
+
+	mutex_lock(&comms->read_lock);
+	smp_store_release(&comms->rx.tail, READ_ONCE(comms->rx.head));
+	mutex_unlock(&comms->read_lock);
+
+	mutex_lock(&comms->send_lock);
+	smp_store_release(&comms->tx.tail, READ_ONCE(comms->tx.head));
+	comms->tx_inflight = false;
+	mutex_unlock(&comms->send_lock);
+
+	wake_up_interruptible(&comms->ref->wq);
+}
+
+static void p9221_comms_ref_free(struct kref *kref)
+{
+	kfree(container_of(kref, struct p9221_comms_ref, kref));
+}
+
+/* charger stays valid until p9221_comms_put(), NULL after remove() */
+static struct p9221_charger_data *p9221_comms_get(struct file *file)
+{
+	struct p9221_comms_ref *ref = file->private_data;
+
+	down_read(&ref->sem);
+	if (!ref->dead)
+		return ref->charger;
+
+	up_read(&ref->sem);
+	return NULL;
+}
+
+static void p9221_comms_put(struct file *file)
+{
+	struct p9221_comms_ref *ref = file->private_data;
+
+	up_read(&ref->sem);
+}
+
+static int p9221_comms_open(struct inode *inode, struct file *file)
+{
+	struct p9221_charger_data *charger =
+		container_of(inode->i_cdev, struct p9221_charger_data,
+			     comms.cdev);
+	struct p9221_comms_ref *ref = charger->comms.ref;
+
+	down_read(&ref->sem);
+	if (ref->dead) {
+		up_read(&ref->sem);
+		return -ENODEV;
+	}
+	kref_get(&ref->kref);
+	up_read(&ref->sem);
+
+	file->private_data = ref;
+	return nonseekable_open(inode, file);
+}
+
+static int p9221_comms_release(struct inode *inode, struct file *file)
+{
+	struct p9221_comms_ref *ref = file->private_data;
+
+	kref_put(&ref->kref, p9221_comms_ref_free);
+	return 0;
+}
+
+/* one packet per read(), the packet stays queued when count is too small */
+static ssize_t p9221_comms_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct p9221_charger_data *charger;
+	struct p9221_comms_ref *ref;
+	struct p9221_comms *comms;
+	const u8 *pkt;
+	size_t len;
+	int ret;
+
+	charger = p9221_comms_get(file);
+	if (!charger)
+		return -ENODEV;
+
+	comms = &charger->comms;
+	ref = comms->ref;
+
+	mutex_lock(&comms->read_lock);
+	while (!(pkt = p9221_comms_peek(&comms->rx, &len))) {
+		mutex_unlock(&comms->read_lock);
+
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto done;
+		}
+
+		ret = wait_event_interruptible(ref->wq,
+					READ_ONCE(ref->dead) ||
+					!p9221_comms_empty(&comms->rx));
+		if (ret < 0)
+			goto done;
+		if (READ_ONCE(ref->dead)) {
+			ret = -ENODEV;
+			goto done;
+		}
+
+		mutex_lock(&comms->read_lock);
+	}
+
+	if (count < len) {
+		ret = -EMSGSIZE;
+	} else if (copy_to_user(buf, pkt, len)) {
+		ret = -EFAULT;
+	} else {
+		p9221_comms_pop(&comms->rx);
+		ret = len;
+	}
+
+	mutex_unlock(&comms->read_lock);
+done:
+	p9221_comms_put(file);
+	return ret;
+}
+
+/* one packet per write(), sent in order on the CC channel */
+static ssize_t p9221_comms_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct p9221_charger_data *charger;
+	struct p9221_comms_ref *ref;
+	struct p9221_comms *comms;
+	u8 *slot = NULL;
+	int ret;
+
+	charger = p9221_comms_get(file);
+	if (!charger)
+		return -ENODEV;
+
+	comms = &charger->comms;
+	ref = comms->ref;
+
+	if (count == 0 || count > comms->tx.slot_size) {
+		ret = -EINVAL;
+		goto done;
+	}
+
+	mutex_lock(&comms->write_lock);
+	while (charger->online && !(slot = p9221_comms_slot(&comms->tx))) {
+		mutex_unlock(&comms->write_lock);
+
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto done;
+		}
+
+		ret = wait_event_interruptible(ref->wq,
+					READ_ONCE(ref->dead) ||
+					!charger->online ||
+					!p9221_comms_full(&comms->tx));
+		if (ret < 0)
+			goto done;
+
+		mutex_lock(&comms->write_lock);
+	}
+
+	if (!charger->online || READ_ONCE(ref->dead)) {
+		ret = -ENODEV;
+	} else if (copy_from_user(slot, buf, count)) {
+		ret = -EFAULT;
+	} else {
+		p9221_comms_commit(&comms->tx, count);
+		ret = count;
+	}
+
+	mutex_unlock(&comms->write_lock);
+
+	if (ret > 0)
+		p9221_comms_tx_kick(charger);
+done:
+	p9221_comms_put(file);
+	return ret;
+}
+
+static __poll_t p9221_comms_poll(struct file *file, poll_table *wait)
+{
+	struct p9221_comms_ref *ref = file->private_data;
+	struct p9221_charger_data *charger;
+	struct p9221_comms *comms;
+	__poll_t mask = 0;
+
+	/* wq lives in ref, the poll table can outlive the charger */
+	poll_wait(file, &ref->wq, wait);
+
+	charger = p9221_comms_get(file);
+	if (!charger)
+		return EPOLLHUP | EPOLLERR;
+
+	comms = &charger->comms;
+	if (!p9221_comms_empty(&comms->rx))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (charger->online && !p9221_comms_full(&comms->tx))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	p9221_comms_put(file);
+	return mask;
+}
+
+static const struct file_operations p9221_comms_fops = {
+	.owner = THIS_MODULE,
+	.open = p9221_comms_open,
+	.release = p9221_comms_release,
+	.read = p9221_comms_read,
+	.write = p9221_comms_write,
+	.poll = p9221_comms_poll,
+	.llseek = no_llseek,
+};
+
+static int p9221_comms_ring_init(struct device *dev,
+				 struct p9221_comms_ring *ring,
+				 unsigned int slots, size_t slot_size)
+{
+	ring->data = devm_kcalloc(dev, slots, slot_size, GFP_KERNEL);
+	ring->len = devm_kcalloc(dev, slots, sizeof(*ring->len), GFP_KERNEL);
+	if (!ring->data || !ring->len)
+		return -ENOMEM;
+
+	ring->slots = slots;
+	ring->slot_size = slot_size;
+	ring->head = ring->tail = 0;
+	return 0;
+}
+
+static void p9221_comms_cleanup(struct p9221_charger_data *charger)
+{
+	struct p9221_comms *comms = &charger->comms;
+	struct p9221_comms_ref *ref = comms->ref;
+
+	/* fail new and sleeping file ops, wait for the running ones to leave */
+	if (ref) {
+		WRITE_ONCE(ref->dead, true);
+		wake_up_interruptible_all(&ref->wq);
+		down_write(&ref->sem);
+		ref->charger = NULL;
+		up_write(&ref->sem);
+	}
+
+	if (comms->added) {
+		comms->added = false;
+		cdev_del(&comms->cdev);
+		cancel_delayed_work_sync(&comms->tx_work);
+	}
+	if (comms->available)
+		device_destroy(comms->class, comms->major);
+	if (comms->class)
+		class_destroy(comms->class);
+	if (comms->major)
+		unregister_chrdev_region(comms->major, 1);
+
+	/* open files keep their own reference */
+	if (ref) {
+		comms->ref = NULL;
+		kref_put(&ref->kref, p9221_comms_ref_free);
+	}
+}
+
+/* rx_buf_size and tx_buf_size are set by p9221_chip_init_funcs() */
+static int p9221_comms_init(struct p9221_charger_data *charger)
+{
+	struct p9221_comms *comms = &charger->comms;
+	struct device *dev;
+	int ret;
+
+	mutex_init(&comms->read_lock);
+	mutex_init(&comms->write_lock);
+	mutex_init(&comms->send_lock);
+	INIT_DELAYED_WORK(&comms->tx_work, p9221_comms_tx_work);
+
+	comms->ref = kzalloc(sizeof(*comms->ref), GFP_KERNEL);
+	if (!comms->ref)
+		return -ENOMEM;
+
+	kref_init(&comms->ref->kref);
+	init_rwsem(&comms->ref->sem);
+	init_waitqueue_head(&comms->ref->wq);
+	comms->ref->charger = charger;
+
+	ret = p9221_comms_ring_init(charger->dev, &comms->rx,
+				    P9221_COMMS_RX_SLOTS, charger->rx_buf_size);
+	if (ret == 0)
+		ret = p9221_comms_ring_init(charger->dev, &comms->tx,
+					    P9221_COMMS_TX_SLOTS,
+					    charger->tx_buf_size);
+	if (ret < 0) {
+		p9221_comms_cleanup(charger);
+		return ret;
+	}
+
+	/* cat /proc/devices */
+	if (alloc_chrdev_region(&comms->major, 0, 1,
+				P9221_COMMS_DEVICENAME) < 0) {
+		comms->major = 0;
+		goto no_comms;
+	}
+	/* ls /sys/class */
+	comms->class = class_create(THIS_MODULE, P9221_COMMS_DEVICENAME);
+	if (IS_ERR_OR_NULL(comms->class)) {
+		comms->class = NULL;
+		goto no_comms;
+	}
+	/* ls /dev/ */
+	dev = device_create(comms->class, NULL, comms->major, NULL,
+			    P9221_COMMS_DEVICENAME);
+	if (IS_ERR_OR_NULL(dev))
+		goto no_comms;
+
+	comms->available = true;
+	cdev_init(&comms->cdev, &p9221_comms_fops);
+	if (cdev_add(&comms->cdev, comms->major, 1) < 0)
+		goto no_comms;
+
+	comms->added = true;
+	return 0;
+
+no_comms:
+	p9221_comms_cleanup(charger);
+	return -ENODEV;
+}
+
 
 static void p9221_abort_transfers(struct p9221_charger_data *charger)
 {
@@ -525,6 +1019,7 @@ static void p9221_abort_transfers(struct p9221_charger_data *charger)
 	charger->rx_done = true;
 	charger->rx_len = 0;
 	set_renego_state(charger, P9XXX_AVAILABLE);
+	p9221_comms_flush(charger);
 	sysfs_notify(&charger->dev->kobj, NULL, "txbusy");
 	sysfs_notify(&charger->dev->kobj, NULL, "txdone");
 	sysfs_notify(&charger->dev->kobj, NULL, "rxdone");
@@ -933,6 +1428,7 @@ static void p9221_tx_work(struct work_struct *work)
 	charger->tx_done = true;
 	sysfs_notify(&charger->dev->kobj, NULL, "txbusy");
 	sysfs_notify(&charger->dev->kobj, NULL, "txdone");
+	p9221_comms_tx_done(charger);
 }
 
 static void p9221_vrect_timer_handler(struct timer_list *t)
@@ -5473,30 +5969,17 @@ static void p9221_irq_handler(struct p9221_charger_data *charger, u16 irq_src)
 	if (irq_src & charger->ints.stat_limit_mask)
 		p9221_over_handle(charger, irq_src);
 
-	/* Receive complete */
+	/* Receive complete, data was read in p9221_irq_cc_rx() */
 	if (irq_src & charger->ints.cc_data_rcvd_bit) {
-		size_t rxlen = 0;
-
-		res = charger->chip_get_cc_recv_size(charger, &rxlen);
-		if (res) {
-			dev_err(&charger->client->dev,
-				"Failed to read len: %d\n", res);
-			rxlen = 0;
-		}
-		if (rxlen) {
-			res = charger->chip_get_data_buf(charger,
-							 charger->rx_buf,
-							 rxlen);
-			if (res)
-				dev_err(&charger->client->dev,
-					"Failed to read len: %d\n", res);
+		charger->rx_done = true;
+		charger->cc_data_lock.cc_rcv_at = get_boot_msec();
+		set_renego_state(charger, P9XXX_AVAILABLE);
+		sysfs_notify(&charger->dev->kobj, NULL, "rxdone");
 
-			charger->rx_len = rxlen;
-			charger->rx_done = true;
-			charger->cc_data_lock.cc_rcv_at = get_boot_msec();
-			set_renego_state(charger, P9XXX_AVAILABLE);
-			sysfs_notify(&charger->dev->kobj, NULL, "rxdone");
-		}
+		/* the other side answered, the queue can restart */
+		if (!p9221_comms_empty(&charger->comms.tx))
+			mod_delayed_work(system_wq, &charger->comms.tx_work,
+					 msecs_to_jiffies(CC_DATA_LOCK_MS));
 	}
 
 	/* Send complete */
@@ -5513,6 +5996,7 @@ static void p9221_irq_handler(struct p9221_charger_data *charger, u16 irq_src)
 		cancel_delayed_work(&charger->tx_work);
 		sysfs_notify(&charger->dev->kobj, NULL, "txbusy");
 		sysfs_notify(&charger->dev->kobj, NULL, "txdone");
+		p9221_comms_tx_done(charger);
 	}
 
 	/* Proprietary packet */
@@ -5535,18 +6019,166 @@ static void p9221_irq_handler(struct p9221_charger_data *charger, u16 irq_src)
 	}
 }
 
-#define IRQ_DEBOUNCE_TIME_MS		4
+/*
+ * Read a CC packet from the IRQ thread before INT is cleared and queue it
+ * to comms: packets received while irq_work is pending are not lost when
+ * the events coalesce. Return false when there is no data.
+ */
+static bool p9221_irq_cc_rx(struct p9221_charger_data *charger)
+{
+	size_t rxlen = 0;
+	int res;
+
+	res = charger->chip_get_cc_recv_size(charger, &rxlen);
+	if (res) {
+		dev_err(&charger->client->dev, "Failed to read len: %d\n", res);
+		rxlen = 0;
+	}
+	if (!rxlen)
+		return false;
+
+	res = charger->chip_get_data_buf(charger, charger->rx_buf, rxlen);
+	if (res)
+		dev_err(&charger->client->dev, "Failed to read len: %d\n", res);
+
+	charger->rx_len = rxlen;
+	if (!res)
+		p9221_comms_rx_push(charger, charger->rx_buf, rxlen);
+
+	return true;
+}
+
+/*
+ * The IRQ thread reads and clears INT (and reads CC data), events are
+ * OR-ed into a pending mask and handled in irq_work. Events latched while
+ * irq_work is pending are coalesced and handled in one pass.
+ */
+static void p9221_irq_latch(struct p9221_charger_data *charger, u16 irq_src,
+			    bool rtx)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&charger->irq_lock, flags);
+	if (!charger->irq_pending && !charger->irq_pending_rtx)
+		charger->irq_latched_at = ktime_get();
+	/* only the last packet is in rx_buf, all of them are in comms */
+	if (!rtx && (charger->irq_pending & irq_src &
+		     charger->ints.cc_data_rcvd_bit))
+		charger->irq_stats.cc_coalesced++;
+	if (rtx)
+		charger->irq_pending_rtx |= irq_src;
+	else
+		charger->irq_pending |= irq_src;
+	charger->irq_stats.latched++;
+	__pm_stay_awake(charger->irq_ws);
+	spin_unlock_irqrestore(&charger->irq_lock, flags);
+
+	queue_work(charger->irq_wq, &charger->irq_work);
+}
+
+static void p9221_irq_stats_update(struct p9221_charger_data *charger,
+				   u16 irq_src, ktime_t latched_at)
+{
+	struct p9221_irq_stats *stats = &charger->irq_stats;
+	const u32 lat_us = ktime_us_delta(ktime_get(), latched_at);
+	unsigned long bits = irq_src;
+	int i;
+
+	for_each_set_bit(i, &bits, ARRAY_SIZE(stats->count))
+		stats->count[i]++;
+
+	stats->handled++;
+	stats->lat_sum_us += lat_us;
+	if (lat_us > stats->lat_max_us)
+		stats->lat_max_us = lat_us;
+}
+
+/*
+ * Handle the coalesced events: RTX first, then VRECTON (online detection),
+ * then p9221_irq_handler() which runs protection limits before the CC and
+ * PP traffic and CC reset after them.
+ */
+static void p9221_irq_work(struct work_struct *work)
+{
+	struct p9221_charger_data *charger =
+		container_of(work, struct p9221_charger_data, irq_work);
+	u16 irq_src, irq_src_rtx;
+	ktime_t latched_at;
+	unsigned long flags;
+
+	spin_lock_irqsave(&charger->irq_lock, flags);
+	irq_src = charger->irq_pending;
+	irq_src_rtx = charger->irq_pending_rtx;
+	latched_at = charger->irq_latched_at;
+	charger->irq_pending = 0;
+	charger->irq_pending_rtx = 0;
+	spin_unlock_irqrestore(&charger->irq_lock, flags);
+
+	if (irq_src_rtx)
+		rtx_irq_handler(charger, irq_src_rtx);
+
+	if (irq_src & charger->ints.vrecton_bit) {
+		dev_info(&charger->client->dev,
+			"Received VRECTON, online=%d\n", charger->online);
+		if (!charger->online) {
+			charger->check_det = true;
+			pm_stay_awake(charger->dev);
+
+			if (!schedule_delayed_work(&charger->notifier_work,
+				msecs_to_jiffies(P9221_NOTIFIER_DELAY_MS))) {
+				pm_relax(charger->dev);
+			}
+		}
+	}
+
+	if (irq_src)
+		p9221_irq_handler(charger, irq_src);
+
+	if (irq_src | irq_src_rtx)
+		p9221_irq_stats_update(charger, irq_src | irq_src_rtx,
+				       latched_at);
+
+	/* keep the device awake when more events were latched meanwhile */
+	spin_lock_irqsave(&charger->irq_lock, flags);
+	if (!charger->irq_pending && !charger->irq_pending_rtx)
+		__pm_relax(charger->irq_ws);
+	spin_unlock_irqrestore(&charger->irq_lock, flags);
+}
+
+static void p9221_irq_wq_destroy(void *data)
+{
+	destroy_workqueue(data);
+}
+
+static int p9221_irq_stats_show(struct seq_file *s, void *unused)
+{
+	struct p9221_charger_data *charger = s->private;
+	struct p9221_irq_stats *stats = &charger->irq_stats;
+	int i;
+
+	seq_printf(s, "latched=%u handled=%u lat_max_us=%u lat_avg_us=%llu\n",
+		   stats->latched, stats->handled, stats->lat_max_us,
+		   stats->handled ? div_u64(stats->lat_sum_us, stats->handled) : 0);
+	seq_printf(s, "cc_coalesced=%u rx_dropped=%u\n", stats->cc_coalesced,
+		   charger->comms.rx_dropped);
+
+	for (i = 0; i < ARRAY_SIZE(stats->count); i++)
+		if (stats->count[i])
+			seq_printf(s, "bit%02d: %u\n", i, stats->count[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(p9221_irq_stats);
+
+/*
+ * Level triggered: INT is always read and cleared here, returning early with
+ * the line asserted would re-fire the interrupt right away.
+ */
 static irqreturn_t p9221_irq_thread(int irq, void *irq_data)
 {
 	struct p9221_charger_data *charger = irq_data;
 	int ret;
-	u16 irq_src = 0;
-	ktime_t now = get_boot_msec();
-
-	if ((now - charger->irq_at) < IRQ_DEBOUNCE_TIME_MS)
-		return IRQ_HANDLED;
-
-	charger->irq_at = now;
+	u16 irq_src = 0, irq_latch;
 
 	pm_runtime_get_sync(charger->dev);
 	if (!charger->resume_complete) {
@@ -5576,6 +6208,11 @@ static irqreturn_t p9221_irq_thread(int irq, void *irq_data)
 	if (!irq_src)
 		goto out;
 
+	irq_latch = irq_src;
+	if (!charger->ben_state && (irq_src & charger->ints.cc_data_rcvd_bit) &&
+	    !p9221_irq_cc_rx(charger))
+		irq_latch &= ~charger->ints.cc_data_rcvd_bit;
+
 	ret = p9221_clear_interrupts(charger, irq_src);
 	if (ret) {
 		dev_err(&charger->client->dev,
@@ -5584,26 +6221,11 @@ static irqreturn_t p9221_irq_thread(int irq, void *irq_data)
 	}
 
 	/* todo interrupt handling for rx */
-	if (charger->ben_state) {
+	if (charger->ben_state)
 		logbuffer_log(charger->rtx_log, "INT=%04x", irq_src);
-		rtx_irq_handler(charger, irq_src);
-		goto out;
-	}
 
-	if (irq_src & charger->ints.vrecton_bit) {
-		dev_info(&charger->client->dev,
-			"Received VRECTON, online=%d\n", charger->online);
-		if (!charger->online) {
-			charger->check_det = true;
-			pm_stay_awake(charger->dev);
-
-			if (!schedule_delayed_work(&charger->notifier_work,
-				msecs_to_jiffies(P9221_NOTIFIER_DELAY_MS))) {
-				pm_relax(charger->dev);
-			}
-		}
-	}
-	p9221_irq_handler(charger, irq_src);
+	if (irq_latch)
+		p9221_irq_latch(charger, irq_latch, charger->ben_state);
 
 out:
 	return IRQ_HANDLED;
@@ -6352,7 +6974,6 @@ static int p9221_charger_probe(struct i2c_client *client,
 	charger->chip_id = charger->pdata->chip_id;
 	charger->rtx_wakelock = false;
 	charger->last_disable = -1;
-	charger->irq_at = 0;
 	charger->ll_bpp_cep = -EINVAL;
 	mutex_init(&charger->io_lock);
 	mutex_init(&charger->cmd_lock);
@@ -6386,6 +7007,20 @@ static int p9221_charger_probe(struct i2c_client *client,
 	init_waitqueue_head(&charger->ccreset_wq);
 
 	charger->align_ws = wakeup_source_register(NULL, "p9221_align");
+	charger->irq_ws = wakeup_source_register(NULL, "p9221_irq");
+
+	spin_lock_init(&charger->irq_lock);
+	INIT_WORK(&charger->irq_work, p9221_irq_work);
+	charger->irq_wq = alloc_ordered_workqueue("p9221_irq", WQ_HIGHPRI);
+	if (!charger->irq_wq) {
+		dev_err(&client->dev, "Failed to create irq workqueue\n");
+		return -ENOMEM;
+	}
+	/* released after the IRQ */
+	ret = devm_add_action_or_reset(&client->dev, p9221_irq_wq_destroy,
+				       charger->irq_wq);
+	if (ret)
+		return ret;
 
 	/* setup function pointers for platform */
 	/* first from *_charger.c -> *_chip.c */
@@ -6591,6 +7226,11 @@ static int p9221_charger_probe(struct i2c_client *client,
 			dev_info(&client->dev, "rtx sysfs_create_group failed\n");
 	}
 
+	ret = p9221_comms_init(charger);
+	if (ret < 0)
+		dev_err(&client->dev, "Failed to create comms device (%d)\n",
+			ret);
+
 	charger->debug_entry = debugfs_create_dir("p9221_charger", 0);
 	if (IS_ERR_OR_NULL(charger->debug_entry)) {
 		charger->debug_entry = NULL;
@@ -6598,6 +7238,8 @@ static int p9221_charger_probe(struct i2c_client *client,
 	} else {
 		debugfs_create_bool("no_fod", 0644, charger->debug_entry, &charger->no_fod);
 		debugfs_create_u32("de_q_value", 0644, charger->debug_entry, &charger->de_q_value);
+		debugfs_create_file("irq_stats", 0444, charger->debug_entry,
+				    charger, &p9221_irq_stats_fops);
 	}
 
 	/* can independently read battery capacity */
@@ -6668,6 +7310,8 @@ static int p9221_charger_remove(struct i2c_client *client)
 {
 	struct p9221_charger_data *charger = i2c_get_clientdata(client);
 
+	disable_irq(charger->pdata->irq_int);
+	cancel_work_sync(&charger->irq_work);
 	cancel_delayed_work_sync(&charger->dcin_work);
 	cancel_delayed_work_sync(&charger->charge_stats_work);
 	cancel_delayed_work_sync(&charger->tx_work);
@@ -6681,6 +7325,7 @@ static int p9221_charger_remove(struct i2c_client *client)
 	cancel_work_sync(&charger->rtx_disable_work);
 	cancel_work_sync(&charger->rtx_reset_work);
 	cancel_delayed_work_sync(&charger->power_mitigation_work);
+	p9221_comms_cleanup(charger);
 	alarm_try_to_cancel(&charger->icl_ramp_alarm);
 	alarm_try_to_cancel(&charger->auth_dc_icl_alarm);
 	del_timer_sync(&charger->vrect_timer);
@@ -6702,6 +7347,7 @@ static int p9221_charger_remove(struct i2c_client *client)
 		logbuffer_unregister(charger->rtx_log);
 
 	wakeup_source_unregister(charger->align_ws);
+	wakeup_source_unregister(charger->irq_ws);
 	return 0;
 }
 
@@ -18,6 +18,9 @@
 
 #include <linux/gpio.h>
 #include <linux/crc8.h>
+#include <linux/cdev.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
 #include <misc/gvotable.h>
 #include "gbms_power_supply.h"
 
@@ -646,6 +649,66 @@ struct p9221_charger_ints_bit {
 	u16				stat_rtx_mask;
 };
 
+/*
+ * In-band communication queue: packets received on the CC channel and
+ * packets waiting to be sent, exposed through /dev/p9221_comms.
+ * The RX ring has a single producer (the IRQ thread) and a single consumer
+ * (readers serialize on read_lock), the TX ring has a single consumer (the
+ * send path, under send_lock) and writers serialize on write_lock.
+ * Open files hold a reference to p9221_comms_ref, not to the charger: file
+ * operations run with ref->sem held for read and fail once ref->dead is set
+ * so that remove() can wait them out before the charger memory goes away.
+ */
+#define P9221_COMMS_DEVICENAME		"p9221_comms"
+#define P9221_COMMS_RX_SLOTS		8	/* power of 2 */
+#define P9221_COMMS_TX_SLOTS		8	/* power of 2 */
+#define P9221_COMMS_RETRY_MS		250
+
+struct p9221_comms_ring {
+	u8				*data;	/* slots * slot_size */
+	u16				*len;
+	size_t				slot_size;
+	unsigned int			slots;
+	unsigned int			head;	/* written by the producer */
+	unsigned int			tail;	/* written by the consumer */
+};
+
+struct p9221_comms_ref {
+	struct kref			kref;
+	struct rw_semaphore		sem;
+	wait_queue_head_t		wq;
+	bool				dead;
+	struct p9221_charger_data	*charger;
+};
+
+struct p9221_comms {
+	struct p9221_comms_ring		rx;
+	struct p9221_comms_ring		tx;
+	u32				rx_dropped;
+	struct mutex			read_lock;
+	struct mutex			write_lock;
+	struct mutex			send_lock;
+	bool				tx_inflight;
+	struct p9221_comms_ref		*ref;
+	struct delayed_work		tx_work;
+
+	dev_t				major;
+	struct cdev			cdev;
+	struct class			*class;
+	bool				available;
+	bool				added;
+};
+
+/* IRQ events handled by irq_work, exported in debugfs irq_stats */
+struct p9221_irq_stats {
+	u32				count[16];	/* per INT bit */
+	u32				latched;	/* IRQ thread runs */
+	u32				handled;	/* irq_work runs */
+	u32				lat_max_us;	/* latch to handled */
+	u64				lat_sum_us;
+	u32				cc_coalesced;	/* rx_buf overwritten */
+};
+
 struct p9221_charger_data {
 	struct i2c_client		*client;
 	struct p9221_charger_platform_data *pdata;
@@ -768,12 +831,20 @@ struct p9221_charger_data {
 	struct mutex			auth_lock;
 	int 				ll_bpp_cep;
 	int				last_disable;
-	ktime_t				irq_at;
 	int				renego_state;
 	struct mutex			renego_lock;
 	bool				send_eop;
 	wait_queue_head_t		ccreset_wq;
 	bool				cc_reset_pending;
+	struct p9221_comms		comms;
+	spinlock_t			irq_lock;
+	u16				irq_pending;
+	u16				irq_pending_rtx;
+	ktime_t				irq_latched_at;
+	struct workqueue_struct		*irq_wq;
+	struct work_struct		irq_work;
+	struct wakeup_source		*irq_ws;
+	struct p9221_irq_stats		irq_stats;
 	int				send_txid_cnt;
 	bool				sw_ramp_done;
 	bool				hpp_hv;